@@ -0,0 +1,373 @@
+// Бенчмарки подземелья (Google Benchmark):
+//   g++ -std=c++17 -O2 -pthread bench.cpp -lbenchmark -o bench
+//   ./bench                                   - таблица в консоль и JSON в bench.json
+//   ./bench --benchmark_out=base.json         - свой файл для сравнения с базовой версией
+#define DUNGEON_NO_MAIN
+#include "main.cpp"
+
+#include <benchmark/benchmark.h>
+#include <filesystem>
+#include <map>
+#include <random>
+
+// Форма синтетического мира
+enum class WorldShape { UNIFORM, CLUSTERED, TYPE_SKEWED };
+
+static std::vector<NPCRecord> makeWorld(size_t count, WorldShape shape, unsigned seed = 42) {
+    std::mt19937 rng(seed);
+    std::uniform_int_distribution<int> coord(0, 500);
+    std::uniform_int_distribution<int> kind(0, static_cast<int>(NPC_TYPE_COUNT) - 1);
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    std::normal_distribution<double> spread(0.0, 8.0);
+
+    // CLUSTERED: 16 скоплений вокруг случайных центров
+    std::vector<std::pair<int, int>> centers;
+    for (int c = 0; c < 16; ++c) centers.emplace_back(coord(rng), coord(rng));
+    auto clamp = [](double v) { return std::clamp(static_cast<int>(std::lround(v)), 0, 500); };
+
+    std::vector<NPCRecord> world;
+    world.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        NPCRecord record{static_cast<NPCType>(kind(rng)), "npc" + std::to_string(i), coord(rng), coord(rng)};
+        if (shape == WorldShape::CLUSTERED) {
+            const auto& center = centers[i % centers.size()];
+            record.x = clamp(center.first + spread(rng));
+            record.y = clamp(center.second + spread(rng));
+        } else if (shape == WorldShape::TYPE_SKEWED) {
+            // 80% принцесс, 15% драконов, 5% рыцарей
+            double p = unit(rng);
+            record.type = p < 0.80 ? NPCType::PRINCESS : p < 0.95 ? NPCType::DRAGON : NPCType::KNIGHT;
+        }
+        world.push_back(std::move(record));
+    }
+    return world;
+}
+
+// Миры одного размера и формы строятся один раз на весь запуск
+static const std::vector<NPCRecord>& cachedWorld(size_t count, WorldShape shape) {
+    static std::map<std::pair<size_t, int>, std::vector<NPCRecord>> worlds;
+    auto key = std::make_pair(count, static_cast<int>(shape));
+    auto it = worlds.find(key);
+    if (it == worlds.end()) it = worlds.emplace(key, makeWorld(count, shape)).first;
+    return it->second;
+}
+
+static std::unique_ptr<Dungeon> makeDungeon(const std::vector<NPCRecord>& world, StorageMode mode) {
+    auto dungeon = std::make_unique<Dungeon>(mode, false); // без журналов: меряем бой, а не вывод, и log.txt не появляется
+    for (const auto& record : world) {
+        dungeon->addNPC(record.type, record.name, record.x, record.y);
+    }
+    return dungeon;
+}
+
+static std::string tempPath(const std::string& name) {
+    return (std::filesystem::temp_directory_path() / ("dungeon_bench_" + name)).string();
+}
+
+// Аргументы: {число NPC, радиус}. Плотные миры с большим радиусом пропускаются:
+// число пар растёт как n * range^2, и такие прогоны идут часами.
+static void battleArgs(benchmark::internal::Benchmark* b) {
+    for (long long count = 1000; count <= 10000000; count *= 10) {
+        for (long long range : {1, 5, 20}) {
+            if (count * range * range <= 400000000LL) b->Args({count, range});
+        }
+    }
+    b->Unit(benchmark::kMillisecond);
+}
+
+static void sizeArgs(benchmark::internal::Benchmark* b) {
+    b->RangeMultiplier(10)->Range(1000, 10000000)->Unit(benchmark::kMillisecond);
+}
+
+static void BM_Battle(benchmark::State& state, WorldShape shape, StorageMode mode, BattleEngine engine, size_t threads) {
+    const auto& world = cachedWorld(static_cast<size_t>(state.range(0)), shape);
+    const double range = static_cast<double>(state.range(1));
+    Dungeon probe(mode, false);
+    if (!probe.setBattleEngine(engine)) {
+        state.SkipWithError(("GPU недоступен: " + probe.getGpuStatus()).c_str());
+        return;
+    }
+    std::unique_ptr<Dungeon> dungeon;
+    for (auto _ : state) {
+        state.PauseTiming();
+        dungeon.reset();
+        dungeon = makeDungeon(world, mode);
+        dungeon->setBattleEngine(engine);
+        dungeon->setThreads(threads);
+        state.ResumeTiming();
+        dungeon->battle(range);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+static const size_t HARDWARE_THREADS = std::max(1u, std::thread::hardware_concurrency());
+
+BENCHMARK_CAPTURE(BM_Battle, uniform_objects_visitor, WorldShape::UNIFORM, StorageMode::OBJECTS, BattleEngine::VISITOR, 1)->Apply(battleArgs);
+BENCHMARK_CAPTURE(BM_Battle, uniform_objects_table, WorldShape::UNIFORM, StorageMode::OBJECTS, BattleEngine::TABLE, 1)->Apply(battleArgs);
+BENCHMARK_CAPTURE(BM_Battle, uniform_soa_table, WorldShape::UNIFORM, StorageMode::SOA, BattleEngine::TABLE, 1)->Apply(battleArgs);
+BENCHMARK_CAPTURE(BM_Battle, uniform_soa_simd, WorldShape::UNIFORM, StorageMode::SOA, BattleEngine::SIMD, 1)->Apply(battleArgs);
+BENCHMARK_CAPTURE(BM_Battle, uniform_soa_simd_parallel, WorldShape::UNIFORM, StorageMode::SOA, BattleEngine::SIMD, HARDWARE_THREADS)->Apply(battleArgs);
+BENCHMARK_CAPTURE(BM_Battle, uniform_soa_gpu, WorldShape::UNIFORM, StorageMode::SOA, BattleEngine::GPU, 1)->Apply(battleArgs);
+BENCHMARK_CAPTURE(BM_Battle, clustered_soa_simd, WorldShape::CLUSTERED, StorageMode::SOA, BattleEngine::SIMD, 1)->Apply(battleArgs);
+BENCHMARK_CAPTURE(BM_Battle, skewed_soa_simd, WorldShape::TYPE_SKEWED, StorageMode::SOA, BattleEngine::SIMD, 1)->Apply(battleArgs);
+
+// Мир из side x side шардов с той же плотностью NPC на шард: {шардов по стороне, NPC на шард, потоки}
+static void BM_WorldBattle(benchmark::State& state) {
+    const int side = static_cast<int>(state.range(0));
+    const auto& world = cachedWorld(static_cast<size_t>(state.range(1)), WorldShape::UNIFORM);
+    std::unique_ptr<World> shards;
+    for (auto _ : state) {
+        state.PauseTiming();
+        shards.reset();
+        shards = std::make_unique<World>(side, side, StorageMode::SOA, false);
+        shards->setThreads(static_cast<size_t>(state.range(2)));
+        for (int row = 0; row < side; ++row) {
+            for (int col = 0; col < side; ++col) {
+                shards->shard(col, row).addNPCs(world);
+            }
+        }
+        state.ResumeTiming();
+        shards->battle(5);
+    }
+    state.SetItemsProcessed(state.iterations() * side * side * state.range(1));
+}
+BENCHMARK(BM_WorldBattle)
+    ->ArgsProduct({{1, 2, 4}, {10000, 100000}, {1, static_cast<long long>(HARDWARE_THREADS)}})
+    ->Unit(benchmark::kMillisecond);
+
+// Тот же мир 4 x 4, распределённый по узлам-потокам через LocalTransport: {узлов, NPC на шард}
+static void BM_DistributedBattle(benchmark::State& state) {
+    const size_t nodes = static_cast<size_t>(state.range(0));
+    const auto& world = cachedWorld(static_cast<size_t>(state.range(1)), WorldShape::UNIFORM);
+    const int side = 4;
+    for (auto _ : state) {
+        state.PauseTiming();
+        LocalHub hub(nodes);
+        std::vector<std::unique_ptr<LocalTransport>> transports;
+        std::vector<std::unique_ptr<World>> parts;
+        for (size_t rank = 0; rank < nodes; ++rank) {
+            transports.push_back(std::make_unique<LocalTransport>(hub, rank));
+            parts.push_back(std::make_unique<World>(side, side, StorageMode::SOA, *transports.back(), false));
+            for (int row = 0; row < side; ++row) {
+                for (int col = 0; col < side; ++col) {
+                    if (parts.back()->owns(col, row)) parts.back()->shard(col, row).addNPCs(world);
+                }
+            }
+        }
+        state.ResumeTiming();
+        std::vector<std::thread> workers;
+        for (auto& part : parts) workers.emplace_back([&part] { part->battle(5); });
+        for (auto& worker : workers) worker.join();
+    }
+    state.SetItemsProcessed(state.iterations() * side * side * state.range(1));
+}
+BENCHMARK(BM_DistributedBattle)->ArgsProduct({{1, 2, 4}, {10000, 100000}})->UseRealTime()->Unit(benchmark::kMillisecond);
+
+// Такт симуляции: движение всех NPC и бой; следующий такт считается в фоне между вызовами
+static void BM_Tick(benchmark::State& state, size_t threads) {
+    auto dungeon = makeDungeon(cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM), StorageMode::SOA);
+    dungeon->setThreads(threads);
+    dungeon->battle(2);
+    for (auto _ : state) {
+        dungeon->tick(2);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_CAPTURE(BM_Tick, single, 1)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_Tick, parallel, HARDWARE_THREADS)->Apply(sizeArgs);
+
+// Повторный бой после нескольких add: инкрементальный путь
+static void BM_BattleAfterAdd(benchmark::State& state) {
+    const auto& world = cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM);
+    auto dungeon = makeDungeon(world, StorageMode::SOA);
+    dungeon->battle(5);
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> coord(0, 500);
+    for (auto _ : state) {
+        state.PauseTiming();
+        for (int k = 0; k < 10; ++k) dungeon->addNPC(NPCType::KNIGHT, "late", coord(rng), coord(rng));
+        state.ResumeTiming();
+        dungeon->battle(5);
+    }
+}
+BENCHMARK(BM_BattleAfterAdd)->Apply(sizeArgs);
+
+// Перебор радиусов через undo: бой, возврат к версии до него, бой с меньшим радиусом.
+// С кэшем пар (BattleCache) повторные бои обходятся без сетки и проверки расстояний.
+static void BM_BattleAfterUndo(benchmark::State& state, bool cached) {
+    const auto& world = cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM);
+    auto dungeon = makeDungeon(world, StorageMode::SOA);
+    dungeon->setBattleEngine(BattleEngine::SIMD);
+    if (!cached) dungeon->setBattleCacheLimit(0);
+    const WorldVersion before = dungeon->snapshot();
+    dungeon->battle(5);
+    dungeon->restore(before);
+    dungeon->battle(5);
+    for (auto _ : state) {
+        state.PauseTiming();
+        dungeon->restore(before);
+        state.ResumeTiming();
+        dungeon->battle(3);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_CAPTURE(BM_BattleAfterUndo, uncached, false)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_BattleAfterUndo, cached, true)->RangeMultiplier(10)->Range(1000, 1000000)->Unit(benchmark::kMillisecond);
+
+// Запросы по индексу: время от числа найденных, а не от размера мира
+static void BM_QueryNear(benchmark::State& state) {
+    auto dungeon = makeDungeon(cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM), StorageMode::SOA);
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> coord(0, 500);
+    size_t found = 0;
+    for (auto _ : state) {
+        found += dungeon->near(coord(rng), coord(rng), 10).size();
+    }
+    state.counters["found"] = benchmark::Counter(static_cast<double>(found), benchmark::Counter::kAvgIterations);
+}
+BENCHMARK(BM_QueryNear)->Apply(sizeArgs);
+
+static void BM_QueryNearest(benchmark::State& state) {
+    auto dungeon = makeDungeon(cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM), StorageMode::SOA);
+    std::mt19937 rng(7);
+    std::uniform_int_distribution<int> coord(0, 500);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(dungeon->nearest(coord(rng), coord(rng), 10));
+    }
+}
+BENCHMARK(BM_QueryNearest)->Apply(sizeArgs);
+
+// Версия мира после add: копируется только изменённая страница
+static void BM_SnapshotAfterAdd(benchmark::State& state) {
+    auto dungeon = makeDungeon(cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM), StorageMode::SOA);
+    dungeon->snapshot();
+    for (auto _ : state) {
+        dungeon->addNPC(NPCType::KNIGHT, "late", 250, 250);
+        benchmark::DoNotOptimize(dungeon->snapshot());
+    }
+}
+BENCHMARK(BM_SnapshotAfterAdd)->Apply(sizeArgs);
+
+// Байты считаются по распакованному содержимому; ratio - во сколько раз меньше файл
+static void setFileCounters(benchmark::State& state, const std::string& path) {
+    const auto stored = static_cast<int64_t>(std::filesystem::file_size(path));
+    const auto raw = static_cast<int64_t>(MappedFile::open(path)->size());
+    state.SetBytesProcessed(state.iterations() * raw);
+    state.counters["ratio"] = stored > 0 ? static_cast<double>(raw) / static_cast<double>(stored) : 1.0;
+}
+
+static std::string filePath(const char* name, bool compressed) {
+    return tempPath(name) + (compressed ? ".dz" : "");
+}
+
+static void BM_SaveText(benchmark::State& state, StorageMode mode, bool compressed) {
+    auto dungeon = makeDungeon(cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM), mode);
+    const std::string path = filePath("save.txt", compressed);
+    for (auto _ : state) {
+        dungeon->saveToFile(path);
+    }
+    setFileCounters(state, path);
+    std::filesystem::remove(path);
+}
+BENCHMARK_CAPTURE(BM_SaveText, objects, StorageMode::OBJECTS, false)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_SaveText, soa, StorageMode::SOA, false)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_SaveText, soa_dz, StorageMode::SOA, true)->Apply(sizeArgs);
+
+static void BM_LoadText(benchmark::State& state, StorageMode mode, bool compressed, size_t threads) {
+    const std::string path = filePath("load.txt", compressed);
+    makeDungeon(cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM), StorageMode::SOA)->saveToFile(path);
+    Dungeon dungeon(mode, false);
+    dungeon.setThreads(threads);
+    for (auto _ : state) {
+        dungeon.loadFromFile(path);
+    }
+    setFileCounters(state, path);
+    std::filesystem::remove(path);
+}
+BENCHMARK_CAPTURE(BM_LoadText, objects, StorageMode::OBJECTS, false, 1)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_LoadText, soa, StorageMode::SOA, false, 1)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_LoadText, soa_parallel, StorageMode::SOA, false, HARDWARE_THREADS)->Apply(sizeArgs)->UseRealTime();
+BENCHMARK_CAPTURE(BM_LoadText, soa_dz, StorageMode::SOA, true, 1)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_LoadText, soa_dz_parallel, StorageMode::SOA, true, HARDWARE_THREADS)->Apply(sizeArgs)->UseRealTime();
+
+static void BM_SaveSnapshot(benchmark::State& state, bool compressed) {
+    auto dungeon = makeDungeon(cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM), StorageMode::SOA);
+    const std::string path = filePath("save.bin", compressed);
+    for (auto _ : state) {
+        dungeon->saveSnapshot(path);
+    }
+    setFileCounters(state, path);
+    std::filesystem::remove(path);
+}
+BENCHMARK_CAPTURE(BM_SaveSnapshot, raw, false)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_SaveSnapshot, dz, true)->Apply(sizeArgs);
+
+static void BM_LoadSnapshot(benchmark::State& state, bool compressed, size_t threads) {
+    const std::string path = filePath("load.bin", compressed);
+    makeDungeon(cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM), StorageMode::SOA)->saveSnapshot(path);
+    Dungeon dungeon(StorageMode::SOA, false);
+    dungeon.setThreads(threads);
+    for (auto _ : state) {
+        dungeon.loadSnapshot(path);
+    }
+    setFileCounters(state, path);
+    std::filesystem::remove(path);
+}
+BENCHMARK_CAPTURE(BM_LoadSnapshot, raw, false, 1)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_LoadSnapshot, raw_parallel, false, HARDWARE_THREADS)->Apply(sizeArgs)->UseRealTime();
+BENCHMARK_CAPTURE(BM_LoadSnapshot, dz, true, 1)->Apply(sizeArgs);
+BENCHMARK_CAPTURE(BM_LoadSnapshot, dz_parallel, true, HARDWARE_THREADS)->Apply(sizeArgs)->UseRealTime();
+
+// Создание и удаление NPC: куча против арены подземелья
+static void BM_CreateNPCHeap(benchmark::State& state) {
+    const auto& world = cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM);
+    NameTable names;
+    std::vector<std::unique_ptr<NPC>> npcs;
+    npcs.reserve(world.size());
+    for (auto _ : state) {
+        for (const auto& record : world) {
+            npcs.push_back(NPCFactory::createNPC(record.type, record.name, record.x, record.y, names));
+        }
+        npcs.clear();
+        names.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CreateNPCHeap)->Apply(sizeArgs);
+
+static void BM_CreateNPCArena(benchmark::State& state) {
+    const auto& world = cachedWorld(static_cast<size_t>(state.range(0)), WorldShape::UNIFORM);
+    NPCArena arena;
+    NameTable names;
+    std::vector<NPCPtr> npcs;
+    npcs.reserve(world.size());
+    for (auto _ : state) {
+        for (const auto& record : world) {
+            npcs.push_back(NPCFactory::createNPC(record.type, record.name, record.x, record.y, arena, names));
+        }
+        npcs.clear();
+        arena.release();
+        names.clear();
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_CreateNPCArena)->Apply(sizeArgs);
+
+// Без явного --benchmark_out результаты дополнительно пишутся в bench.json
+int main(int argc, char** argv) {
+    std::vector<char*> args(argv, argv + argc);
+    std::string out = "--benchmark_out=bench.json", format = "--benchmark_out_format=json";
+    bool hasOut = std::any_of(args.begin() + 1, args.end(), [](const char* arg) {
+        return std::string_view(arg).rfind("--benchmark_out=", 0) == 0;
+    });
+    if (!hasOut) {
+        args.push_back(out.data());
+        args.push_back(format.data());
+    }
+    int count = static_cast<int>(args.size());
+    benchmark::Initialize(&count, args.data());
+    if (benchmark::ReportUnrecognizedArguments(count, args.data())) return 1;
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -4,260 +4,5471 @@
 #include <memory>
 #include <cmath>
 #include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <charconv>
+#include <iterator>
+#include <cstddef>
+#include <new>
+#include <future>
+#include <cerrno>
+#include <limits>
+#include <cstdio>
+#include <deque>
+#include <array>
 
-// Типы NPC
-enum class NPCType { PRINCESS, DRAGON, KNIGHT };
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#endif
+
+// Движок боя GPU (BattleEngine::GPU): сборка с -DDUNGEON_WITH_OPENCL и -lOpenCL
+#ifdef DUNGEON_WITH_OPENCL
+#define CL_TARGET_OPENCL_VERSION 120
+#include <CL/cl.h>
+#endif
+
+// Фоновые команды REPL (bg) - сопрограммы C++20; в сборке по более старому стандарту
+// bg выполняет команду сразу
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define DUNGEON_ASYNC 1
+#endif
+#endif
+#ifndef DUNGEON_ASYNC
+#define DUNGEON_ASYNC 0
+#endif
+
+#if defined(__SSE2__) || defined(__AVX2__) || defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Счётчики и замеры фаз боя (Dungeon::getStats); -DDUNGEON_NO_STATS убирает их из горячего пути
+#ifdef DUNGEON_NO_STATS
+#define DUNGEON_STATS 0
+#else
+#define DUNGEON_STATS 1
+#endif
+
+// Типы NPC. Остальное о каждом виде - в его описании ниже и в списке Species
+enum class NPCType : std::uint8_t { PRINCESS, DRAGON, KNIGHT };
+
+// Кого убивает вид
+template <NPCType... Victims>
+struct Kills {
+    static constexpr bool contains(NPCType type) { return (false || ... || (type == Victims)); }
+};
+
+// Описание вида: name - для вывода, keyword - в файле сохранения,
+// command - в REPL, speed - клеток за такт по каждой оси
+struct PrincessSpecies {
+    static constexpr NPCType type = NPCType::PRINCESS;
+    static constexpr const char* name = "Принцесса";
+    static constexpr const char* keyword = "PRINCESS";
+    static constexpr const char* command = "princess";
+    static constexpr int speed = 1;
+    using Victims = Kills<>;
+};
+
+struct DragonSpecies {
+    static constexpr NPCType type = NPCType::DRAGON;
+    static constexpr const char* name = "Дракон";
+    static constexpr const char* keyword = "DRAGON";
+    static constexpr const char* command = "dragon";
+    static constexpr int speed = 3;
+    using Victims = Kills<NPCType::PRINCESS>;
+};
+
+struct KnightSpecies {
+    static constexpr NPCType type = NPCType::KNIGHT;
+    static constexpr const char* name = "Рыцарь";
+    static constexpr const char* keyword = "KNIGHT";
+    static constexpr const char* command = "knight";
+    static constexpr int speed = 2;
+    using Victims = Kills<NPCType::DRAGON>;
+};
+
+template <typename S>
+struct SpeciesTag {
+    using type = S;
+};
+
+// Список видов в порядке значений NPCType. Из него при компиляции строятся
+// таблицы имён, матрица убийств, фабрика (dispatch) и интерфейс Visitor:
+// новый вид - значение в NPCType, описание и место в Species.
+template <typename... S>
+struct SpeciesList {
+    static constexpr size_t size = sizeof...(S);
+
+    template <template <typename...> class T>
+    using apply = T<S...>;
+
+    static constexpr std::array<const char*, size> names = {S::name...};
+    static constexpr std::array<const char*, size> keywords = {S::keyword...};
+    static constexpr std::array<const char*, size> commands = {S::command...};
+    static constexpr std::array<int, size> speeds = {S::speed...};
+
+    struct Matrix {
+        bool at[size][size];
+    };
+
+    // at[убийца][жертва]
+    static constexpr Matrix killMatrix() {
+        Matrix matrix{};
+        for (size_t victim = 0; victim < size; ++victim) {
+            ((matrix.at[static_cast<size_t>(S::type)][victim] = S::Victims::contains(static_cast<NPCType>(victim))), ...);
+        }
+        return matrix;
+    }
+
+    static constexpr bool ordered() {
+        size_t index = 0;
+        return (true && ... && (static_cast<size_t>(S::type) == index++));
+    }
+
+    // f(SpeciesTag<вид>{}) для вида type; R{}, если type вне списка
+    template <typename R, typename F>
+    static R dispatch(NPCType type, F&& f) {
+        R result{};
+        (void)((type == S::type ? (result = f(SpeciesTag<S>{}), true) : false) || ...);
+        return result;
+    }
+
+    // Вид по имени из таблицы names, keywords или commands
+    static bool find(const std::array<const char*, size>& table, std::string_view text, NPCType& type) {
+        for (size_t i = 0; i < size; ++i) {
+            if (text == table[i]) {
+                type = static_cast<NPCType>(i);
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+using Species = SpeciesList<PrincessSpecies, DragonSpecies, KnightSpecies>;
+constexpr size_t NPC_TYPE_COUNT = Species::size;
+
+static_assert(Species::ordered(), "Species перечисляет виды в порядке NPCType");
+
+// Правила боя: KILL_MATRIX.at[убийца][жертва]
+constexpr Species::Matrix KILL_MATRIX = Species::killMatrix();
+
+constexpr bool canKill(NPCType killer, NPCType victim) {
+    return KILL_MATRIX.at[static_cast<size_t>(killer)][static_cast<size_t>(victim)];
+}
+
+static_assert(canKill(NPCType::DRAGON, NPCType::PRINCESS) && canKill(NPCType::KNIGHT, NPCType::DRAGON) &&
+              !canKill(NPCType::PRINCESS, NPCType::DRAGON) && !canKill(NPCType::DRAGON, NPCType::KNIGHT),
+              "Дракон убивает принцессу, рыцарь убивает дракона");
+
+// Целый порог для квадрата расстояния: d2 <= rangeSquared(range) ровно тогда,
+// когда sqrt(d2) <= range. Отрицательный (или NaN) радиус не задевает никого.
+inline long long rangeSquared(double range) {
+    const long long maxRange2 = 1LL << 52; // дальше double теряет точность целых
+    if (!(range >= 0)) return -1;
+    if (range * range >= static_cast<double>(maxRange2)) return maxRange2;
+    long long r2 = static_cast<long long>(range * range);
+    while (r2 > 0 && std::sqrt(static_cast<double>(r2)) > range) --r2;
+    while (std::sqrt(static_cast<double>(r2 + 1)) <= range) ++r2;
+    return r2;
+}
+
+// Имя NPC из таблицы имён: номер и строка, которая живёт в самой таблице
+struct NameHandle {
+    std::uint32_t id;
+    std::string_view text;
+};
+
+// Таблица имён: каждое имя хранится один раз, NPC ссылаются на него по номеру
+class NameTable {
+    static constexpr size_t BLOCK_SIZE = 64 * 1024;
+
+    // Символы имён блоками: блоки не перемещаются, поэтому views остаются верными.
+    // Блоки общие с копиями из share().
+    std::vector<std::shared_ptr<char[]>> blocks;
+    size_t blockUsed = BLOCK_SIZE;
+    std::vector<std::string_view> views;
+    // Открытая адресация: slots хранят id + 1 (0 - пусто), заполнены не больше чем наполовину
+    std::vector<std::uint32_t> slots;
+    size_t indexed = 0; // views[0, indexed) уже внесены в slots
+    std::vector<std::shared_ptr<const void>> backings; // чужая память из adopt()
+
+    std::string_view copyChars(std::string_view name) {
+        if (blocks.empty() || name.size() > BLOCK_SIZE - blockUsed) {
+            blocks.emplace_back(new char[std::max(BLOCK_SIZE, name.size())]);
+            blockUsed = 0;
+        }
+        char* at = blocks.back().get() + blockUsed;
+        std::copy_n(name.data(), name.size(), at);
+        blockUsed += name.size();
+        return std::string_view(at, name.size());
+    }
+
+    static size_t hashOf(std::string_view name) { return std::hash<std::string_view>()(name); }
+
+    // Слот с именем name или пустой слот, куда его можно вставить
+    size_t findSlot(std::string_view name, size_t hash) const {
+        const size_t mask = slots.size() - 1;
+        for (size_t s = hash & mask;; s = (s + 1) & mask) {
+            if (slots[s] == 0 || views[slots[s] - 1] == name) return s;
+        }
+    }
+
+    void insertSlot(std::uint32_t id) {
+        slots[findSlot(views[id], hashOf(views[id]))] = id + 1;
+    }
+
+    void reserveSlots(size_t count) {
+        if (count * 2 <= slots.size()) return;
+        size_t capacity = 16;
+        while (capacity < count * 2) capacity *= 2;
+        slots.assign(capacity, 0);
+        for (size_t id = 0; id < indexed; ++id) insertSlot(static_cast<std::uint32_t>(id));
+    }
+
+    // Внешние имена индексируются только при первом intern() после adopt()
+    void indexPending() {
+        reserveSlots(views.size() + 1);
+        for (; indexed < views.size(); ++indexed) {
+            insertSlot(static_cast<std::uint32_t>(indexed));
+        }
+    }
+
+public:
+    NameTable() = default;
+    NameTable(NameTable&&) = default;
+    NameTable& operator=(NameTable&&) = default;
+
+    // Копия владеет своими строками: views оригинала указывают в его блоки
+    NameTable(const NameTable& other) {
+        views.reserve(other.views.size());
+        for (auto name : other.views) {
+            views.push_back(copyChars(name));
+        }
+    }
+
+    NameTable& operator=(const NameTable& other) {
+        if (this != &other) *this = NameTable(other);
+        return *this;
+    }
+
+    std::uint32_t intern(std::string_view name) {
+        indexPending();
+        size_t slot = findSlot(name, hashOf(name));
+        if (slots[slot] != 0) return slots[slot] - 1;
+        auto id = static_cast<std::uint32_t>(views.size());
+        views.push_back(copyChars(name));
+        slots[slot] = id + 1;
+        indexed = views.size();
+        return id;
+    }
+
+    // Добавляет имена без копирования; backing держит их память, пока жива таблица
+    void adopt(std::shared_ptr<const void> backing, std::vector<std::string_view> external) {
+        backings.push_back(std::move(backing));
+        views.insert(views.end(), external.begin(), external.end());
+    }
+
+    // Те же имена без копирования символов: новая таблица держит блоки этой,
+    // поэтому остаётся верной после clear() или разрушения оригинала
+    NameTable share() const {
+        auto owners = std::make_shared<std::vector<std::shared_ptr<const void>>>(backings);
+        owners->insert(owners->end(), blocks.begin(), blocks.end());
+        NameTable shared;
+        shared.adopt(owners, views);
+        return shared;
+    }
+
+    std::string_view get(std::uint32_t id) const { return views[id]; }
+    NameHandle handle(std::uint32_t id) const { return {id, views[id]}; }
+    size_t size() const { return views.size(); }
+
+    void clear() {
+        slots.clear();
+        views.clear();
+        blocks.clear();
+        blockUsed = BLOCK_SIZE;
+        backings.clear();
+        indexed = 0;
+    }
+};
 
 class NPC {
 public:
-    NPC(const std::string& name, int x, int y) : name(name), x(x), y(y), alive(true) {}
+    // name.text должна жить дольше NPC (строка из NameTable)
+    NPC(NameHandle name, int x, int y) : name(name), x(x), y(y), alive(true) {}
     virtual ~NPC() = default;
 
     virtual NPCType getType() const = 0;
     virtual void accept(class Visitor& visitor) = 0;
 
-    std::string getName() const { return name; }
-    int getX() const { return x; }
-    int getY() const { return y; }
-    bool isAlive() const { return alive; }
-    void markDead() { alive = false; }
+    std::string_view getName() const { return name.text; }
+    std::uint32_t getNameId() const { return name.id; }
+    int getX() const { return x; }
+    int getY() const { return y; }
+    bool isAlive() const { return alive; }
+    void markDead() { alive = false; }
+    void revive() { alive = true; }
+    void moveTo(int newX, int newY) {
+        x = newX;
+        y = newY;
+    }
+    // То же имя в другой таблице (Dungeon::compactObjectNames)
+    void rename(NameHandle handle) { name = handle; }
+
+    double distanceTo(const NPC& other) const {
+        return std::sqrt(std::pow(x - other.x, 2) + std::pow(y - other.y, 2));
+    }
+
+    long long distanceSquaredTo(const NPC& other) const {
+        long long dx = x - other.x, dy = y - other.y;
+        return dx * dx + dy * dy;
+    }
+
+    // range2 - порог из rangeSquared()
+    bool inRange(const NPC& other, long long range2) const { return distanceSquaredTo(other) <= range2; }
+
+private:
+    NameHandle name;
+    int x, y;
+    bool alive;
+};
+
+// NPC вида S. Бой в Dungeon идёт по KILL_MATRIX, виртуальны только getType и accept
+template <typename S>
+class SpeciesNPC : public NPC {
+public:
+    SpeciesNPC(NameHandle name, int x, int y) : NPC(name, x, y) {}
+    NPCType getType() const override { return S::type; }
+    void accept(Visitor& visitor) override;
+};
+
+using Princess = SpeciesNPC<PrincessSpecies>;
+using Dragon = SpeciesNPC<DragonSpecies>;
+using Knight = SpeciesNPC<KnightSpecies>;
+
+// Пул потоков для parallelFor: вызывающий поток работает наравне с рабочими
+class ThreadPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, finished;
+    std::function<void(size_t)> job; // job(номер части)
+    size_t generation = 0;
+    size_t running = 0;
+    bool stopping = false;
+
+    void workerLoop(size_t part) {
+        size_t seen = 0;
+        for (;;) {
+            std::function<void(size_t)>* current;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || generation != seen; });
+                if (stopping) return;
+                seen = generation;
+                current = &job;
+            }
+            (*current)(part);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (--running == 0) finished.notify_one();
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threads) {
+        for (size_t part = 1; part < threads; ++part) {
+            workers.emplace_back([this, part] { workerLoop(part); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto& worker : workers) worker.join();
+    }
+
+    size_t size() const { return workers.size() + 1; }
+
+    // f(part, begin, end): часть part обрабатывает [begin, end) из [0, count)
+    template <typename F>
+    void parallelFor(size_t count, F&& f) {
+        const size_t parts = size();
+        auto chunk = [&](size_t part) {
+            f(part, count * part / parts, count * (part + 1) / parts);
+        };
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            job = chunk;
+            running = workers.size();
+            ++generation;
+        }
+        wake.notify_all();
+        chunk(0);
+        std::unique_lock<std::mutex> lock(mutex);
+        finished.wait(lock, [&] { return running == 0; });
+    }
+};
+
+// pool->parallelFor или весь диапазон одной частью в вызывающем потоке, если pool == nullptr
+template <typename F>
+void parallelParts(ThreadPool* pool, size_t count, F&& f) {
+    if (pool) pool->parallelFor(count, f);
+    else f(0, 0, count);
+}
+
+inline size_t partCount(const ThreadPool* pool) { return pool ? pool->size() : 1; }
+
+// Ход долгой операции (бой, сохранение, загрузка) для фоновых команд REPL: пишет
+// поток операции, читает REPL. После cancel операция останавливается на ближайшей проверке.
+struct Progress {
+    std::atomic<std::uint64_t> done{0};
+    std::atomic<std::uint64_t> total{0};
+    std::atomic<bool> cancel{false};
+
+    void start(std::uint64_t units) {
+        done.store(0, std::memory_order_relaxed);
+        total.store(units, std::memory_order_relaxed);
+    }
+
+    // false - операцию просят прервать
+    bool advance(std::uint64_t units) {
+        done.fetch_add(units, std::memory_order_relaxed);
+        return !cancelled();
+    }
+
+    bool cancelled() const { return cancel.load(std::memory_order_relaxed); }
+};
+
+// Сжатие в формате блока LZ4: последовательности литералов и ссылок назад до 64 КиБ,
+// жадный поиск по хешу четырёх байт. Распаковка проверяет границы, поэтому
+// повреждённый блок даёт ошибку, а не выход за буфер.
+class Lz4Block {
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t LAST_LITERALS = 5; // конец блока - всегда литералы
+    static constexpr size_t MATCH_LIMIT = 12;  // ссылка начинается не ближе к концу
+    static constexpr size_t MAX_OFFSET = 65535;
+    static constexpr int HASH_BITS = 14;
+
+    static std::uint32_t read32(const char* at) {
+        std::uint32_t value;
+        std::memcpy(&value, at, sizeof(value));
+        return value;
+    }
+
+    static size_t hash(std::uint32_t value) { return (value * 2654435761u) >> (32 - HASH_BITS); }
+
+    // Продолжение длины, не поместившейся в 4 бита токена
+    static char* writeLength(char* out, size_t length) {
+        for (; length >= 255; length -= 255) *out++ = static_cast<char>(255);
+        *out++ = static_cast<char>(length);
+        return out;
+    }
+
+    static char* writeSequence(char* out, const char* literals, size_t literalCount, size_t offset, size_t matchLength) {
+        const size_t extra = matchLength - MIN_MATCH;
+        *out++ = static_cast<char>((std::min<size_t>(literalCount, 15) << 4) | std::min<size_t>(extra, 15));
+        if (literalCount >= 15) out = writeLength(out, literalCount - 15);
+        std::memcpy(out, literals, literalCount);
+        out += literalCount;
+        *out++ = static_cast<char>(offset & 0xFF);
+        *out++ = static_cast<char>(offset >> 8);
+        if (extra >= 15) out = writeLength(out, extra - 15);
+        return out;
+    }
+
+    // Длина после токена; false - вход кончился
+    static bool readLength(const unsigned char*& in, const unsigned char* end, size_t& length) {
+        for (;;) {
+            if (in == end) return false;
+            const unsigned char part = *in++;
+            length += part;
+            if (part != 255) return true;
+        }
+    }
+
+public:
+    static constexpr size_t FAILED = SIZE_MAX;
+
+    static size_t bound(size_t size) { return size + size / 255 + 16; }
+
+    // dst - не меньше bound(size) байт; возвращает размер сжатого
+    static size_t compress(const char* src, size_t size, char* dst) {
+        // позиции прошлых блоков в таблице не мешают: кандидат проверяется по байтам
+        thread_local std::vector<std::uint32_t> table(size_t(1) << HASH_BITS, 0);
+        char* out = dst;
+        size_t anchor = 0;
+        if (size > MATCH_LIMIT) {
+            const size_t limit = size - MATCH_LIMIT, matchEnd = size - LAST_LITERALS;
+            for (size_t ip = 0; ip < limit;) {
+                const std::uint32_t sequence = read32(src + ip);
+                std::uint32_t& slot = table[hash(sequence)];
+                const size_t ref = slot;
+                slot = static_cast<std::uint32_t>(ip);
+                if (ref >= ip || ip - ref > MAX_OFFSET || read32(src + ref) != sequence) {
+                    ip += 1 + ((ip - anchor) >> 6); // без совпадений шаг растёт
+                    continue;
+                }
+                size_t length = MIN_MATCH;
+                while (ip + length < matchEnd && src[ref + length] == src[ip + length]) ++length;
+                out = writeSequence(out, src + anchor, ip - anchor, ip - ref, length);
+                ip += length;
+                anchor = ip;
+            }
+        }
+        const size_t literals = size - anchor;
+        *out++ = static_cast<char>(std::min<size_t>(literals, 15) << 4);
+        if (literals >= 15) out = writeLength(out, literals - 15);
+        std::memcpy(out, src + anchor, literals);
+        return static_cast<size_t>(out + literals - dst);
+    }
+
+    // Размер распакованного по токенам, без копирования; FAILED - блок повреждён
+    // или распакуется длиннее limit
+    static size_t decodedSize(const char* src, size_t size, size_t limit) {
+        const auto* in = reinterpret_cast<const unsigned char*>(src);
+        const auto* end = in + size;
+        size_t out = 0;
+        for (;;) {
+            if (in == end) return FAILED;
+            const unsigned token = *in++;
+            size_t literals = token >> 4;
+            if (literals == 15 && !readLength(in, end, literals)) return FAILED;
+            if (literals > static_cast<size_t>(end - in) || literals > limit - out) return FAILED;
+            in += literals;
+            out += literals;
+            if (in == end) return out;
+            if (end - in < 2) return FAILED;
+            in += 2;
+            size_t length = token & 15;
+            if (length == 15 && !readLength(in, end, length)) return FAILED;
+            length += MIN_MATCH;
+            if (length > limit - out) return FAILED;
+            out += length;
+        }
+    }
+
+    // Размер распакованного или FAILED, если блок повреждён или не влезает в capacity.
+    // prefix - сколько байт перед dst уже распаковано и доступно ссылкам (связанные блоки).
+    static size_t decompress(const char* src, size_t size, char* dst, size_t capacity, size_t prefix = 0) {
+        const auto* in = reinterpret_cast<const unsigned char*>(src);
+        const auto* end = in + size;
+        size_t out = 0;
+        for (;;) {
+            if (in == end) return FAILED;
+            const unsigned token = *in++;
+            size_t literals = token >> 4;
+            if (literals == 15 && !readLength(in, end, literals)) return FAILED;
+            if (literals > static_cast<size_t>(end - in) || literals > capacity - out) return FAILED;
+            if (literals > 0) std::memcpy(dst + out, in, literals); // dst может быть nullptr при capacity 0
+            in += literals;
+            out += literals;
+            if (in == end) return out;
+            if (end - in < 2) return FAILED;
+            const size_t offset = static_cast<size_t>(in[0]) | static_cast<size_t>(in[1]) << 8;
+            in += 2;
+            size_t length = token & 15;
+            if (length == 15 && !readLength(in, end, length)) return FAILED;
+            length += MIN_MATCH;
+            if (offset == 0 || offset > out + prefix || length > capacity - out) return FAILED;
+            if (offset >= length) {
+                std::memcpy(dst + out, dst + out - offset, length);
+            } else {
+                for (size_t k = 0; k < length; ++k) dst[out + k] = dst[out - offset + k];
+            }
+            out += length;
+        }
+    }
+};
+
+// xxHash32 (один проход) - контрольные суммы кадра LZ4
+inline std::uint32_t xxHash32(const char* data, size_t size, std::uint32_t seed = 0) {
+    constexpr std::uint32_t P1 = 2654435761u, P2 = 2246822519u, P3 = 3266489917u, P4 = 668265263u, P5 = 374761393u;
+    auto rotl = [](std::uint32_t value, int bits) { return (value << bits) | (value >> (32 - bits)); };
+    auto read32 = [](const char* at) {
+        std::uint32_t value;
+        std::memcpy(&value, at, sizeof(value));
+        return value;
+    };
+    const char* end = data + size;
+    std::uint32_t h;
+    if (size >= 16) {
+        std::uint32_t v[4] = {seed + P1 + P2, seed + P2, seed, seed - P1};
+        for (; end - data >= 16; data += 16) {
+            for (int k = 0; k < 4; ++k) v[k] = rotl(v[k] + read32(data + 4 * k) * P2, 13) * P1;
+        }
+        h = rotl(v[0], 1) + rotl(v[1], 7) + rotl(v[2], 12) + rotl(v[3], 18);
+    } else {
+        h = seed + P5;
+    }
+    h += static_cast<std::uint32_t>(size);
+    for (; end - data >= 4; data += 4) h = rotl(h + read32(data) * P3, 17) * P4;
+    for (; data < end; ++data) h = rotl(h + static_cast<unsigned char>(*data) * P5, 11) * P1;
+    h ^= h >> 15;
+    h *= P2;
+    h ^= h >> 13;
+    h *= P3;
+    h ^= h >> 16;
+    return h;
+}
+
+// Сжатый файл *.dz - кадры LZ4 (LZ4 Frame Format), их читает и пишет утилита lz4:
+//   uint32 0x184D2204, FLG, BD, [uint64 размер содержимого], HC - байт xxHash32 FLG..
+//   блоки: uint32 размер (старший бит - без сжатия), байты, [uint32 xxHash32 блока]
+//   uint32 0 - конец кадра, [uint32 xxHash32 содержимого]
+// Сами пишем независимые блоки по 64 КиБ без сумм, дописывание начинает новый кадр.
+// Читаются и кадры утилиты: связанные блоки до 4 МиБ, суммы проверяются.
+struct CompressedFormat {
+    static constexpr std::uint32_t MAGIC = 0x184D2204;
+    static constexpr std::uint32_t SKIPPABLE = 0x184D2A50; // ..5F: кадр без данных, пропускается
+    static constexpr std::uint32_t BLOCK_SIZE = 64 << 10;
+    static constexpr std::uint32_t UNCOMPRESSED = 1u << 31;
+    static constexpr std::uint64_t MAX_RAW_SIZE = std::uint64_t(1) << 35; // распакованного на файл
+    static constexpr char FLAGS = 0x60;            // версия 01, независимые блоки
+    static constexpr char BLOCK_DESCRIPTOR = 0x40; // блоки до 64 КиБ
+    static constexpr size_t HEADER_SIZE = 7;
+
+    static std::uint32_t read32(const char* at) {
+        std::uint32_t value;
+        std::memcpy(&value, at, sizeof(value));
+        return value;
+    }
+
+    static bool matches(const char* data, size_t size) {
+        return size >= sizeof(std::uint32_t) && (read32(data) == MAGIC || (read32(data) & ~0xFu) == SKIPPABLE);
+    }
+
+    // имя файла с .dz - писать сжатым
+    static bool wanted(const std::string& filename) {
+        return filename.size() > 3 && filename.compare(filename.size() - 3, 3, ".dz") == 0;
+    }
+
+    // Заголовок кадра, который пишем сами
+    static void header(char (&out)[HEADER_SIZE]) {
+        std::memcpy(out, &MAGIC, sizeof(MAGIC));
+        out[4] = FLAGS;
+        out[5] = BLOCK_DESCRIPTOR;
+        out[6] = static_cast<char>(xxHash32(out + 4, 2) >> 8);
+    }
+};
+
+// Запись кадра *.dz: текст копится блоком, заполненный блок уходит в фоновый поток,
+// который сжимает и пишет его в файл. sync() (flush потока) закрывает текущий блок
+// и ждёт, пока всё отданное дойдёт до файла. Дописывание начинает новый кадр.
+class CompressedStreamBuf : public std::streambuf {
+    static constexpr size_t MAX_QUEUE = 4; // блоков в очереди, дальше писатель ждёт
+
+    std::ofstream file;
+    std::vector<char> block;
+    std::deque<std::vector<char>> queue;
+    std::mutex mutex;
+    std::condition_variable changed;
+    size_t pending = 0; // блоков в очереди и в работе
+    bool stopping = false;
+    bool failed = false;
+    bool closed = false;
+    std::thread worker; // последним: стартует, когда остальное готово
+
+    void writeRaw(const void* bytes, size_t size) { file.write(static_cast<const char*>(bytes), static_cast<std::streamsize>(size)); }
+
+    void workerLoop() {
+        std::vector<char> packed;
+        for (;;) {
+            std::vector<char> raw;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                changed.wait(lock, [&] { return !queue.empty() || stopping; });
+                if (queue.empty()) return;
+                raw = std::move(queue.front());
+                queue.pop_front();
+            }
+            packed.resize(Lz4Block::bound(raw.size()));
+            const size_t size = Lz4Block::compress(raw.data(), raw.size(), packed.data());
+            const bool stored = size >= raw.size();
+            const std::uint32_t header = static_cast<std::uint32_t>(stored ? raw.size() | CompressedFormat::UNCOMPRESSED : size);
+            writeRaw(&header, sizeof(header));
+            writeRaw(stored ? raw.data() : packed.data(), stored ? raw.size() : size);
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!file) failed = true;
+            --pending;
+            changed.notify_all();
+        }
+    }
+
+    void submit() {
+        if (pptr() == pbase()) return;
+        std::vector<char> raw(pbase(), pptr());
+        setp(block.data(), block.data() + block.size());
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return queue.size() < MAX_QUEUE; });
+        queue.push_back(std::move(raw));
+        ++pending;
+        changed.notify_all();
+    }
+
+protected:
+    int_type overflow(int_type c) override {
+        submit();
+        if (traits_type::eq_int_type(c, traits_type::eof())) return traits_type::not_eof(c);
+        *pptr() = traits_type::to_char_type(c);
+        pbump(1);
+        return c;
+    }
+
+    int sync() override {
+        submit();
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return pending == 0; });
+        file.flush();
+        if (!file) failed = true;
+        return failed ? -1 : 0;
+    }
+
+public:
+    CompressedStreamBuf(const std::string& filename, bool append)
+        : file(filename, std::ios::binary | (append ? std::ios::app : std::ios::trunc)), block(CompressedFormat::BLOCK_SIZE),
+          worker([this] { workerLoop(); }) {
+        setp(block.data(), block.data() + block.size());
+        char header[CompressedFormat::HEADER_SIZE];
+        CompressedFormat::header(header);
+        writeRaw(header, sizeof(header));
+        failed = !file;
+    }
+
+    ~CompressedStreamBuf() override { close(); }
+
+    bool isOpen() const { return file.is_open(); }
+
+    // Дописывает блоки и конец кадра; false - ошибка записи
+    bool close() {
+        if (closed) return !failed;
+        closed = true;
+        sync();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        changed.notify_all();
+        worker.join();
+        const std::uint32_t end = 0;
+        writeRaw(&end, sizeof(end));
+        file.close();
+        if (!file) failed = true;
+        return !failed;
+    }
+};
+
+class CompressedOStream : public std::ostream {
+    CompressedStreamBuf buffer;
+public:
+    CompressedOStream(const std::string& filename, bool append) : std::ostream(nullptr), buffer(filename, append) {
+        rdbuf(&buffer);
+        if (!buffer.isOpen()) setstate(std::ios::failbit);
+    }
+    bool close() { return buffer.close(); }
+};
+
+// Файл для записи: с именем *.dz - сжатый (CompressedOStream), иначе обычный
+inline std::unique_ptr<std::ostream> openOutput(const std::string& filename, bool append = false) {
+    if (CompressedFormat::wanted(filename)) return std::make_unique<CompressedOStream>(filename, append);
+    return std::make_unique<std::ofstream>(filename, std::ios::binary | (append ? std::ios::app : std::ios::trunc));
+}
+
+// Таблица блоков файла *.dz по заголовкам кадров, без распаковки. Размер блока после
+// распаковки в кадре не записан и считается по токенам (Lz4Block::decodedSize), так
+// что распакованный файл не больше того, что в нём действительно закодировано.
+class CompressedBlocks {
+    struct Block {
+        size_t at;     // начало данных в файле
+        size_t stored; // байт в файле
+        size_t limit;  // наибольший размер блока кадра
+        size_t frame;
+        bool compressed;
+        bool linked;   // ссылается на предыдущие блоки кадра
+        bool checksum; // за данными uint32 xxHash32
+    };
+    struct Frame {
+        size_t firstBlock, endBlock;
+        bool complete; // дошёл до конца кадра (с tornTail может оборваться)
+        bool hasSize;
+        bool hasChecksum;
+        std::uint64_t contentSize;
+        std::uint32_t checksum;
+    };
+
+    const char* data = nullptr;
+    std::vector<Block> list;
+    std::vector<Frame> frames;
+
+public:
+    // false - не *.dz, неверный заголовок или файл оборван. С tornTail оборванный хвост
+    // (сбой во время записи) отбрасывается целыми блоками - так читается журнал.
+    bool scan(const char* bytes, size_t size, bool tornTail = false) {
+        using Format = CompressedFormat;
+        data = bytes;
+        list.clear();
+        frames.clear();
+        size_t at = 0;
+        while (at < size) {
+            if (size - at < sizeof(std::uint32_t)) return tornTail;
+            const std::uint32_t magic = Format::read32(bytes + at);
+            if ((magic & ~0xFu) == Format::SKIPPABLE) {
+                if (size - at < 2 * sizeof(std::uint32_t)) return tornTail;
+                const size_t length = Format::read32(bytes + at + sizeof(std::uint32_t));
+                if (size - at - 2 * sizeof(std::uint32_t) < length) return tornTail;
+                at += 2 * sizeof(std::uint32_t) + length;
+                continue;
+            }
+            if (magic != Format::MAGIC) return false;
+            at += sizeof(std::uint32_t);
+            if (size - at < 2) return tornTail;
+            const auto flags = static_cast<std::uint8_t>(bytes[at]), descriptor = static_cast<std::uint8_t>(bytes[at + 1]);
+            const unsigned sizeCode = (descriptor >> 4) & 7;
+            // версия 01, без словаря, зарезервированные биты нулевые, блоки от 64 КиБ до 4 МиБ
+            if ((flags >> 6) != 1 || (flags & 0x03) || (descriptor & 0x8F) || sizeCode < 4) return false;
+            Frame frame{list.size(), list.size(), false, (flags & 0x08) != 0, (flags & 0x04) != 0, 0, 0};
+            const size_t headerBytes = frame.hasSize ? 10 : 2;
+            if (size - at < headerBytes + 1) return tornTail;
+            if (static_cast<std::uint8_t>(xxHash32(bytes + at, headerBytes) >> 8) != static_cast<std::uint8_t>(bytes[at + headerBytes])) {
+                return false;
+            }
+            if (frame.hasSize) std::memcpy(&frame.contentSize, bytes + at + 2, sizeof(frame.contentSize));
+            at += headerBytes + 1;
+            const size_t limit = size_t(1) << (8 + 2 * sizeCode);
+            const bool linked = (flags & 0x20) == 0, blockChecksum = (flags & 0x10) != 0;
+            for (;;) {
+                if (size - at < sizeof(std::uint32_t)) break;
+                const std::uint32_t word = Format::read32(bytes + at);
+                if (word == 0) {
+                    if (frame.hasChecksum) {
+                        if (size - at < 2 * sizeof(std::uint32_t)) break;
+                        frame.checksum = Format::read32(bytes + at + sizeof(std::uint32_t));
+                        at += sizeof(std::uint32_t);
+                    }
+                    at += sizeof(std::uint32_t);
+                    frame.complete = true;
+                    break;
+                }
+                const size_t stored = word & ~Format::UNCOMPRESSED;
+                if (stored > limit) return false;
+                const size_t total = stored + (blockChecksum ? sizeof(std::uint32_t) : 0);
+                if (size - at - sizeof(std::uint32_t) < total) break;
+                list.push_back({at + sizeof(std::uint32_t), stored, limit, frames.size(), (word & Format::UNCOMPRESSED) == 0,
+                                linked, blockChecksum});
+                at += sizeof(std::uint32_t) + total;
+            }
+            frame.endBlock = list.size();
+            frames.push_back(frame);
+            if (!frame.complete) return tornTail;
+        }
+        return at > 0;
+    }
+
+    // Независимые блоки с pool считаются и распаковываются параллельно, связанные - подряд
+    bool decodeAll(std::vector<char>& out, ThreadPool* pool = nullptr) const {
+        std::vector<size_t> sizes(list.size());
+        std::atomic<bool> ok{true};
+        parallelParts(pool, list.size(), [&](size_t, size_t from, size_t to) {
+            for (size_t i = from; i < to; ++i) {
+                const Block& block = list[i];
+                if (block.checksum &&
+                    xxHash32(data + block.at, block.stored) != CompressedFormat::read32(data + block.at + block.stored)) {
+                    ok = false;
+                }
+                sizes[i] = block.compressed ? Lz4Block::decodedSize(data + block.at, block.stored, block.limit) : block.stored;
+                if (sizes[i] == Lz4Block::FAILED) ok = false;
+            }
+        });
+        if (!ok) return false;
+        std::vector<std::uint64_t> offsets(list.size() + 1, 0);
+        for (size_t i = 0; i < list.size(); ++i) {
+            offsets[i + 1] = offsets[i] + sizes[i];
+            if (offsets[i + 1] > CompressedFormat::MAX_RAW_SIZE) return false;
+        }
+        out.resize(static_cast<size_t>(offsets.back()));
+
+        auto decode = [&](size_t i) {
+            const Block& block = list[i];
+            char* to = out.data() + offsets[i];
+            if (!block.compressed) {
+                std::memcpy(to, data + block.at, block.stored);
+                return true;
+            }
+            // связанный блок ссылается до 64 КиБ назад в распакованное своего кадра
+            const size_t prefix = block.linked ? static_cast<size_t>(std::min<std::uint64_t>(
+                                                     offsets[i] - offsets[frames[block.frame].firstBlock], 64 << 10))
+                                               : 0;
+            return Lz4Block::decompress(data + block.at, block.stored, to, sizes[i], prefix) == sizes[i];
+        };
+        const bool linked = std::any_of(list.begin(), list.end(), [](const Block& block) { return block.linked; });
+        if (linked) {
+            for (size_t i = 0; i < list.size(); ++i) {
+                if (!decode(i)) return false;
+            }
+        } else {
+            parallelParts(pool, list.size(), [&](size_t, size_t from, size_t to) {
+                for (size_t i = from; i < to && ok.load(std::memory_order_relaxed); ++i) {
+                    if (!decode(i)) ok = false;
+                }
+            });
+            if (!ok) return false;
+        }
+        for (const Frame& frame : frames) {
+            if (!frame.complete) continue;
+            const std::uint64_t from = offsets[frame.firstBlock], length = offsets[frame.endBlock] - from;
+            if (frame.hasSize && frame.contentSize != length) return false;
+            if (frame.hasChecksum && xxHash32(out.data() + from, static_cast<size_t>(length)) != frame.checksum) return false;
+        }
+        return true;
+    }
+};
+
+// для логирования
+class Observer {
+public:
+    virtual ~Observer() = default;
+    virtual void onKill(const NPC& killer, const NPC& victim) { onKill(killer.getName(), victim.getName()); }
+    // для хранилища без объектов NPC (NPCStore)
+    virtual void onKill(std::string_view killerName, std::string_view victimName) = 0;
+    // конец боя: буферизующие наблюдатели дописывают накопленное
+    virtual void flush() {}
+
+    // Изменения мира по id в хранилище подземелья (для Journal); id остаются
+    // верными до onCompact(), после него живые нумеруются заново по порядку
+    virtual void onAdd(size_t /*id*/, NPCType /*type*/, std::string_view /*name*/, int /*x*/, int /*y*/) {}
+    virtual void onKilled(size_t /*victim*/) {}
+    virtual void onMove(size_t /*id*/, int /*x*/, int /*y*/) {}
+    virtual void onCompact() {}
+    virtual void onTick() {}
+};
+
+class ConsoleObserver : public Observer {
+public:
+    using Observer::onKill;
+    void onKill(std::string_view killerName, std::string_view victimName) override {
+        std::cout << killerName << " убил(а) " << victimName << std::endl;
+    }
+};
+
+class FileObserver : public Observer {
+    std::ofstream logFile;
+public:
+    FileObserver() : logFile("log.txt", std::ios::app) {}
+    using Observer::onKill;
+    void onKill(std::string_view killerName, std::string_view victimName) override {
+        if (logFile.is_open()) {
+            logFile << killerName << " убил(а) " << victimName << std::endl;
+        }
+    }
+};
+
+// Рассылает события всем подключённым наблюдателям
+class ObserverList : public Observer {
+    std::vector<Observer*> observers;
+public:
+    using Observer::onKill;
+    void add(Observer& observer) { observers.push_back(&observer); }
+    void remove(Observer& observer) {
+        observers.erase(std::remove(observers.begin(), observers.end(), &observer), observers.end());
+    }
+    void onKill(std::string_view killerName, std::string_view victimName) override {
+        for (auto* observer : observers) observer->onKill(killerName, victimName);
+    }
+    void flush() override {
+        for (auto* observer : observers) observer->flush();
+    }
+    void onAdd(size_t id, NPCType type, std::string_view name, int x, int y) override {
+        for (auto* observer : observers) observer->onAdd(id, type, name, x, y);
+    }
+    void onKilled(size_t victim) override {
+        for (auto* observer : observers) observer->onKilled(victim);
+    }
+    void onMove(size_t id, int x, int y) override {
+        for (auto* observer : observers) observer->onMove(id, x, y);
+    }
+    void onCompact() override {
+        for (auto* observer : observers) observer->onCompact();
+    }
+    void onTick() override {
+        for (auto* observer : observers) observer->onTick();
+    }
+};
+
+// Асинхронный журнал убийств: onKill только копирует строку в кольцевой буфер
+// (один писатель, один читатель, без блокировок), фоновый поток выводит
+// накопленное большими блоками. flush() ждёт, пока всё записанное дойдёт до потока.
+class AsyncObserver : public Observer {
+    static constexpr size_t CAPACITY = 1 << 20; // степень двойки
+    static constexpr size_t BATCH = 1 << 16;    // столько байт будит фоновый поток, остальное - flush()
+
+    std::unique_ptr<std::ostream> ownedFile;
+    std::ostream& out;
+    bool opened = true;
+    std::vector<char> ring;
+    std::atomic<size_t> head{0}; // пишет только onKill
+    std::atomic<size_t> tail{0}; // пишет только фоновый поток
+    std::atomic<bool> sleeping{false}; // фоновый поток ждёт wake, кольцо пусто
+    std::mutex mutex;
+    std::condition_variable wake, flushed;
+    size_t flushRequested = 0, flushDone = 0;
+    bool stopping = false;
+    std::thread writer; // последним: стартует, когда остальное готово
+
+    void push(std::string_view bytes) {
+        while (!bytes.empty()) {
+            const size_t h = head.load(std::memory_order_relaxed);
+            const size_t t = tail.load(std::memory_order_acquire);
+            const size_t space = CAPACITY - (h - t);
+            if (space == 0) {
+                publish();
+                std::this_thread::yield();
+                continue;
+            }
+            const size_t n = std::min(space, bytes.size());
+            const size_t pos = h & (CAPACITY - 1);
+            const size_t first = std::min(n, CAPACITY - pos);
+            std::copy_n(bytes.data(), first, ring.data() + pos);
+            std::copy_n(bytes.data() + first, n - first, ring.data());
+            head.store(h + n, std::memory_order_release);
+            bytes.remove_prefix(n);
+        }
+    }
+
+    // После записи head: будит фоновый поток, если он уснул на пустом кольце.
+    // seq_cst здесь и в writerLoop(): хотя бы один увидит запись другого.
+    void publish() {
+        head.fetch_add(0, std::memory_order_seq_cst);
+        if (!sleeping.load(std::memory_order_seq_cst)) return;
+        { std::lock_guard<std::mutex> lock(mutex); }
+        wake.notify_one();
+    }
+
+    void writerLoop() {
+        for (;;) {
+            const size_t t = tail.load(std::memory_order_relaxed);
+            const size_t h = head.load(std::memory_order_acquire);
+            if (h != t) {
+                const size_t pos = t & (CAPACITY - 1);
+                const size_t first = std::min(h - t, CAPACITY - pos);
+                out.write(ring.data() + pos, static_cast<std::streamsize>(first));
+                out.write(ring.data(), static_cast<std::streamsize>(h - t - first));
+                tail.store(h, std::memory_order_release);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            if (head.load(std::memory_order_acquire) != h) continue;
+            if (flushDone != flushRequested) {
+                out.flush();
+                flushDone = flushRequested;
+                flushed.notify_all();
+                continue;
+            }
+            if (stopping) return;
+            sleeping.store(true, std::memory_order_seq_cst);
+            wake.wait(lock, [&] {
+                return head.load(std::memory_order_seq_cst) != h || flushDone != flushRequested || stopping;
+            });
+            sleeping.store(false, std::memory_order_relaxed);
+        }
+    }
+
+public:
+    using Observer::onKill;
+
+    explicit AsyncObserver(std::ostream& out) : out(out), ring(CAPACITY), writer([this] { writerLoop(); }) {}
+
+    // Дописывает в файл, как FileObserver; *.dz - сжатым кадром (openOutput).
+    // Файл не открылся - isOpen() == false, убийства никуда не пишутся.
+    explicit AsyncObserver(const std::string& filename)
+        : ownedFile(openOutput(filename, true)), out(*ownedFile), opened(static_cast<bool>(*ownedFile)), ring(CAPACITY),
+          writer([this] { writerLoop(); }) {}
+
+    ~AsyncObserver() override {
+        flush();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_one();
+        writer.join();
+    }
+
+    void onKill(std::string_view killerName, std::string_view victimName) override {
+        push(killerName);
+        push(" убил(а) ");
+        push(victimName);
+        push("\n");
+        if (head.load(std::memory_order_relaxed) - tail.load(std::memory_order_relaxed) >= BATCH) publish();
+    }
+
+    // Всего байт, переданных в журнал; вызывать из потока, который пишет onKill
+    size_t bytesWritten() const { return head.load(std::memory_order_relaxed); }
+
+    bool isOpen() const { return opened; }
+
+    void flush() override {
+        std::unique_lock<std::mutex> lock(mutex);
+        const size_t request = ++flushRequested;
+        wake.notify_one();
+        flushed.wait(lock, [&] { return flushDone >= request; });
+    }
+};
+
+// Копит убийства, чтобы выдать их позже одним проходом (World: после параллельной фазы)
+class KillBuffer : public Observer {
+    std::string text;         // имена подряд
+    std::vector<size_t> ends; // конец каждого имени: убийца, жертва, убийца, ...
+public:
+    using Observer::onKill;
+    void onKill(std::string_view killerName, std::string_view victimName) override {
+        text += killerName;
+        ends.push_back(text.size());
+        text += victimName;
+        ends.push_back(text.size());
+    }
+
+    // Передаёт накопленное в target и очищает буфер
+    void replay(Observer& target) {
+        std::string_view all(text);
+        for (size_t k = 0, from = 0; k < ends.size(); k += 2) {
+            target.onKill(all.substr(from, ends[k] - from), all.substr(ends[k], ends[k + 1] - ends[k]));
+            from = ends[k + 1];
+        }
+        text.clear();
+        ends.clear();
+    }
+};
+
+//обработка сражений
+template <typename S>
+class SpeciesVisitor {
+public:
+    virtual ~SpeciesVisitor() = default;
+    virtual void visit(SpeciesNPC<S>& npc) = 0;
+};
+
+template <typename... S>
+class VisitorOf : public SpeciesVisitor<S>... {
+public:
+    using SpeciesVisitor<S>::visit...;
+};
+
+// visit(SpeciesNPC<S>&) для каждого вида из Species
+class Visitor : public Species::apply<VisitorOf> {};
+
+// Все visit посетителя Impl через один шаблон Impl::meet(npc)
+template <typename Impl, typename... S>
+class VisitorImpl;
+
+template <typename Impl>
+class VisitorImpl<Impl> : public Visitor {};
+
+template <typename Impl, typename First, typename... Rest>
+class VisitorImpl<Impl, First, Rest...> : public VisitorImpl<Impl, Rest...> {
+public:
+    using VisitorImpl<Impl, Rest...>::visit;
+    void visit(SpeciesNPC<First>& npc) override { static_cast<Impl*>(this)->meet(npc); }
+};
+
+template <typename Impl>
+struct VisitorFor {
+    template <typename... S>
+    using type = VisitorImpl<Impl, S...>;
+};
+
+class BattleVisitor : public Species::apply<VisitorFor<BattleVisitor>::type> {
+    NPC* other;
+    long long range2;
+    Observer& observer;
+public:
+    BattleVisitor(double range, Observer& observer) : other(nullptr), range2(rangeSquared(range)), observer(observer) {}
+
+    void setOther(NPC* npc) { other = npc; }
+
+    template <typename S>
+    void meet(SpeciesNPC<S>& npc) {
+        if (other && other->isAlive() && npc.inRange(*other, range2) && canKill(S::type, other->getType())) {
+            other->markDead();
+            observer.onKill(npc, *other);
+        }
+    }
+};
+
+template <typename S>
+void SpeciesNPC<S>::accept(Visitor& visitor) { visitor.visit(*this); }
+
+// Пул блоков одного размера: выделение - из списка свободных или сдвигом
+// указателя в текущем куске, освобождение - в список свободных
+class FixedPool {
+    static constexpr size_t SLOTS_PER_CHUNK = 1024;
+
+    size_t slotSize;
+    std::vector<std::unique_ptr<unsigned char[]>> chunks;
+    size_t nextChunk = 0;
+    unsigned char* current = nullptr;
+    size_t used = SLOTS_PER_CHUNK;
+    void* freeList = nullptr;
+    size_t live = 0;
+
+public:
+    explicit FixedPool(size_t size)
+        : slotSize((std::max(size, sizeof(void*)) + alignof(std::max_align_t) - 1) / alignof(std::max_align_t) * alignof(std::max_align_t)) {}
+    FixedPool(const FixedPool&) = delete;
+    FixedPool& operator=(const FixedPool&) = delete;
+
+    void* allocate() {
+        ++live;
+        if (freeList) {
+            void* slot = freeList;
+            freeList = *static_cast<void**>(slot);
+            return slot;
+        }
+        if (used == SLOTS_PER_CHUNK) {
+            if (nextChunk == chunks.size()) chunks.push_back(std::make_unique<unsigned char[]>(slotSize * SLOTS_PER_CHUNK));
+            current = chunks[nextChunk++].get();
+            used = 0;
+        }
+        return current + slotSize * used++;
+    }
+
+    void deallocate(void* slot) {
+        --live;
+        *static_cast<void**>(slot) = freeList;
+        freeList = slot;
+    }
+
+    // Если живых блоков нет - начать заново с первого куска, не возвращая память
+    void release() {
+        if (live != 0) return;
+        freeList = nullptr;
+        nextChunk = 0;
+        current = nullptr;
+        used = SLOTS_PER_CHUNK;
+    }
+};
+
+template <typename... S>
+struct SpeciesPools {
+    FixedPool byType[sizeof...(S)] = {FixedPool(sizeof(SpeciesNPC<S>))...};
+};
+
+// Память под NPC подземелья: отдельный пул на каждый тип
+class NPCArena {
+    Species::apply<SpeciesPools> pools;
+
+    FixedPool& poolFor(NPCType type) { return pools.byType[static_cast<size_t>(type)]; }
+
+public:
+    NPC* create(NPCType type, NameHandle name, int x, int y) {
+        void* slot = poolFor(type).allocate();
+        return Species::dispatch<NPC*>(type, [&](auto species) -> NPC* {
+            return new (slot) SpeciesNPC<typename decltype(species)::type>(name, x, y);
+        });
+    }
+
+    void destroy(NPC* npc) {
+        FixedPool& pool = poolFor(npc->getType());
+        npc->~NPC();
+        pool.deallocate(npc);
+    }
+
+    // Вызывать после уничтожения всех NPC (например, после npcs.clear())
+    void release() {
+        for (auto& pool : pools.byType) pool.release();
+    }
+};
+
+// Удаляет NPC из арены, если он создан в ней, иначе обычным delete
+struct NPCDeleter {
+    NPCArena* arena = nullptr;
+    void operator()(NPC* npc) const {
+        if (arena) arena->destroy(npc);
+        else delete npc;
+    }
+};
+
+using NPCPtr = std::unique_ptr<NPC, NPCDeleter>;
+
+// Запись NPC в текстовом формате сохранения
+struct NPCRecord {
+    NPCType type;
+    std::string name;
+    int x, y;
+};
+
+// То же без владения именем: имя указывает в разбираемый текст
+struct NPCRecordView {
+    NPCType type;
+    std::string_view name;
+    int x, y;
+};
+
+// Ошибка разбора файла сохранения; line = 0 - ошибка всего файла
+struct LoadError {
+    size_t line;
+    std::string message;
+};
+
+// Итог Dungeon::addNPCs: rejected - номера записей с координатами вне [0, 500]
+struct AddReport {
+    size_t added = 0;
+    std::vector<size_t> rejected;
+};
+
+// Слова одной строки через пробельные символы, без копирования
+class LineTokens {
+    std::string_view rest;
+
+    static bool isSpace(char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f'; }
+
+public:
+    explicit LineTokens(std::string_view line) : rest(line) {}
+
+    bool next(std::string_view& token) {
+        size_t pos = 0;
+        while (pos < rest.size() && isSpace(rest[pos])) ++pos;
+        size_t start = pos;
+        while (pos < rest.size() && !isSpace(rest[pos])) ++pos;
+        token = rest.substr(start, pos - start);
+        rest.remove_prefix(pos);
+        return !token.empty();
+    }
+};
+
+// Число целиком из token (int, size_t, double); как и >>, допускает ведущий '+'
+template <typename T>
+bool parseNumber(std::string_view token, T& value) {
+    if (token.size() > 1 && token[0] == '+' && token[1] != '-' && token[1] != '+') token.remove_prefix(1);
+    auto result = std::from_chars(token.data(), token.data() + token.size(), value);
+    return result.ec == std::errc() && result.ptr == token.data() + token.size();
+}
+
+class NPCFactory {
+public:
+    // NPC в куче; имя в таблице names вызывающего, она должна пережить NPC
+    static std::unique_ptr<NPC> createNPC(NPCType type, std::string_view name, int x, int y, NameTable& names) {
+        NameHandle handle = names.handle(names.intern(name));
+        return Species::dispatch<std::unique_ptr<NPC>>(type, [&](auto species) {
+            return std::unique_ptr<NPC>(new SpeciesNPC<typename decltype(species)::type>(handle, x, y));
+        });
+    }
+
+    // Имя берётся из таблицы names владельца арены, а не копируется в NPC
+    static NPCPtr createNPC(NPCType type, std::string_view name, int x, int y, NPCArena& arena, NameTable& names) {
+        return NPCPtr(arena.create(type, names.handle(names.intern(name)), x, y), NPCDeleter{&arena});
+    }
+
+    // Читает одну запись; false - конец файла или неверная запись
+    static bool readRecord(std::istream& in, NPCRecord& record) {
+        std::string typeStr;
+        if (in >> typeStr >> record.name >> record.x >> record.y) {
+            if (!parseKeyword(typeStr, record.type)) return false;
+
+            if (record.x < 0 || record.x > 500 || record.y < 0 || record.y > 500) return false;
+            return true;
+        }
+        return false;
+    }
+
+    static std::unique_ptr<NPC> loadFromStream(std::istream& in, NameTable& names) {
+        NPCRecord record;
+        if (!readRecord(in, record)) return nullptr;
+        return createNPC(record.type, record.name, record.x, record.y, names);
+    }
+
+    static const char* typeName(NPCType type) {
+        return static_cast<size_t>(type) < NPC_TYPE_COUNT ? Species::names[static_cast<size_t>(type)] : "";
+    }
+
+    // Имя типа в файле сохранения, см. parseKeyword()
+    static const char* typeKeyword(NPCType type) {
+        return static_cast<size_t>(type) < NPC_TYPE_COUNT ? Species::keywords[static_cast<size_t>(type)] : "";
+    }
+
+    static bool parseKeyword(std::string_view keyword, NPCType& type) { return Species::find(Species::keywords, keyword, type); }
+
+    // Разбирает текст сохранения целиком, без istream и временных строк:
+    // onRecord(type, name, x, y) для каждой верной строки "ТИП имя x y",
+    // неверные строки пропускаются и попадают в errors
+    template <typename F>
+    static void parseText(std::string_view text, F&& onRecord, std::vector<LoadError>& errors) {
+        size_t lineNumber = 0;
+        while (!text.empty()) {
+            ++lineNumber;
+            size_t end = text.find('\n');
+            std::string_view line = text.substr(0, end);
+            text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+
+            std::string_view tokens[5];
+            size_t count = 0;
+            LineTokens words(line);
+            while (count < 5 && words.next(tokens[count])) ++count;
+
+            if (count == 0) continue;
+            if (count != 4) {
+                errors.push_back({lineNumber, "ожидалось: ТИП имя x y в одной строке"});
+                continue;
+            }
+            NPCType type;
+            if (!parseKeyword(tokens[0], type)) {
+                errors.push_back({lineNumber, "неизвестный тип NPC: " + std::string(tokens[0])});
+                continue;
+            }
+            int x, y;
+            if (!parseNumber(tokens[2], x) || !parseNumber(tokens[3], y)) {
+                errors.push_back({lineNumber, "координаты должны быть целыми числами"});
+                continue;
+            }
+            if (x < 0 || x > 500 || y < 0 || y > 500) {
+                errors.push_back({lineNumber, "неверные координаты"});
+                continue;
+            }
+            onRecord(type, tokens[1], x, y);
+        }
+    }
+};
+
+// Запись файла (или потока, например std::cout) большими блоками: текст копится
+// в буфере, числа - через to_chars. Файл *.dz пишется сжатым (openOutput).
+class BufferedWriter {
+    static constexpr size_t CAPACITY = 1 << 20;
+
+    std::unique_ptr<std::ostream> file;
+    std::ostream* out;
+    std::vector<char> buffer;
+    size_t used = 0;
+
+    void drain() {
+        out->write(buffer.data(), static_cast<std::streamsize>(used));
+        used = 0;
+    }
+
+public:
+    explicit BufferedWriter(const std::string& filename) : file(openOutput(filename)), out(file.get()), buffer(CAPACITY) {}
+    // Поток должен жить дольше писателя
+    explicit BufferedWriter(std::ostream& stream, size_t capacity = CAPACITY)
+        : out(&stream), buffer(std::clamp<size_t>(capacity, 64, CAPACITY)) {}
+    ~BufferedWriter() { finish(); }
+
+    bool isOpen() const { return out != file.get() || static_cast<bool>(*file); }
+
+    void write(std::string_view text) {
+        if (text.size() > buffer.size() - used) {
+            drain();
+            if (text.size() > buffer.size()) {
+                out->write(text.data(), static_cast<std::streamsize>(text.size()));
+                return;
+            }
+        }
+        std::copy_n(text.data(), text.size(), buffer.data() + used);
+        used += text.size();
+    }
+
+    void put(char c) {
+        if (used == buffer.size()) drain();
+        buffer[used++] = c;
+    }
+
+    void writeInt(long long value) {
+        if (buffer.size() - used < 24) drain();
+        used = static_cast<size_t>(std::to_chars(buffer.data() + used, buffer.data() + buffer.size(), value).ptr - buffer.data());
+    }
+
+    // Дописывает буфер; false - ошибка записи
+    bool finish() {
+        if (used > 0) drain();
+        out->flush();
+        return static_cast<bool>(*out);
+    }
+};
+
+// Плотное представление мира на время боя: указатели в массивы NPCStore
+struct BattleView {
+    const std::int16_t* x;
+    const std::int16_t* y;
+    const NPCType* type;
+    std::uint8_t* alive;
+    size_t size;
+};
+
+// Хранилище NPC структурой массивов: бой читает плотно упакованные координаты
+// и типы без обхода указателей. Координаты в [0, 500] помещаются в int16.
+struct NPCStore {
+    std::vector<std::int16_t> x, y;
+    std::vector<NPCType> type;
+    std::vector<std::uint8_t> alive;
+    std::vector<std::uint32_t> nameId;
+    NameTable names;
+
+    size_t size() const { return type.size(); }
+    std::string_view nameAt(size_t i) const { return names.get(nameId[i]); }
+    BattleView view() { return {x.data(), y.data(), type.data(), alive.data(), size()}; }
+
+    void add(NPCType npcType, std::string_view name, int npcX, int npcY) {
+        addWithNameId(npcType, names.intern(name), npcX, npcY);
+    }
+
+    // Имя уже лежит в другой таблице (например, зеркало объектов Dungeon)
+    void addWithNameId(NPCType npcType, std::uint32_t id, int npcX, int npcY) {
+        x.push_back(static_cast<std::int16_t>(npcX));
+        y.push_back(static_cast<std::int16_t>(npcY));
+        type.push_back(npcType);
+        alive.push_back(1);
+        nameId.push_back(id);
+    }
+
+    void reserve(size_t count) {
+        x.reserve(count);
+        y.reserve(count);
+        type.reserve(count);
+        alive.reserve(count);
+        nameId.reserve(count);
+    }
+
+    void clear() {
+        x.clear();
+        y.clear();
+        type.clear();
+        alive.clear();
+        nameId.clear();
+        names.clear();
+    }
+
+    // Удаляет мёртвых, сохраняя порядок живых
+    void compact() {
+        size_t out = 0;
+        for (size_t i = 0; i < size(); ++i) {
+            if (!alive[i]) continue;
+            x[out] = x[i];
+            y[out] = y[i];
+            type[out] = type[i];
+            alive[out] = 1;
+            nameId[out] = nameId[i];
+            ++out;
+        }
+        x.resize(out);
+        y.resize(out);
+        type.resize(out);
+        alive.resize(out);
+        nameId.resize(out);
+    }
+
+    // Таблица имён заново из имён NPC хранилища (после compact() - только живых);
+    // номера имён меняются
+    void compactNames() {
+        NameTable kept;
+        for (size_t i = 0; i < size(); ++i) nameId[i] = kept.intern(names.get(nameId[i]));
+        names = std::move(kept);
+    }
+};
+
+// Файл, отображённый в память только для чтения (без POSIX - прочитанный целиком)
+class MappedFile {
+    const char* bytes = nullptr;
+    size_t length = 0;
+#if defined(__unix__) || defined(__APPLE__)
+    void* mapping = nullptr;
+#else
+    std::vector<char> buffer;
+#endif
+    std::vector<char> decoded; // распакованный файл *.dz
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#if defined(__unix__) || defined(__APPLE__)
+        if (mapping) munmap(mapping, length);
+#endif
+    }
+
+    // nullptr, если файл не открылся; сжатый файл (*.dz) распаковывается в память,
+    // с pool - по блокам параллельно. tornTail - см. CompressedBlocks::scan().
+    static std::shared_ptr<MappedFile> open(const std::string& filename, ThreadPool* pool = nullptr, bool tornTail = false) {
+        auto file = std::make_shared<MappedFile>();
+#if defined(__unix__) || defined(__APPLE__)
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return nullptr;
+        struct stat info;
+        if (fstat(fd, &info) != 0) {
+            ::close(fd);
+            return nullptr;
+        }
+        file->length = static_cast<size_t>(info.st_size);
+        if (file->length > 0) {
+            void* mapped = mmap(nullptr, file->length, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                ::close(fd);
+                return nullptr;
+            }
+            file->mapping = mapped;
+            file->bytes = static_cast<const char*>(mapped);
+        }
+        ::close(fd);
+#else
+        std::ifstream in(filename, std::ios::binary);
+        if (!in) return nullptr;
+        file->buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        file->bytes = file->buffer.data();
+        file->length = file->buffer.size();
+#endif
+        if (CompressedFormat::matches(file->bytes, file->length)) {
+            CompressedBlocks blocks;
+            if (!blocks.scan(file->bytes, file->length, tornTail) || !blocks.decodeAll(file->decoded, pool)) return nullptr;
+#if defined(__unix__) || defined(__APPLE__)
+            munmap(file->mapping, file->length);
+            file->mapping = nullptr;
+#else
+            file->buffer = std::vector<char>();
+#endif
+            file->bytes = file->decoded.data();
+            file->length = file->decoded.size();
+        }
+        return file;
+    }
+
+    const char* data() const { return bytes; }
+    size_t size() const { return length; }
+};
+
+// Перепаковка: *.dz читается распакованным, в to пишется сжато, если to - *.dz
+inline bool convertFile(const std::string& from, const std::string& to) {
+    auto in = MappedFile::open(from);
+    if (!in) return false;
+    auto out = openOutput(to);
+    out->write(in->data(), static_cast<std::streamsize>(in->size()));
+    out->flush();
+    return static_cast<bool>(*out);
+}
+
+// Двоичный снимок мира (little-endian):
+//   SnapshotHeader
+//   SnapshotRecord[recordCount]
+//   uint32 nameOffsets[nameCount + 1] - границы имён в блоке символов
+//   char names[nameBytes]
+// Загрузка отображает файл в память: записи раскладываются в массивы NPCStore,
+// блок имён копируется одним куском, и NameTable ссылается на копию - файл можно
+// перезаписать, пока мир загружен.
+struct SnapshotHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t recordSize;
+    std::uint64_t recordCount;
+    std::uint64_t nameCount;
+    std::uint64_t nameBytes;
+};
+
+struct SnapshotRecord {
+    std::int16_t x, y;
+    std::uint8_t type;
+    std::uint8_t reserved[3];
+    std::uint32_t nameId;
+};
+
+static_assert(sizeof(SnapshotHeader) == 40 && sizeof(SnapshotRecord) == 12, "формат снимка не должен зависеть от платформы");
+
+class Snapshot {
+public:
+    static constexpr char MAGIC[8] = {'D', 'U', 'N', 'G', 'E', 'O', 'N', '\0'};
+    static constexpr std::uint32_t VERSION = 1;
+
+    // Живые NPC из store; имена переиндексируются, чтобы в файл не попали имена мёртвых.
+    // written - заголовок записанного файла (для журнала контрольной точки).
+    static bool save(const std::string& filename, const NPCStore& store, SnapshotHeader* written = nullptr) {
+        std::vector<std::uint32_t> remap(store.names.size(), UINT32_MAX);
+        std::vector<SnapshotRecord> records;
+        std::vector<std::uint32_t> offsets{0};
+        std::string chars;
+        for (size_t i = 0; i < store.size(); ++i) {
+            if (!store.alive[i]) continue;
+            std::uint32_t& id = remap[store.nameId[i]];
+            if (id == UINT32_MAX) {
+                id = static_cast<std::uint32_t>(offsets.size() - 1);
+                chars += store.nameAt(i);
+                offsets.push_back(static_cast<std::uint32_t>(chars.size()));
+            }
+            records.push_back({store.x[i], store.y[i], static_cast<std::uint8_t>(store.type[i]), {0, 0, 0}, id});
+        }
+
+        SnapshotHeader header{};
+        std::copy_n(MAGIC, sizeof(MAGIC), header.magic);
+        header.version = VERSION;
+        header.recordSize = sizeof(SnapshotRecord);
+        header.recordCount = records.size();
+        header.nameCount = offsets.size() - 1;
+        header.nameBytes = chars.size();
+        if (written) *written = header;
+
+        auto file = openOutput(filename);
+        file->write(reinterpret_cast<const char*>(&header), sizeof(header));
+        file->write(reinterpret_cast<const char*>(records.data()), static_cast<std::streamsize>(records.size() * sizeof(SnapshotRecord)));
+        file->write(reinterpret_cast<const char*>(offsets.data()), static_cast<std::streamsize>(offsets.size() * sizeof(std::uint32_t)));
+        file->write(chars.data(), static_cast<std::streamsize>(chars.size()));
+        file->flush();
+        return static_cast<bool>(*file);
+    }
+
+    // Заменяет содержимое store; при любой ошибке формата store не меняется.
+    // С pool имена и записи проверяются и раскладываются частями параллельно.
+    static bool load(const std::string& filename, NPCStore& store, SnapshotHeader* read = nullptr, ThreadPool* pool = nullptr) {
+        auto file = MappedFile::open(filename, pool);
+        if (!file || file->size() < sizeof(SnapshotHeader)) return false;
+
+        SnapshotHeader header;
+        std::memcpy(&header, file->data(), sizeof(header));
+        if (!std::equal(MAGIC, MAGIC + sizeof(MAGIC), header.magic) || header.version != VERSION ||
+            header.recordSize != sizeof(SnapshotRecord)) {
+            return false;
+        }
+        // счётчики из файла проверяются по остатку файла до сложения, чтобы не переполниться
+        const std::uint64_t size = file->size();
+        const std::uint64_t recordsAt = sizeof(SnapshotHeader);
+        if (header.recordCount > (size - recordsAt) / sizeof(SnapshotRecord)) return false;
+        const std::uint64_t offsetsAt = recordsAt + header.recordCount * sizeof(SnapshotRecord);
+        if (header.nameCount >= (size - offsetsAt) / sizeof(std::uint32_t)) return false;
+        const std::uint64_t charsAt = offsetsAt + (header.nameCount + 1) * sizeof(std::uint32_t);
+        if (header.nameBytes != size - charsAt) return false;
+
+        const char* chars = file->data() + charsAt;
+        auto offsetAt = [&](std::uint64_t n) {
+            std::uint32_t offset;
+            std::memcpy(&offset, file->data() + offsetsAt + n * sizeof(offset), sizeof(offset));
+            return offset;
+        };
+        if (offsetAt(0) != 0) return false;
+        const size_t nameCount = static_cast<size_t>(header.nameCount);
+        std::vector<std::string_view> names(nameCount);
+        std::atomic<bool> ok{true};
+        parallelParts(pool, nameCount, [&](size_t, size_t from, size_t to) {
+            std::uint32_t previous = offsetAt(from);
+            for (size_t n = from; n < to; ++n) {
+                const std::uint32_t offset = offsetAt(n + 1);
+                if (offset < previous || offset > header.nameBytes) {
+                    ok = false;
+                    return;
+                }
+                names[n] = std::string_view(chars + previous, offset - previous);
+                previous = offset;
+            }
+        });
+        if (!ok) return false;
+
+        const size_t count = static_cast<size_t>(header.recordCount);
+        NPCStore loaded;
+        loaded.x.resize(count);
+        loaded.y.resize(count);
+        loaded.type.resize(count);
+        loaded.alive.assign(count, 1);
+        loaded.nameId.resize(count);
+        parallelParts(pool, count, [&](size_t, size_t from, size_t to) {
+            for (size_t i = from; i < to; ++i) {
+                SnapshotRecord record;
+                std::memcpy(&record, file->data() + recordsAt + i * sizeof(record), sizeof(record));
+                if (record.x < 0 || record.x > 500 || record.y < 0 || record.y > 500 || record.type >= NPC_TYPE_COUNT ||
+                    record.nameId >= header.nameCount) {
+                    ok = false;
+                    return;
+                }
+                loaded.x[i] = record.x;
+                loaded.y[i] = record.y;
+                loaded.type[i] = static_cast<NPCType>(record.type);
+                loaded.nameId[i] = record.nameId;
+            }
+        });
+        if (!ok) return false;
+        std::shared_ptr<char[]> owned(new char[std::max<size_t>(1, header.nameBytes)]);
+        std::memcpy(owned.get(), chars, header.nameBytes);
+        parallelParts(pool, nameCount, [&](size_t, size_t from, size_t to) {
+            for (size_t n = from; n < to; ++n) names[n] = std::string_view(owned.get() + (names[n].data() - chars), names[n].size());
+        });
+        loaded.names.adopt(std::move(owned), std::move(names));
+        store = std::move(loaded);
+        if (read) *read = header;
+        return true;
+    }
+};
+
+// Текстовое сохранение в NPCStore по частям: файл режется на куски по границам
+// строк, куски разбираются параллельно, затем собираются в порядке файла, так что
+// порядок NPC, номера имён и строки ошибок те же, что при разборе подряд.
+class ChunkedTextLoader {
+    static constexpr size_t PROGRESS_BYTES = size_t(1) << 22; // кусок при Progress
+
+    struct Chunk {
+        std::string_view text;
+        std::vector<NPCRecordView> records;
+        std::vector<LoadError> errors;
+        size_t lines = 0; // переводов строки в куске
+        size_t first = 0; // номер первой записи куска во всём файле
+    };
+
+    // Первая запись с тем же именем: открытая адресация по номерам записей,
+    // slots хранят номер + 1 (0 - пусто), заполнены не больше чем наполовину
+    class FirstSeen {
+        const std::vector<std::string_view>& names;
+        const std::vector<std::uint64_t>& hashes;
+        std::vector<std::uint32_t> slots = std::vector<std::uint32_t>(16, 0);
+        size_t used = 0;
+
+        size_t findSlot(std::uint32_t i) const {
+            const size_t mask = slots.size() - 1;
+            for (size_t s = hashes[i] & mask;; s = (s + 1) & mask) {
+                if (slots[s] == 0) return s;
+                const std::uint32_t other = slots[s] - 1;
+                if (hashes[other] == hashes[i] && names[other] == names[i]) return s;
+            }
+        }
+
+    public:
+        FirstSeen(const std::vector<std::string_view>& names, const std::vector<std::uint64_t>& hashes) : names(names), hashes(hashes) {}
+
+        std::uint32_t first(std::uint32_t i) {
+            if ((used + 1) * 2 > slots.size()) {
+                std::vector<std::uint32_t> old(slots.size() * 2, 0);
+                old.swap(slots);
+                for (std::uint32_t entry : old) {
+                    if (entry != 0) slots[findSlot(entry - 1)] = entry;
+                }
+            }
+            const size_t s = findSlot(i);
+            if (slots[s] != 0) return slots[s] - 1;
+            slots[s] = i + 1;
+            ++used;
+            return i;
+        }
+    };
+
+    // Куски по parts на границах строк; последний может закончиться без '\n'
+    static std::vector<Chunk> split(std::string_view text, size_t parts) {
+        std::vector<Chunk> chunks(parts);
+        size_t begin = 0;
+        for (size_t part = 0; part < parts; ++part) {
+            size_t end = part + 1 == parts ? text.size() : std::max(begin, text.size() * (part + 1) / parts);
+            if (end < text.size()) {
+                const size_t newline = text.find('\n', end == 0 ? 0 : end - 1);
+                end = newline == std::string_view::npos ? text.size() : newline + 1;
+            }
+            chunks[part].text = text.substr(begin, end - begin);
+            begin = end;
+        }
+        return chunks;
+    }
+
+public:
+    // С progress куски не больше PROGRESS_BYTES, ход - в байтах разобранного текста;
+    // после отмены разбор останавливается и store не меняется (false)
+    static bool load(const std::shared_ptr<MappedFile>& file, NPCStore& store, std::vector<LoadError>& errors, ThreadPool* pool = nullptr,
+                     Progress* progress = nullptr) {
+        const std::string_view text(file->data(), file->size());
+        const size_t parts = partCount(pool);
+        std::vector<Chunk> chunks = split(text, progress ? std::max(parts, text.size() / PROGRESS_BYTES + 1) : parts);
+        if (progress) progress->start(text.size());
+        parallelParts(pool, chunks.size(), [&](size_t, size_t from, size_t to) {
+            for (size_t part = from; part < to; ++part) {
+                if (progress && progress->cancelled()) return;
+                Chunk& chunk = chunks[part];
+                chunk.lines = static_cast<size_t>(std::count(chunk.text.begin(), chunk.text.end(), '\n'));
+                chunk.records.reserve(chunk.lines + 1);
+                NPCFactory::parseText(chunk.text,
+                                      [&](NPCType type, std::string_view name, int x, int y) { chunk.records.push_back({type, name, x, y}); },
+                                      chunk.errors);
+                if (progress) progress->advance(chunk.text.size());
+            }
+        });
+        if (progress && progress->cancelled()) return false;
+
+        size_t count = 0, lineBase = 0;
+        for (Chunk& chunk : chunks) {
+            chunk.first = count;
+            count += chunk.records.size();
+            for (LoadError& error : chunk.errors) {
+                error.line += lineBase;
+                errors.push_back(std::move(error));
+            }
+            lineBase += chunk.lines;
+        }
+        if (count >= UINT32_MAX) {
+            errors.push_back({0, "слишком много записей"});
+            return false;
+        }
+
+        NPCStore loaded;
+        loaded.x.resize(count);
+        loaded.y.resize(count);
+        loaded.type.resize(count);
+        loaded.alive.assign(count, 1);
+        loaded.nameId.resize(count);
+        std::vector<std::string_view> names(count);
+        std::vector<std::uint64_t> hashes(count);
+        parallelParts(pool, chunks.size(), [&](size_t, size_t from, size_t to) {
+            for (size_t part = from; part < to; ++part) {
+                const Chunk& chunk = chunks[part];
+                for (size_t k = 0; k < chunk.records.size(); ++k) {
+                    const NPCRecordView& record = chunk.records[k];
+                    const size_t i = chunk.first + k;
+                    loaded.x[i] = static_cast<std::int16_t>(record.x);
+                    loaded.y[i] = static_cast<std::int16_t>(record.y);
+                    loaded.type[i] = record.type;
+                    names[i] = record.name;
+                    hashes[i] = std::hash<std::string_view>()(record.name);
+                }
+            }
+        });
+        chunks = std::vector<Chunk>();
+
+        // Повторы каждого имени ищет одна часть (по старшим битам хеша; младшие -
+        // для её таблицы), проходя записи в порядке файла: first[i] - первая запись
+        // с тем же именем
+        std::vector<std::uint32_t> first(count);
+        parallelParts(pool, parts, [&](size_t, size_t from, size_t to) {
+            for (size_t part = from; part < to; ++part) {
+                FirstSeen seen(names, hashes);
+                for (size_t i = 0; i < count; ++i) {
+                    if ((hashes[i] >> 32) % parts != part) continue;
+                    first[i] = seen.first(static_cast<std::uint32_t>(i));
+                }
+            }
+        });
+
+        // Номера имён в порядке первого появления, как у NameTable::intern подряд
+        std::vector<size_t> newNames(parts + 1, 0);
+        parallelParts(pool, count, [&](size_t part, size_t from, size_t to) {
+            size_t fresh = 0;
+            for (size_t i = from; i < to; ++i) fresh += first[i] == i;
+            newNames[part + 1] = fresh;
+        });
+        for (size_t part = 0; part < parts; ++part) newNames[part + 1] += newNames[part];
+        std::vector<std::string_view> unique(newNames[parts]);
+        parallelParts(pool, count, [&](size_t part, size_t from, size_t to) {
+            auto id = static_cast<std::uint32_t>(newNames[part]);
+            for (size_t i = from; i < to; ++i) {
+                if (first[i] != i) continue;
+                unique[id] = names[i];
+                loaded.nameId[i] = id++;
+            }
+        });
+        parallelParts(pool, count, [&](size_t, size_t from, size_t to) {
+            for (size_t i = from; i < to; ++i) {
+                if (first[i] != i) loaded.nameId[i] = loaded.nameId[first[i]];
+            }
+        });
+        // Символы имён копируются одним блоком: отображение не переживает загрузку,
+        // поэтому файл можно сразу перезаписать
+        std::vector<size_t> charsBefore(parts + 1, 0);
+        parallelParts(pool, unique.size(), [&](size_t part, size_t from, size_t to) {
+            size_t bytes = 0;
+            for (size_t id = from; id < to; ++id) bytes += unique[id].size();
+            charsBefore[part + 1] = bytes;
+        });
+        for (size_t part = 0; part < parts; ++part) charsBefore[part + 1] += charsBefore[part];
+        std::shared_ptr<char[]> chars(new char[std::max<size_t>(1, charsBefore[parts])]);
+        parallelParts(pool, unique.size(), [&](size_t part, size_t from, size_t to) {
+            char* at = chars.get() + charsBefore[part];
+            for (size_t id = from; id < to; ++id) {
+                std::copy_n(unique[id].data(), unique[id].size(), at);
+                unique[id] = std::string_view(at, unique[id].size());
+                at += unique[id].size();
+            }
+        });
+        loaded.names.adopt(std::move(chars), std::move(unique));
+        store = std::move(loaded);
+        return true;
+    }
+};
+
+// Неизменяемая версия мира (Dungeon::snapshot()): записи NPCStore страницами по PAGE.
+// Версии делят страницы, которые между ними не менялись, поэтому снимок после боя
+// копирует только страницы с убитыми, сдвинутыми и добавленными NPC.
+class WorldVersion {
+public:
+    static constexpr size_t PAGE = 1024;
+
+    struct Page {
+        std::int16_t x[PAGE], y[PAGE];
+        NPCType type[PAGE];
+        std::uint8_t alive[PAGE];
+        std::uint32_t nameId[PAGE];
+    };
+
+    // Записей вместе с мёртвыми, ещё не убранными уплотнением
+    size_t size() const { return count; }
+    size_t aliveCount() const { return count - dead; }
+    size_t countOf(NPCType type) const { return aliveCounts[static_cast<size_t>(type)]; }
+    std::uint64_t getTicks() const { return ticks; }
+
+    // f(type, name, x, y) для живых NPC в порядке хранения
+    template <typename F>
+    void forEachAlive(F&& f) const {
+        for (size_t i = 0; i < count; ++i) {
+            const Page& page = *pages[i / PAGE];
+            const size_t at = i % PAGE;
+            if (page.alive[at]) f(page.type[at], names->get(page.nameId[at]), page.x[at], page.y[at]);
+        }
+    }
+
+    // Страницы, которые у версий не общие (при разной раскладке id - все)
+    std::vector<size_t> changedPages(const WorldVersion& other) const {
+        std::vector<size_t> changed;
+        const size_t total = std::max(pages.size(), other.pages.size());
+        for (size_t p = 0; p < total; ++p) {
+            if (layout != other.layout || p >= pages.size() || p >= other.pages.size() || pages[p] != other.pages[p]) {
+                changed.push_back(p);
+            }
+        }
+        return changed;
+    }
+
+private:
+    friend class Dungeon;
+
+    std::vector<std::shared_ptr<const Page>> pages;
+    size_t count = 0;
+    size_t dead = 0;
+    size_t aliveCounts[NPC_TYPE_COUNT] = {};
+    std::shared_ptr<const NameTable> names;
+    std::uint64_t layout = 0; // эпоха раскладки id подземелья, см. Dungeon::relayout()
+    std::uint64_t geometry = 0; // эпоха координат и id, см. Dungeon::moved()
+    std::uint64_t ticks = 0;
+};
+
+// Журнал изменений (write-ahead) после контрольной точки - двоичного снимка:
+//   JournalHeader
+//   JournalRecord, за записью ADD - nameLength байт имени
+// События приходят как наблюдателю (onAdd, onKilled, ...), пишутся буфером и
+// доходят до файла на flush(). Оборванная последняя запись при чтении отбрасывается.
+struct JournalHeader {
+    char magic[4];
+    std::uint32_t version;
+    std::uint64_t snapshotRecords; // NPC в снимке контрольной точки
+    std::uint64_t snapshotNameBytes;
+    std::uint64_t ticks;
+};
+
+struct JournalRecord {
+    std::uint8_t kind;
+    std::uint8_t type;
+    std::uint16_t nameLength;
+    std::int16_t x, y;
+    std::uint32_t id;
+};
+
+static_assert(sizeof(JournalHeader) == 32 && sizeof(JournalRecord) == 12, "формат журнала не должен зависеть от платформы");
+
+class Journal : public Observer {
+    std::string filename;
+    std::unique_ptr<BufferedWriter> out;
+    std::uint64_t written = 0;
+
+    void append(JournalRecord record, std::string_view name = {}) {
+        out->write(std::string_view(reinterpret_cast<const char*>(&record), sizeof(record)));
+        out->write(name);
+        written += sizeof(record) + name.size();
+    }
+
+public:
+    enum Kind : std::uint8_t { ADD = 1, KILL, MOVE, COMPACT, TICK };
+
+    static constexpr char MAGIC[4] = {'D', 'J', 'N', 'L'};
+    static constexpr std::uint32_t VERSION = 1;
+    static constexpr size_t MAX_NAME = 0xFFFF;
+
+    explicit Journal(std::string filename) : filename(std::move(filename)) {}
+
+    // Начинает файл заново после контрольной точки; false - не удалось записать
+    bool reset(const SnapshotHeader& snapshot, std::uint64_t ticks) {
+        out.reset();
+        out = std::make_unique<BufferedWriter>(filename);
+        if (!out->isOpen()) return false;
+        JournalHeader header{};
+        std::copy_n(MAGIC, sizeof(MAGIC), header.magic);
+        header.version = VERSION;
+        header.snapshotRecords = snapshot.recordCount;
+        header.snapshotNameBytes = snapshot.nameBytes;
+        header.ticks = ticks;
+        out->write(std::string_view(reinterpret_cast<const char*>(&header), sizeof(header)));
+        written = 0;
+        return out->finish();
+    }
+
+    // Байт записей после контрольной точки
+    std::uint64_t bytes() const { return written; }
+
+    using Observer::onKill;
+    void onKill(std::string_view, std::string_view) override {}
+
+    // Имя длиннее MAX_NAME обрезается
+    void onAdd(size_t id, NPCType type, std::string_view name, int x, int y) override {
+        name = name.substr(0, MAX_NAME);
+        append({ADD, static_cast<std::uint8_t>(type), static_cast<std::uint16_t>(name.size()), static_cast<std::int16_t>(x),
+                static_cast<std::int16_t>(y), static_cast<std::uint32_t>(id)},
+               name);
+    }
+    void onKilled(size_t victim) override { append({KILL, 0, 0, 0, 0, static_cast<std::uint32_t>(victim)}); }
+    void onMove(size_t id, int x, int y) override {
+        append({MOVE, 0, 0, static_cast<std::int16_t>(x), static_cast<std::int16_t>(y), static_cast<std::uint32_t>(id)});
+    }
+    void onCompact() override { append({COMPACT, 0, 0, 0, 0, 0}); }
+    void onTick() override { append({TICK, 0, 0, 0, 0, 0}); }
+
+    void flush() override {
+        if (out) out->finish();
+    }
+
+    // Читает журнал: accept(header) решает, подходит ли он, затем f(record, name) для
+    // каждой целой записи, false из f - стоп. false - файла нет, заголовок неверный
+    // или не принят.
+    template <typename Accept, typename F>
+    static bool read(const std::string& filename, Accept&& accept, F&& f) {
+        auto file = MappedFile::open(filename, nullptr, true);
+        if (!file || file->size() < sizeof(JournalHeader)) return false;
+        JournalHeader header;
+        std::memcpy(&header, file->data(), sizeof(header));
+        if (!std::equal(MAGIC, MAGIC + sizeof(MAGIC), header.magic) || header.version != VERSION || !accept(header)) {
+            return false;
+        }
+        size_t at = sizeof(JournalHeader);
+        while (file->size() - at >= sizeof(JournalRecord)) {
+            JournalRecord record;
+            std::memcpy(&record, file->data() + at, sizeof(record));
+            at += sizeof(record);
+            if (file->size() - at < record.nameLength) break;
+            const std::string_view name(file->data() + at, record.nameLength);
+            at += record.nameLength;
+            if (!f(record, name)) break;
+        }
+        return true;
+    }
+};
+
+// Маска типов, с которыми у attacker возможен бой в любую сторону: бит t для
+// canKill(attacker, t) || canKill(t, attacker). Остальные пары в бою ничего не меняют.
+constexpr std::uint32_t pairMask(NPCType attacker) {
+    std::uint32_t mask = 0;
+    for (size_t t = 0; t < NPC_TYPE_COUNT; ++t) {
+        if (canKill(attacker, static_cast<NPCType>(t)) || canKill(static_cast<NPCType>(t), attacker)) {
+            mask |= 1u << t;
+        }
+    }
+    return mask;
+}
+
+// Координаты NPC парой int16 в одном int32: x в младшей половине, y в старшей
+inline std::int32_t packXY(int x, int y) {
+    return static_cast<std::int32_t>(static_cast<std::uint16_t>(x) | (static_cast<std::uint32_t>(static_cast<std::uint16_t>(y)) << 16));
+}
+
+// Набор инструкций filterCandidates(). SIMD128 - SSE2 или NEON, если они есть в сборке.
+// AVX2 на x86-64 (GCC и Clang) выбирается при запуске по процессору, даже если сборка
+// без -mavx2; с -mavx2 он единственный векторный.
+enum class SimdLevel { SCALAR, SIMD128, AVX2 };
+
+#if defined(__AVX2__)
+#define DUNGEON_AVX2 1
+#define DUNGEON_AVX2_TARGET
+#elif defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define DUNGEON_AVX2 1
+#define DUNGEON_AVX2_TARGET __attribute__((target("avx2")))
+#else
+#define DUNGEON_AVX2 0
+#endif
+
+// Лучший набор, который есть и в сборке, и у процессора
+inline SimdLevel bestSimdLevel() {
+#if defined(__AVX2__)
+    return SimdLevel::AVX2;
+#else
+#if DUNGEON_AVX2
+    if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+#endif
+#if defined(__SSE2__) || (defined(__ARM_NEON) && defined(__aarch64__))
+    return SimdLevel::SIMD128;
+#else
+    return SimdLevel::SCALAR;
+#endif
+#endif
+}
+
+inline SimdLevel& simdLevelSetting() {
+    static SimdLevel level = bestSimdLevel();
+    return level;
+}
+
+inline SimdLevel simdLevel() { return simdLevelSetting(); }
+
+// Для проверок и замеров: набор не лучше bestSimdLevel(); false - такого нет, набор
+// не менялся. Не во время боя.
+inline bool setSimdLevel(SimdLevel level) {
+    if (level > bestSimdLevel()) return false;
+#if defined(__AVX2__)
+    if (level == SimdLevel::SIMD128) return false; // SSE2-ветка в сборке с -mavx2 не собирается
+#endif
+    simdLevelSetting() = level;
+    return true;
+}
+
+#if DUNGEON_AVX2
+DUNGEON_AVX2_TARGET inline unsigned avx2RejectMask(const std::int32_t* xy, const std::uint32_t* typeBits, __m256i o, __m256i r2,
+                                                   __m256i tm) {
+    __m256i d = _mm256_sub_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(xy)), o);
+    __m256i far = _mm256_cmpgt_epi32(_mm256_madd_epi16(d, d), r2); // dx*dx + dy*dy > range2
+    __m256i tb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(typeBits));
+    __m256i other = _mm256_cmpeq_epi32(_mm256_and_si256(tb, tm), _mm256_setzero_si256());
+    return static_cast<unsigned>(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_or_si256(far, other))));
+}
+
+// AVX2: по 16 кандидатов за итерацию; возвращает, сколько проверено
+DUNGEON_AVX2_TARGET inline size_t filterAvx2(const std::int32_t* xy, const std::uint32_t* typeBits, const size_t* ids, size_t count,
+                                             std::int32_t origin, std::int32_t range2, std::uint32_t typeMask,
+                                             std::vector<size_t>& out) {
+    const __m256i o = _mm256_set1_epi32(origin);
+    const __m256i r2 = _mm256_set1_epi32(range2);
+    const __m256i tm = _mm256_set1_epi32(static_cast<int>(typeMask));
+    size_t k = 0;
+    for (; k + 16 <= count; k += 16) {
+        unsigned keep = ~(avx2RejectMask(xy + k, typeBits + k, o, r2, tm) |
+                          (avx2RejectMask(xy + k + 8, typeBits + k + 8, o, r2, tm) << 8)) &
+                        0xFFFFu;
+        for (; keep; keep &= keep - 1) out.push_back(ids[k + __builtin_ctz(keep)]);
+    }
+    return k;
+}
+#endif
+
+// SSE2 и NEON: по 4 за инструкцию; возвращает, сколько проверено
+inline size_t filterSimd128(const std::int32_t* xy, const std::uint32_t* typeBits, const size_t* ids, size_t count,
+                            std::int32_t origin, std::int32_t range2, std::uint32_t typeMask, std::vector<size_t>& out) {
+    size_t k = 0;
+#if defined(__SSE2__) && !defined(__AVX2__)
+    const __m128i o = _mm_set1_epi32(origin);
+    const __m128i r2 = _mm_set1_epi32(range2);
+    const __m128i tm = _mm_set1_epi32(static_cast<int>(typeMask));
+    const __m128i zero = _mm_setzero_si128();
+    auto rejectMask = [&](size_t at) {
+        __m128i d = _mm_sub_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(xy + at)), o);
+        __m128i far = _mm_cmpgt_epi32(_mm_madd_epi16(d, d), r2);
+        __m128i tb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(typeBits + at));
+        __m128i other = _mm_cmpeq_epi32(_mm_and_si128(tb, tm), zero);
+        return static_cast<unsigned>(_mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(far, other))));
+    };
+    for (; k + 16 <= count; k += 16) {
+        unsigned reject = rejectMask(k) | (rejectMask(k + 4) << 4) | (rejectMask(k + 8) << 8) | (rejectMask(k + 12) << 12);
+        for (unsigned keep = ~reject & 0xFFFFu; keep; keep &= keep - 1) out.push_back(ids[k + __builtin_ctz(keep)]);
+    }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    const int16x8_t o = vreinterpretq_s16_s32(vdupq_n_s32(origin));
+    const int32x4_t r2 = vdupq_n_s32(range2);
+    const uint32x4_t tm = vdupq_n_u32(typeMask);
+    for (; k + 4 <= count; k += 4) {
+        int16x8_t d = vsubq_s16(vreinterpretq_s16_s32(vld1q_s32(xy + k)), o);
+        int16x4_t lo = vget_low_s16(d);
+        int32x4_t d2 = vpaddq_s32(vmull_s16(lo, lo), vmull_high_s16(d, d));
+        uint32x4_t keep = vandq_u32(vcleq_s32(d2, r2), vtstq_u32(vld1q_u32(typeBits + k), tm));
+        if (vgetq_lane_u32(keep, 0)) out.push_back(ids[k]);
+        if (vgetq_lane_u32(keep, 1)) out.push_back(ids[k + 1]);
+        if (vgetq_lane_u32(keep, 2)) out.push_back(ids[k + 2]);
+        if (vgetq_lane_u32(keep, 3)) out.push_back(ids[k + 3]);
+    }
+#else
+    (void)xy, (void)typeBits, (void)ids, (void)count, (void)origin, (void)range2, (void)typeMask, (void)out;
+#endif
+    return k;
+}
+
+// Добавляет в out те ids[k], у которых квадрат расстояния до origin (packXY) не больше
+// range2 и бит типа есть в typeMask. Векторно - набором simdLevel(), хвост - скалярно.
+inline void filterCandidates(const std::int32_t* xy, const std::uint32_t* typeBits, const size_t* ids, size_t count,
+                             std::int32_t origin, std::int32_t range2, std::uint32_t typeMask,
+                             std::vector<size_t>& out) {
+    size_t k = 0;
+    switch (simdLevel()) {
+#if DUNGEON_AVX2
+    case SimdLevel::AVX2:
+        k = filterAvx2(xy, typeBits, ids, count, origin, range2, typeMask, out);
+        break;
+#endif
+    case SimdLevel::SIMD128:
+        k = filterSimd128(xy, typeBits, ids, count, origin, range2, typeMask, out);
+        break;
+    default:
+        break;
+    }
+    const std::int32_t ox = static_cast<std::int16_t>(origin & 0xFFFF), oy = static_cast<std::int16_t>(origin >> 16);
+    for (; k < count; ++k) {
+        std::int32_t dx = static_cast<std::int16_t>(xy[k] & 0xFFFF) - ox;
+        std::int32_t dy = static_cast<std::int16_t>(xy[k] >> 16) - oy;
+        if (dx * dx + dy * dy <= range2 && (typeBits[k] & typeMask)) out.push_back(ids[k]);
+    }
+}
+
+// Равномерная сетка для боя: сторона ячейки ~ range, поэтому все пары
+// в радиусе боя лежат в соседних ячейках (координаты ограничены [0, maxCoord],
+// для подземелья - [0, 500])
+class SpatialGrid {
+    static constexpr int MAX_COORD = 500;
+    static constexpr int MAX_COLS = 1024; // на больших картах ячейка растёт, а не их число
+
+    int cellSize = 1;
+    int cols = 1;
+    std::vector<size_t> cellStart; // начало ячейки в items (CSR)
+    std::vector<size_t> items;     // индексы NPC, отсортированные по ячейкам
+    std::vector<std::int32_t> itemXY;        // packXY() в порядке items, см. pack()
+    std::vector<std::uint32_t> itemTypeBits; // 1 << NPCType в порядке items
+
+    int cellOf(int x, int y) const { return (y / cellSize) * cols + x / cellSize; }
+
+public:
+    // xAt(i), yAt(i) - координаты i-го NPC
+    template <typename XFn, typename YFn>
+    void build(size_t count, XFn xAt, YFn yAt, double range, int maxCoord = MAX_COORD) {
+        const int minCell = (maxCoord + MAX_COLS) / MAX_COLS;
+        cellSize = range >= maxCoord ? maxCoord + 1 : std::max(minCell, static_cast<int>(std::ceil(range)));
+        cols = maxCoord / cellSize + 1;
+
+        cellStart.assign(static_cast<size_t>(cols) * cols + 1, 0);
+        for (size_t i = 0; i < count; ++i) {
+            ++cellStart[cellOf(xAt(i), yAt(i)) + 1];
+        }
+        for (size_t c = 1; c < cellStart.size(); ++c) {
+            cellStart[c] += cellStart[c - 1];
+        }
+
+        // индексы внутри ячейки остаются по возрастанию
+        items.resize(count);
+        std::vector<size_t> fill(cellStart.begin(), cellStart.end() - 1);
+        for (size_t i = 0; i < count; ++i) {
+            items[fill[cellOf(xAt(i), yAt(i))]++] = i;
+        }
+    }
+
+    void build(const std::vector<NPCPtr>& npcs, double range) {
+        build(npcs.size(), [&](size_t i) { return npcs[i]->getX(); }, [&](size_t i) { return npcs[i]->getY(); }, range);
+    }
+
+    void build(const BattleView& view, double range, int maxCoord = MAX_COORD) {
+        build(view.size, [&](size_t i) { return view.x[i]; }, [&](size_t i) { return view.y[i]; }, range, maxCoord);
+    }
+
+    // Раскладывает координаты и типы в порядке items для filterCandidates()
+    void pack(const BattleView& view) {
+        itemXY.resize(items.size());
+        itemTypeBits.resize(items.size());
+        for (size_t k = 0; k < items.size(); ++k) {
+            itemXY[k] = packXY(view.x[items[k]], view.y[items[k]]);
+            itemTypeBits[k] = 1u << static_cast<unsigned>(view.type[items[k]]);
+        }
+    }
+
+    // Добавляет в out соседей j > i точки (x, y) в радиусе range2 с типом из typeMask.
+    // Нужен pack(); порядок j в out - по ячейкам, не по возрастанию. Возвращает число проверенных j.
+    size_t collectNear(size_t i, int x, int y, long long range2, std::uint32_t typeMask, std::vector<size_t>& out) const {
+        size_t examined = 0;
+        const std::int32_t origin = packXY(x, y);
+        const auto r2 = static_cast<std::int32_t>(std::min<long long>(range2, INT32_MAX));
+        int cx = x / cellSize, cy = y / cellSize;
+        for (int gy = std::max(0, cy - 1); gy <= std::min(cols - 1, cy + 1); ++gy) {
+            for (int gx = std::max(0, cx - 1); gx <= std::min(cols - 1, cx + 1); ++gx) {
+                int c = gy * cols + gx;
+                // индексы в ячейке возрастают: пропускаем j <= i
+                size_t from = std::upper_bound(items.begin() + cellStart[c], items.begin() + cellStart[c + 1], i) - items.begin();
+                size_t to = cellStart[c + 1];
+                filterCandidates(itemXY.data() + from, itemTypeBits.data() + from, items.data() + from, to - from,
+                                 origin, r2, typeMask, out);
+                examined += to - from;
+            }
+        }
+        return examined;
+    }
+
+    // Вызывает f(j) для всех NPC из ячейки (x, y) и восьми соседних
+    template <typename F>
+    void forEachNear(int x, int y, F&& f) const {
+        int cx = x / cellSize, cy = y / cellSize;
+        for (int gy = std::max(0, cy - 1); gy <= std::min(cols - 1, cy + 1); ++gy) {
+            for (int gx = std::max(0, cx - 1); gx <= std::min(cols - 1, cx + 1); ++gx) {
+                int c = gy * cols + gx;
+                for (size_t k = cellStart[c]; k < cellStart[c + 1]; ++k) {
+                    f(items[k]);
+                }
+            }
+        }
+    }
+};
+
+// Кандидаты фазы 1 для атакующих [begin, begin + ends.size()):
+// пары атакующего begin + k лежат в js[ends[k - 1], ends[k]) по возрастанию j
+struct CandidateList {
+    size_t begin = 0;
+    std::vector<size_t> ends;
+    std::vector<size_t> js;
+    std::vector<std::uint32_t> d2; // квадраты расстояний до js, только для BattleCache
+    size_t examined = 0; // проверено пар, для BattleStats
+
+    void reset(size_t first) {
+        begin = first;
+        ends.clear();
+        js.clear();
+        d2.clear();
+        examined = 0;
+    }
+};
+
+// Пары последнего полного боя: для каждого атакующего i - соседи j > i в радиусе range2
+// по возрастанию j и квадраты расстояний до них. Пока геометрия мира та же (geometry -
+// эпоха Dungeon, см. WorldVersion) и не ожил никто, мёртвый в начале того боя, бой
+// с радиусом не больше range2 берёт пары отсюда, без сетки и проверки расстояний.
+struct BattleCache {
+    std::uint64_t geometry = 0; // 0 - кэша нет (или он ещё строится)
+    long long range2 = -1;
+    std::vector<std::uint8_t> alive; // живые в начале того боя
+    std::vector<std::uint32_t> ends; // пары атакующего i - [ends[i - 1], ends[i])
+    std::vector<std::uint32_t> js, d2;
+
+    void clear() {
+        geometry = 0;
+        range2 = -1;
+        alive = std::vector<std::uint8_t>();
+        ends = std::vector<std::uint32_t>();
+        js = std::vector<std::uint32_t>();
+        d2 = std::vector<std::uint32_t>();
+    }
+
+    bool covers(std::uint64_t world, long long battleRange2, const BattleView& view) const {
+        if (geometry == 0 || geometry != world || battleRange2 > range2 || view.size != alive.size()) return false;
+        for (size_t i = 0; i < view.size; ++i) {
+            if (view.alive[i] > alive[i]) return false;
+        }
+        return true;
+    }
+
+    // Начать заново по бою над view; готов после finish()
+    void start(long long battleRange2, const BattleView& view) {
+        clear();
+        range2 = battleRange2;
+        alive.assign(view.alive, view.alive + view.size);
+        ends.reserve(view.size);
+    }
+
+    // Списки блоков по порядку атакующих; false - пар больше limit (не больше UINT32_MAX),
+    // кэш брошен
+    bool append(const CandidateList& list, size_t limit) {
+        if (js.size() + list.js.size() > limit) {
+            clear();
+            return false;
+        }
+        const size_t base = js.size();
+        for (size_t end : list.ends) ends.push_back(static_cast<std::uint32_t>(base + end));
+        js.insert(js.end(), list.js.begin(), list.js.end());
+        d2.insert(d2.end(), list.d2.begin(), list.d2.end());
+        return true;
+    }
+
+    void finish(std::uint64_t world) { geometry = world; }
+};
+
+#ifdef DUNGEON_WITH_OPENCL
+// Фаза 1 боя на устройстве OpenCL. Хост раскладывает NPC по ячейкам со
+// стороной не меньше радиуса, ядро для каждого атакующего обходит 3x3 ячейки и
+// сначала считает, затем пишет соседей j > i в радиусе с подходящим pairMask().
+// Итог - тот же CandidateList, что у collectCandidates: убийства разбирает хост.
+class GpuPairs {
+    static constexpr const char* SOURCE = R"CL(
+__kernel void pairs(__global const short* x, __global const short* y, __global const uchar* type,
+                    __global const uchar* alive, __global const uint* cellStart, __global const uint* cellItems,
+                    __global const uint* masks, uint begin, uint count, int cell, int cols, long range2, int write,
+                    __global const uint* offsets, __global uint* counts, __global uint* examined, __global uint* out) {
+    const uint k = get_global_id(0);
+    if (k >= count) return;
+    const uint i = begin + k;
+    uint found = 0, seen = 0;
+    if (alive[i]) {
+        const int cx = x[i] / cell, cy = y[i] / cell;
+        const uint mask = masks[type[i]];
+        for (int row = max(cy - 1, 0); row <= min(cy + 1, cols - 1); ++row) {
+            for (int col = max(cx - 1, 0); col <= min(cx + 1, cols - 1); ++col) {
+                const uint c = (uint)(row * cols + col);
+                for (uint p = cellStart[c]; p < cellStart[c + 1]; ++p) {
+                    const uint j = cellItems[p];
+                    if (j <= i) continue;
+                    ++seen;
+                    if (!((mask >> type[j]) & 1u)) continue; // живость j проверяет разбор пар
+                    const long dx = x[i] - x[j], dy = y[i] - y[j];
+                    if (dx * dx + dy * dy > range2) continue;
+                    if (write) out[offsets[k] + found] = j;
+                    ++found;
+                }
+            }
+        }
+    }
+    if (!write) {
+        counts[k] = found;
+        examined[k] = seen;
+    }
+}
+)CL";
+
+    struct Buffer {
+        cl_mem mem = nullptr;
+        size_t bytes = 0;
+    };
+
+    cl_context context = nullptr;
+    cl_command_queue queue = nullptr;
+    cl_program program = nullptr;
+    cl_kernel kernel = nullptr;
+    std::string device;
+    std::string error;
+    Buffer x, y, type, alive, cellStart, cellItems, masks, counts, examined, offsets, out;
+    int cell = 1, cols = 1;
+    cl_long range2 = 0;
+    std::vector<std::uint32_t> hostStart, hostItems, hostCounts, hostExamined, hostOffsets, hostOut;
+
+    bool check(cl_int status, const char* what) {
+        if (status == CL_SUCCESS) return true;
+        error = std::string(what) + ": код " + std::to_string(status);
+        return false;
+    }
+
+    bool reserve(Buffer& buffer, size_t bytes) {
+        if (buffer.bytes >= bytes && buffer.mem) return true;
+        if (buffer.mem) clReleaseMemObject(buffer.mem);
+        buffer.bytes = std::max<size_t>(bytes, 64);
+        cl_int status;
+        buffer.mem = clCreateBuffer(context, CL_MEM_READ_WRITE, buffer.bytes, nullptr, &status);
+        if (status != CL_SUCCESS) buffer = Buffer();
+        return check(status, "clCreateBuffer");
+    }
+
+    bool write(Buffer& buffer, const void* data, size_t bytes) {
+        if (!reserve(buffer, bytes)) return false;
+        return bytes == 0 || check(clEnqueueWriteBuffer(queue, buffer.mem, CL_TRUE, 0, bytes, data, 0, nullptr, nullptr), "clEnqueueWriteBuffer");
+    }
+
+    bool read(Buffer& buffer, void* data, size_t bytes) {
+        return bytes == 0 || check(clEnqueueReadBuffer(queue, buffer.mem, CL_TRUE, 0, bytes, data, 0, nullptr, nullptr), "clEnqueueReadBuffer");
+    }
+
+    bool run(cl_uint begin, cl_uint count, cl_int writePass) {
+        cl_mem args[] = {x.mem, y.mem, type.mem, alive.mem, cellStart.mem, cellItems.mem, masks.mem};
+        cl_uint at = 0;
+        bool ok = true;
+        for (cl_mem& mem : args) ok = ok && check(clSetKernelArg(kernel, at++, sizeof(cl_mem), &mem), "clSetKernelArg");
+        ok = ok && check(clSetKernelArg(kernel, at++, sizeof(begin), &begin), "clSetKernelArg") &&
+             check(clSetKernelArg(kernel, at++, sizeof(count), &count), "clSetKernelArg") &&
+             check(clSetKernelArg(kernel, at++, sizeof(cell), &cell), "clSetKernelArg") &&
+             check(clSetKernelArg(kernel, at++, sizeof(cols), &cols), "clSetKernelArg") &&
+             check(clSetKernelArg(kernel, at++, sizeof(range2), &range2), "clSetKernelArg") &&
+             check(clSetKernelArg(kernel, at++, sizeof(writePass), &writePass), "clSetKernelArg");
+        cl_mem outputs[] = {offsets.mem, counts.mem, examined.mem, out.mem};
+        for (cl_mem& mem : outputs) ok = ok && check(clSetKernelArg(kernel, at++, sizeof(cl_mem), &mem), "clSetKernelArg");
+        const size_t global = count;
+        return ok && check(clEnqueueNDRangeKernel(queue, kernel, 1, nullptr, &global, nullptr, 0, nullptr, nullptr), "clEnqueueNDRangeKernel") &&
+               check(clFinish(queue), "clFinish");
+    }
+
+    bool open() {
+        cl_uint platformCount = 0;
+        if (clGetPlatformIDs(0, nullptr, &platformCount) != CL_SUCCESS || platformCount == 0) {
+            error = "нет платформ OpenCL";
+            return false;
+        }
+        std::vector<cl_platform_id> platforms(platformCount);
+        if (!check(clGetPlatformIDs(platformCount, platforms.data(), nullptr), "clGetPlatformIDs")) return false;
+        // сначала GPU, затем любое устройство (ускоритель, OpenCL на CPU)
+        cl_device_id chosen = nullptr;
+        for (cl_device_type kind : {static_cast<cl_device_type>(CL_DEVICE_TYPE_GPU), static_cast<cl_device_type>(CL_DEVICE_TYPE_ALL)}) {
+            for (cl_platform_id platform : platforms) {
+                cl_uint found = 0;
+                if (!chosen && clGetDeviceIDs(platform, kind, 1, &chosen, &found) != CL_SUCCESS) chosen = nullptr;
+            }
+        }
+        if (!chosen) {
+            error = "нет устройств OpenCL";
+            return false;
+        }
+        char name[256] = {};
+        clGetDeviceInfo(chosen, CL_DEVICE_NAME, sizeof(name) - 1, name, nullptr);
+        device = name;
+
+        cl_int status;
+        context = clCreateContext(nullptr, 1, &chosen, nullptr, nullptr, &status);
+        if (!check(status, "clCreateContext")) return false;
+        queue = clCreateCommandQueue(context, chosen, 0, &status);
+        if (!check(status, "clCreateCommandQueue")) return false;
+        const char* source = SOURCE;
+        program = clCreateProgramWithSource(context, 1, &source, nullptr, &status);
+        if (!check(status, "clCreateProgramWithSource")) return false;
+        if (clBuildProgram(program, 1, &chosen, "", nullptr, nullptr) != CL_SUCCESS) {
+            size_t size = 0;
+            clGetProgramBuildInfo(program, chosen, CL_PROGRAM_BUILD_LOG, 0, nullptr, &size);
+            std::string log(size, '\0');
+            clGetProgramBuildInfo(program, chosen, CL_PROGRAM_BUILD_LOG, size, log.data(), nullptr);
+            log.resize(std::strlen(log.c_str()));
+            error = "ядро не собралось: " + log;
+            return false;
+        }
+        kernel = clCreateKernel(program, "pairs", &status);
+        return check(status, "clCreateKernel");
+    }
+
+public:
+    GpuPairs() = default;
+    GpuPairs(const GpuPairs&) = delete;
+    GpuPairs& operator=(const GpuPairs&) = delete;
+
+    ~GpuPairs() {
+        for (Buffer* buffer : {&x, &y, &type, &alive, &cellStart, &cellItems, &masks, &counts, &examined, &offsets, &out}) {
+            if (buffer->mem) clReleaseMemObject(buffer->mem);
+        }
+        if (kernel) clReleaseKernel(kernel);
+        if (program) clReleaseProgram(program);
+        if (queue) clReleaseCommandQueue(queue);
+        if (context) clReleaseContext(context);
+    }
+
+    // nullptr, если устройства нет или ядро не собралось; причина - в why
+    static std::unique_ptr<GpuPairs> create(std::string& why) {
+        auto gpu = std::make_unique<GpuPairs>();
+        if (gpu->open()) return gpu;
+        why = gpu->error;
+        return nullptr;
+    }
+
+    const std::string& deviceName() const { return device; }
+    const std::string& lastError() const { return error; }
+
+    // В начале боя: координаты, типы и ячейки NPC. Как и в SpatialGrid, в ячейках
+    // есть и мёртвые до сжатия - кандидаты и BattleStats те же, что у simd
+    bool upload(BattleView view, long long battleRange2) {
+        range2 = battleRange2;
+        const double reach = std::ceil(std::sqrt(static_cast<double>(battleRange2)));
+        cell = static_cast<int>(std::clamp(reach, 1.0, 501.0));
+        cols = 500 / cell + 1;
+        hostStart.assign(static_cast<size_t>(cols) * cols + 1, 0);
+        auto cellOf = [&](size_t i) { return static_cast<size_t>(view.y[i] / cell) * cols + static_cast<size_t>(view.x[i] / cell); };
+        for (size_t i = 0; i < view.size; ++i) {
+            ++hostStart[cellOf(i) + 1];
+        }
+        for (size_t c = 1; c < hostStart.size(); ++c) hostStart[c] += hostStart[c - 1];
+        hostItems.resize(hostStart.back());
+        std::vector<std::uint32_t> cursor(hostStart.begin(), hostStart.end() - 1);
+        for (size_t i = 0; i < view.size; ++i) {
+            hostItems[cursor[cellOf(i)]++] = static_cast<std::uint32_t>(i);
+        }
+        std::uint32_t typeMasks[NPC_TYPE_COUNT];
+        for (size_t t = 0; t < NPC_TYPE_COUNT; ++t) typeMasks[t] = pairMask(static_cast<NPCType>(t));
+        return write(x, view.x, view.size * sizeof(std::int16_t)) && write(y, view.y, view.size * sizeof(std::int16_t)) &&
+               write(type, view.type, view.size * sizeof(NPCType)) && write(alive, view.alive, view.size) &&
+               write(cellStart, hostStart.data(), hostStart.size() * sizeof(std::uint32_t)) &&
+               write(cellItems, hostItems.data(), hostItems.size() * sizeof(std::uint32_t)) &&
+               write(masks, typeMasks, sizeof(typeMasks));
+    }
+
+    // Кандидаты атакующих [begin, end) с учётом убитых к этому моменту
+    bool collect(BattleView view, size_t begin, size_t end, CandidateList& list) {
+        list.reset(begin);
+        const size_t count = end - begin;
+        if (count == 0) return true;
+        if (!write(alive, view.alive, view.size) || !reserve(counts, count * sizeof(std::uint32_t)) ||
+            !reserve(examined, count * sizeof(std::uint32_t)) || !reserve(offsets, count * sizeof(std::uint32_t)) ||
+            !reserve(out, sizeof(std::uint32_t)) || !run(static_cast<cl_uint>(begin), static_cast<cl_uint>(count), 0)) {
+            return false;
+        }
+        hostCounts.resize(count);
+        hostExamined.resize(count);
+        if (!read(counts, hostCounts.data(), count * sizeof(std::uint32_t)) ||
+            !read(examined, hostExamined.data(), count * sizeof(std::uint32_t))) {
+            return false;
+        }
+        hostOffsets.resize(count);
+        std::uint64_t total = 0;
+        for (size_t k = 0; k < count; ++k) {
+            hostOffsets[k] = static_cast<std::uint32_t>(total);
+            total += hostCounts[k];
+            list.examined += hostExamined[k];
+        }
+        if (total > UINT32_MAX) {
+            error = "слишком много пар в блоке";
+            return false;
+        }
+        hostOut.resize(static_cast<size_t>(total));
+        if (!write(offsets, hostOffsets.data(), count * sizeof(std::uint32_t)) ||
+            !reserve(out, hostOut.size() * sizeof(std::uint32_t)) || !run(static_cast<cl_uint>(begin), static_cast<cl_uint>(count), 1) ||
+            !read(out, hostOut.data(), hostOut.size() * sizeof(std::uint32_t))) {
+            return false;
+        }
+        list.js.assign(hostOut.begin(), hostOut.end());
+        for (size_t k = 0; k < count; ++k) {
+            const size_t from = hostOffsets[k], to = from + hostCounts[k];
+            std::sort(list.js.begin() + static_cast<std::ptrdiff_t>(from), list.js.begin() + static_cast<std::ptrdiff_t>(to));
+            list.ends.push_back(to);
+        }
+        return true;
+    }
+};
+#else
+// Сборка без OpenCL: движок GPU недоступен, бой идёт на SIMD
+class GpuPairs {
+public:
+    static std::unique_ptr<GpuPairs> create(std::string& why) {
+        why = "сборка без -DDUNGEON_WITH_OPENCL";
+        return nullptr;
+    }
+    const std::string& deviceName() const { return error; }
+    const std::string& lastError() const { return error; }
+    bool upload(BattleView, long long) { return false; }
+    bool collect(BattleView, size_t, size_t, CandidateList&) { return false; }
+
+private:
+    std::string error;
+};
+#endif
+
+// Постоянный индекс NPC сеткой с фиксированной ячейкой. В отличие от SpatialGrid,
+// который строится заново на каждый бой, обновляется по одному NPC при добавлении
+// и перемещении, поэтому поиск соседей нескольких NPC не требует прохода по миру.
+class PointIndex {
+    static constexpr int MAX_COORD = 500;
+    static constexpr int CELL = 16;
+    static constexpr int COLS = MAX_COORD / CELL + 1;
+
+    std::vector<std::vector<std::uint32_t>> cells{static_cast<size_t>(COLS) * COLS};
+
+    static size_t cellOf(int x, int y) { return static_cast<size_t>((y / CELL) * COLS + x / CELL); }
+
+public:
+    void clear() {
+        for (auto& cell : cells) cell.clear();
+    }
+
+    void insert(size_t id, int x, int y) { cells[cellOf(x, y)].push_back(static_cast<std::uint32_t>(id)); }
+
+    void erase(size_t id, int x, int y) {
+        auto& cell = cells[cellOf(x, y)];
+        auto it = std::find(cell.begin(), cell.end(), static_cast<std::uint32_t>(id));
+        if (it == cell.end()) return;
+        *it = cell.back();
+        cell.pop_back();
+    }
+
+    void move(size_t id, int fromX, int fromY, int toX, int toY) {
+        if (cellOf(fromX, fromY) == cellOf(toX, toY)) return;
+        erase(id, fromX, fromY);
+        insert(id, toX, toY);
+    }
+
+    // Живые NPC view с номерами от from; сначала считает, сколько добавится в каждую
+    // ячейку, чтобы каждая выросла один раз
+    void insertRange(const BattleView& view, size_t from) {
+        std::vector<std::uint32_t> added(cells.size(), 0);
+        for (size_t i = from; i < view.size; ++i) added[cellOf(view.x[i], view.y[i])] += view.alive[i];
+        for (size_t c = 0; c < cells.size(); ++c) {
+            if (added[c]) cells[c].reserve(cells[c].size() + added[c]);
+        }
+        for (size_t i = from; i < view.size; ++i) {
+            if (view.alive[i]) insert(i, view.x[i], view.y[i]);
+        }
+    }
+
+    // Только живые NPC view
+    void rebuild(const BattleView& view) {
+        clear();
+        insertRange(view, 0);
+    }
+
+    // f(id) для NPC из ячеек, пересекающих квадрат [x - reach, x + reach] x [y - reach, y + reach];
+    // порядок id произвольный, точное расстояние проверяет вызывающий
+    template <typename F>
+    void forEachInBox(int x, int y, int reach, F&& f) const {
+        const int fromX = std::max(0, x - reach) / CELL, toX = std::min(MAX_COORD, x + reach) / CELL;
+        const int fromY = std::max(0, y - reach) / CELL, toY = std::min(MAX_COORD, y + reach) / CELL;
+        for (int cy = fromY; cy <= toY; ++cy) {
+            for (int cx = fromX; cx <= toX; ++cx) {
+                for (std::uint32_t id : cells[static_cast<size_t>(cy * COLS + cx)]) f(id);
+            }
+        }
+    }
+
+    // f(id) для NPC из ячеек кольца ring вокруг ячейки точки (x, y) в [0, 500]. Возвращает
+    // радиус, ближе которого нет NPC вне колец 0..ring, или -1, если кольцо уже вне мира.
+    template <typename F>
+    long long forEachInRing(int x, int y, int ring, F&& f) const {
+        const int cx = x / CELL, cy = y / CELL;
+        const int fromX = cx - ring, toX = cx + ring, fromY = cy - ring, toY = cy + ring;
+        if (fromX < 0 && fromY < 0 && toX >= COLS && toY >= COLS) return -1;
+        auto visit = [&](int col, int row) {
+            if (col < 0 || col >= COLS || row < 0 || row >= COLS) return;
+            for (std::uint32_t id : cells[static_cast<size_t>(row * COLS + col)]) f(id);
+        };
+        for (int col = fromX; col <= toX; ++col) {
+            visit(col, fromY);
+            if (toY != fromY) visit(col, toY);
+        }
+        for (int row = fromY + 1; row < toY; ++row) {
+            visit(fromX, row);
+            visit(toX, row);
+        }
+        // стороны за краем мира не ограничивают: там NPC нет
+        long long covered = std::numeric_limits<long long>::max();
+        if (fromX > 0) covered = std::min<long long>(covered, x - fromX * CELL + 1);
+        if (toX < COLS - 1) covered = std::min<long long>(covered, (toX + 1) * CELL - x);
+        if (fromY > 0) covered = std::min<long long>(covered, y - fromY * CELL + 1);
+        if (toY < COLS - 1) covered = std::min<long long>(covered, (toY + 1) * CELL - y);
+        return covered;
+    }
+};
+
+// Накопленная статистика боёв. Пары в радиусе для движка simd - только те, где
+// возможно убийство (остальные отсеивает pairMask); время журнала - только flush(),
+// сами onKill входят во время боя.
+struct BattleStats {
+    enum Phase { GRID, PAIRS, RESOLVE, FLUSH, COMPACT, PHASE_COUNT };
+
+    std::uint64_t battles = 0;
+    std::uint64_t incremental = 0;   // из них только по грязным NPC
+    std::uint64_t cached = 0;        // из них по парам прошлого боя (BattleCache)
+    std::uint64_t pairsExamined = 0; // пар, дошедших до проверки расстояния
+    std::uint64_t pairsInRange = 0;
+    std::uint64_t kills[NPC_TYPE_COUNT][NPC_TYPE_COUNT] = {}; // [убийца][жертва]
+    std::uint64_t nanos[PHASE_COUNT] = {};
+    std::uint64_t bytesLogged = 0;   // встроенными журналами (консоль и log.txt)
+
+    static const char* phaseKey(Phase phase) {
+        switch (phase) {
+            case GRID: return "grid";
+            case PAIRS: return "pairs";
+            case RESOLVE: return "resolve";
+            case FLUSH: return "flush";
+            case COMPACT: return "compact";
+            case PHASE_COUNT: break;
+        }
+        return "";
+    }
+};
+
+// Замер фаз подряд: lap(phase) добавляет время с прошлой отметки. Без DUNGEON_STATS - пустой.
+class PhaseTimer {
+    using Clock = std::chrono::steady_clock;
+    BattleStats& stats;
+    Clock::time_point last;
+public:
+    explicit PhaseTimer(BattleStats& stats) : stats(stats) {
+        if constexpr (DUNGEON_STATS) last = Clock::now();
+    }
+
+    void lap(BattleStats::Phase phase) {
+        if constexpr (DUNGEON_STATS) {
+            const auto now = Clock::now();
+            stats.nanos[phase] += static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count());
+            last = now;
+        }
+    }
+};
+
+// Способ хранения NPC в подземелье
+enum class StorageMode { OBJECTS, SOA };
+
+// Итог Dungeon::recover()
+struct RecoveryReport {
+    size_t replayed = 0;      // записей журнала применено
+    bool journalUsed = false; // false - журнала нет или он от другого снимка
+};
+
+// Движок боя: VISITOR - двойная диспетчеризация через BattleVisitor (только OBJECTS),
+// TABLE - таблица KILL_MATRIX по байту NPCType без виртуальных вызовов,
+// SIMD - то же, но кандидаты отбираются векторно по радиусу и pairMask(),
+// GPU - кандидаты отбирает устройство OpenCL (GpuPairs), убийства разбирает хост
+enum class BattleEngine { VISITOR, TABLE, SIMD, GPU };
+
+// Класс подземелья
+class Dungeon {
+    StorageMode storage;
+    BattleEngine engine = BattleEngine::SIMD;
+    NPCArena arena;                         // до npcs: переживает их при разрушении
+    NameTable names;                        // имена npcs
+    std::vector<NPCPtr> npcs;               // StorageMode::OBJECTS
+    NPCStore store;                         // StorageMode::SOA
+    NPCStore packed;                        // зеркало npcs для боя, имена - в names
+    std::unique_ptr<AsyncObserver> consoleLog; // встроенные журналы, см. setLogging()
+    std::unique_ptr<AsyncObserver> fileLog;
+    std::ostream* console = &std::cout;
+    std::string logFile = "log.txt";
+    ObserverList observers;
+    SpatialGrid grid;
+    std::vector<size_t> nearby;
+    size_t threadCount = 1;
+    std::unique_ptr<ThreadPool> pool;
+    std::vector<CandidateList> candidates; // по одному списку на поток
+    std::unique_ptr<GpuPairs> gpu;         // BattleEngine::GPU
+    std::string gpuStatus;                 // почему GPU недоступен
+    PointIndex index;                      // живые NPC активного хранилища между боями
+    std::vector<size_t> dirty;             // добавлены после прошлого боя
+    long long settledRange2 = -1;          // см. battleDirty(); -1 - следующий бой полный
+    std::vector<std::pair<size_t, size_t>> dirtyPairs;
+    double compactionThreshold = 0.25;     // доля мёртвых, после которой мир уплотняется
+    size_t deadCount = 0;                  // мёртвые, ещё лежащие в хранилище
+    size_t aliveCounts[NPC_TYPE_COUNT] = {}; // живых по типам, см. count()
+    BattleStats stats;
+    Progress* progress = nullptr;         // setProgress(): ход и отмена боя и загрузки
+    std::vector<std::uint8_t> badRecords; // addNPCs()
+    std::future<bool> backgroundSave;     // saveToFileAsync(); разрушение дожидается записи
+    std::uint64_t layoutEpoch = 1;        // растёт, когда id NPC сдвигаются (уплотнение, очистка)
+    std::uint64_t geometryEpoch = 1;      // эпоха координат и id NPC, см. moved()
+    std::uint64_t geometryCounter = 1;    // последняя выданная эпоха: номера не повторяются
+    BattleCache cache;                    // пары полного боя после restore(), см. battleTable()
+    size_t cacheLimit = BATTLE_CACHE_PAIRS;
+    std::uint64_t battledGeometry = 0;    // геометрия последнего полного боя по сетке,
+    long long battledRange2 = -1;         // его радиус
+    size_t battledPairs = 0;              // и собранные в нём пары
+    bool repeatGeometry = false;          // restore() вернул battledGeometry
+    WorldVersion lastVersion;             // последний snapshot(): с ним делит страницы следующий
+    std::vector<std::uint8_t> pageChanged; // страницы, изменённые после lastVersion
+    std::vector<size_t> changedPages;
+    std::unique_ptr<Journal> journal;     // openJournal(); в observers, пока открыт
+    std::string journalSnapshot;          // файл контрольных точек журнала
+    std::uint64_t checkpointBytes = 0;    // размер последнего снимка контрольной точки
+    std::array<int, NPC_TYPE_COUNT> speeds = Species::speeds; // клеток за такт по каждой оси
+    std::uint64_t ticks = 0;
+    std::vector<std::int16_t> nextX, nextY; // задний буфер: координаты следующего такта
+    bool movesReady = false;                // pendingMoves посчитан от текущего мира
+    std::future<void> pendingMoves;         // последним: разрушается первым и дожидается расчёта
+
+    static constexpr size_t PARALLEL_BLOCK = 4096; // атакующих на поток за один блок
+    static constexpr size_t GPU_BLOCK = 1 << 20;   // атакующих за один запуск ядра
+    static constexpr size_t INCREMENTAL_LIMIT = 4; // при грязных > size / 4 полный бой дешевле
+    static constexpr size_t NAME_SLACK = 2;        // уплотнение чистит имена, когда их > NAME_SLACK * NPC
+    static constexpr size_t BATTLE_CACHE_PAIRS = 1 << 23; // пар в BattleCache (8 байт на пару)
+    static constexpr size_t PRINT_BUFFER = 64 << 10;
+    static constexpr size_t PROGRESS_RECORDS = 4096; // записей сохранения между проверками Progress
+    static constexpr std::uint64_t JOURNAL_MIN = 1 << 20; // раньше контрольная точка не нужна
+
+    // Текстовое сохранение: forEach(f) вызывает f(type, name, x, y) для каждой записи.
+    // После отмены через progress остальные записи пропускаются, файл удаляется.
+    template <typename ForEach>
+    static bool writeText(const std::string& filename, ForEach&& forEach, Progress* progress = nullptr) {
+        BufferedWriter out(filename);
+        if (!out.isOpen()) return false;
+        size_t pending = 0;
+        bool stopped = false;
+        forEach([&](NPCType type, std::string_view name, int x, int y) {
+            if (stopped) return;
+            if (progress && ++pending == PROGRESS_RECORDS) {
+                stopped = !progress->advance(pending);
+                pending = 0;
+            }
+            out.write(NPCFactory::typeKeyword(type));
+            out.put(' ');
+            out.write(name);
+            out.put(' ');
+            out.writeInt(x);
+            out.put(' ');
+            out.writeInt(y);
+            out.put('\n');
+        });
+        if (progress) progress->advance(pending);
+        if (!stopped) return out.finish();
+        out.finish();
+        std::remove(filename.c_str());
+        return false;
+    }
+
+    // Запись id изменилась после lastVersion
+    void touch(size_t id) {
+        const size_t page = id / WorldVersion::PAGE;
+        if (page >= pageChanged.size()) pageChanged.resize(page + 1, 0);
+        if (pageChanged[page]) return;
+        pageChanged[page] = 1;
+        changedPages.push_back(page);
+    }
+
+    // id NPC сдвинулись или пропали: версии до этого не делят страниц с миром
+    void relayout() {
+        ++layoutEpoch;
+        pageChanged.clear();
+        changedPages.clear();
+        moved();
+    }
+
+    // NPC добавлен или сдвинут, либо сменились id: пары прошлых боёв (cache) больше
+    // не подходят. Убийства геометрию не меняют.
+    void moved() { geometryEpoch = ++geometryCounter; }
+
+    // Страница page активного хранилища копией для WorldVersion
+    std::shared_ptr<const WorldVersion::Page> copyPage(size_t page) const {
+        const NPCStore& source = activeStore();
+        auto copy = std::make_shared<WorldVersion::Page>();
+        const size_t from = page * WorldVersion::PAGE;
+        const size_t count = std::min(WorldVersion::PAGE, source.size() - from);
+        std::copy_n(source.x.begin() + from, count, copy->x);
+        std::copy_n(source.y.begin() + from, count, copy->y);
+        std::copy_n(source.type.begin() + from, count, copy->type);
+        std::copy_n(source.alive.begin() + from, count, copy->alive);
+        std::copy_n(source.nameId.begin() + from, count, copy->nameId);
+        return copy;
+    }
+
+    void append(NPCType type, std::string_view name, int x, int y) {
+        appendUnindexed(type, name, x, y);
+        index.insert(activeSize() - 1, x, y);
+    }
+
+    // append() без индекса: пачку addNPCs() индексирует insertRange()
+    void appendUnindexed(NPCType type, std::string_view name, int x, int y) {
+        settleMoves();
+        if (storage == StorageMode::SOA) {
+            store.add(type, name, x, y);
+        } else {
+            npcs.push_back(NPCFactory::createNPC(type, name, x, y, arena, names));
+            packed.addWithNameId(type, npcs.back()->getNameId(), x, y);
+        }
+        dirty.push_back(activeSize() - 1);
+        touch(activeSize() - 1);
+        moved();
+        ++aliveCounts[static_cast<size_t>(type)];
+        observers.onAdd(activeSize() - 1, type, name, x, y);
+    }
+
+    static std::uint64_t mix(std::uint64_t value) {
+        value += 0x9E3779B97F4A7C15ULL;
+        value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+        return value ^ (value >> 31);
+    }
+
+    // Задний буфер такта tick: каждый живой NPC сдвигается на случайный шаг до
+    // speeds[type] по каждой оси внутри [0, 500]; мёртвые стоят. Шаг зависит от tick
+    // и номера NPC среди живых, поэтому не меняется от уплотнения. Только читает view.
+    void computeMoves(BattleView view, std::uint64_t tick) {
+        nextX.resize(view.size);
+        nextY.resize(view.size);
+        // firstRank[part] - номер первого живого NPC части среди живых
+        std::vector<std::uint64_t> firstRank(std::max<size_t>(1, threadCount) + 1, 0);
+        auto countAlive = [&](size_t part, size_t from, size_t to) {
+            firstRank[part + 1] = static_cast<std::uint64_t>(std::count(view.alive + from, view.alive + to, 1));
+        };
+        auto work = [&](size_t part, size_t from, size_t to) {
+            std::uint64_t rank = firstRank[part];
+            for (size_t i = from; i < to; ++i) {
+                const int speed = speeds[static_cast<size_t>(view.type[i])];
+                if (!view.alive[i] || speed == 0) {
+                    rank += view.alive[i];
+                    nextX[i] = view.x[i];
+                    nextY[i] = view.y[i];
+                    continue;
+                }
+                const std::uint64_t h = mix(tick * 0x100000001B3ULL ^ rank++);
+                const auto span = static_cast<std::uint32_t>(2 * speed + 1);
+                const int dx = static_cast<int>(static_cast<std::uint32_t>(h) % span) - speed;
+                const int dy = static_cast<int>(static_cast<std::uint32_t>(h >> 32) % span) - speed;
+                nextX[i] = static_cast<std::int16_t>(std::clamp(view.x[i] + dx, 0, 500));
+                nextY[i] = static_cast<std::int16_t>(std::clamp(view.y[i] + dy, 0, 500));
+            }
+        };
+        if (threadCount <= 1) {
+            work(0, 0, view.size);
+            return;
+        }
+        if (!pool || pool->size() != threadCount) pool = std::make_unique<ThreadPool>(threadCount);
+        pool->parallelFor(view.size, countAlive);
+        for (size_t part = 1; part < firstRank.size(); ++part) firstRank[part] += firstRank[part - 1];
+        pool->parallelFor(view.size, work);
+    }
+
+    // Перед любым изменением мира: дождаться фонового расчёта и считать его устаревшим
+    void settleMoves() {
+        if (pendingMoves.valid()) pendingMoves.get();
+        movesReady = false;
+    }
+
+    // Задний буфер становится передним; переместившиеся NPC обновляют индекс и
+    // становятся грязными, поэтому следующий бой может остаться инкрементальным
+    void applyMoves() {
+        NPCStore& front = storage == StorageMode::SOA ? store : packed;
+        for (size_t i = 0; i < front.size(); ++i) {
+            if (!front.alive[i] || (nextX[i] == front.x[i] && nextY[i] == front.y[i])) continue;
+            index.move(i, front.x[i], front.y[i], nextX[i], nextY[i]);
+            dirty.push_back(i);
+            touch(i);
+            observers.onMove(i, nextX[i], nextY[i]);
+            if (storage == StorageMode::OBJECTS) npcs[i]->moveTo(nextX[i], nextY[i]);
+        }
+        front.x.swap(nextX);
+        front.y.swap(nextY);
+        moved();
+    }
+
+    // Весь мир разом: NPC уничтожаются, пулы арены начинаются заново
+    // Заменяет мир загруженным. SOA берёт хранилище целиком, OBJECTS - через addNPCs()
+    void install(NPCStore&& loaded) {
+        clearWorld();
+        if (storage == StorageMode::SOA) {
+            store = std::move(loaded);
+            index.rebuild(store.view());
+            for (NPCType type : store.type) ++aliveCounts[static_cast<size_t>(type)];
+        } else {
+            std::vector<NPCRecordView> records(loaded.size());
+            for (size_t i = 0; i < loaded.size(); ++i) records[i] = {loaded.type[i], loaded.nameAt(i), loaded.x[i], loaded.y[i]};
+            addNPCs(records);
+        }
+    }
+
+    // Пул для загрузки файлов; nullptr - один поток. Тот же пул считает фоновый
+    // такт (computeMoves), а parallelFor не реентерабелен, поэтому такт дожидаемся.
+    ThreadPool* loadPool() {
+        settleMoves();
+        if (threadCount <= 1) return nullptr;
+        if (!pool || pool->size() != threadCount) pool = std::make_unique<ThreadPool>(threadCount);
+        return pool.get();
+    }
+
+    void clearWorld() {
+        settleMoves();
+        npcs.clear();
+        packed.clear();
+        arena.release();
+        names.clear();
+        store.clear();
+        index.clear();
+        dirty.clear();
+        settledRange2 = -1;
+        deadCount = 0;
+        std::fill(std::begin(aliveCounts), std::end(aliveCounts), 0);
+        relayout();
+    }
+
+    // f(type, name, x, y) для каждого живого NPC в порядке хранения
+    template <typename F>
+    void forEachAlive(F&& f) const {
+        if (storage == StorageMode::SOA) {
+            for (size_t i = 0; i < store.size(); ++i) {
+                if (!store.alive[i]) continue;
+                f(store.type[i], store.nameAt(i), store.x[i], store.y[i]);
+            }
+        } else {
+            for (const auto& npc : npcs) {
+                if (!npc->isAlive()) continue;
+                f(npc->getType(), npc->getName(), npc->getX(), npc->getY());
+            }
+        }
+    }
+
+    void removeDeadObjects() {
+        npcs.erase(
+            std::remove_if(npcs.begin(), npcs.end(), [](const NPCPtr& npc) { return !npc->isAlive(); }),
+            npcs.end()
+        );
+    }
+
+    // Считает убийства BattleVisitor по парам типов и передаёт их дальше
+    class KillCounter : public Observer {
+        Observer& next;
+        BattleStats& stats;
+    public:
+        KillCounter(Observer& next, BattleStats& stats) : next(next), stats(stats) {}
+        void onKill(const NPC& killer, const NPC& victim) override {
+            if constexpr (DUNGEON_STATS) {
+                ++stats.kills[static_cast<size_t>(killer.getType())][static_cast<size_t>(victim.getType())];
+            }
+            next.onKill(killer, victim);
+        }
+        void onKill(std::string_view killerName, std::string_view victimName) override {
+            next.onKill(killerName, victimName);
+        }
+    };
+
+    // false - прерван через progress (см. battle())
+    bool battleVisitor(double range) {
+        PhaseTimer timer(stats);
+        KillCounter counter(observers, stats);
+        BattleVisitor visitor(range, counter);
+        const long long range2 = rangeSquared(range);
+        bool finished = true;
+        if (range >= 0) {
+            if (progress) progress->start(npcs.size());
+            grid.build(npcs, range);
+            timer.lap(BattleStats::GRID);
+            for (size_t i = 0; i < npcs.size(); ++i) {
+                if (progress && i > 0 && i % PARALLEL_BLOCK == 0 && !progress->advance(PARALLEL_BLOCK)) {
+                    finished = false;
+                    break;
+                }
+                if (!npcs[i]->isAlive()) continue;
+                // соседи j > i в порядке возрастания, как в полном переборе пар
+                nearby.clear();
+                grid.forEachNear(npcs[i]->getX(), npcs[i]->getY(), [&](size_t j) {
+                    if (j > i) nearby.push_back(j);
+                });
+                std::sort(nearby.begin(), nearby.end());
+                for (size_t j : nearby) {
+                    if (!npcs[j]->isAlive()) continue;
+                    if constexpr (DUNGEON_STATS) {
+                        ++stats.pairsExamined;
+                        stats.pairsInRange += npcs[i]->inRange(*npcs[j], range2);
+                    }
+                    visitor.setOther(npcs[j].get());
+                    npcs[i]->accept(visitor);
+                    visitor.setOther(npcs[i].get());
+                    npcs[j]->accept(visitor);
+                }
+            }
+            timer.lap(BattleStats::RESOLVE);
+        }
+        size_t kills = 0;
+        for (size_t i = 0; i < npcs.size(); ++i) {
+            if (packed.alive[i] && !npcs[i]->isAlive()) {
+                packed.alive[i] = 0;
+                --aliveCounts[static_cast<size_t>(packed.type[i])];
+                touch(i);
+                observers.onKilled(i);
+                ++kills;
+            }
+        }
+        noteKills(kills);
+        return finished;
+    }
+
+    // Фаза 1: для атакующих [begin, end), живых в attackers, - соседи j > i в радиусе, по
+    // возрастанию j; с distances - и квадраты расстояний до них (для BattleCache).
+    // Только читает сетку и view, поэтому части диапазона можно считать параллельно.
+    void collectCandidates(BattleView view, long long range2, bool simd, const std::uint8_t* attackers, bool distances,
+                           size_t begin, size_t end, CandidateList& out) const {
+        out.reset(begin);
+        for (size_t i = begin; i < end; ++i) {
+            size_t first = out.js.size();
+            if (attackers[i]) {
+                if (simd) {
+                    // отобраны только пары, способные что-то изменить
+                    out.examined += grid.collectNear(i, view.x[i], view.y[i], range2, pairMask(view.type[i]), out.js);
+                } else {
+                    grid.forEachNear(view.x[i], view.y[i], [&](size_t j) {
+                        if (j <= i) return;
+                        ++out.examined;
+                        long long dx = view.x[i] - view.x[j], dy = view.y[i] - view.y[j];
+                        if (dx * dx + dy * dy <= range2) out.js.push_back(j);
+                    });
+                }
+                std::sort(out.js.begin() + first, out.js.end());
+                if (distances) {
+                    for (size_t c = first; c < out.js.size(); ++c) {
+                        const std::int32_t dx = view.x[i] - view.x[out.js[c]], dy = view.y[i] - view.y[out.js[c]];
+                        out.d2.push_back(static_cast<std::uint32_t>(dx * dx + dy * dy));
+                    }
+                }
+            }
+            out.ends.push_back(out.js.size());
+        }
+    }
+
+    // Одна пара при живом j: сначала i атакует j, затем j атакует i (как в BattleVisitor)
+    template <typename KillFn>
+    static void resolvePair(BattleView view, size_t i, size_t j, KillFn& onKill) {
+        if (canKill(view.type[i], view.type[j])) {
+            view.alive[j] = 0;
+            onKill(i, j);
+        }
+        if (view.alive[i] && canKill(view.type[j], view.type[i])) {
+            view.alive[i] = 0;
+            onKill(j, i);
+        }
+    }
+
+    // Фаза 2: последовательно, в порядке (i, j) по возрастанию - итог не зависит
+    // от числа потоков и совпадает с BattleVisitor
+    template <typename KillFn>
+    static void resolveCandidates(BattleView view, const CandidateList& list, KillFn& onKill) {
+        size_t from = 0;
+        for (size_t k = 0; k < list.ends.size(); ++k) {
+            const size_t i = list.begin + k, to = list.ends[k];
+            if (view.alive[i]) {
+                for (size_t c = from; c < to; ++c) {
+                    if (view.alive[list.js[c]]) resolvePair(view, i, list.js[c], onKill);
+                }
+            }
+            from = to;
+        }
+    }
+
+    // Фаза 2 по cache (cache.covers()): те же пары в том же порядке, отобранные по range2
+    template <typename KillFn>
+    void resolveCached(BattleView view, long long range2, KillFn& onKill) {
+        size_t from = 0;
+        for (size_t i = 0; i < view.size; ++i) {
+            const size_t to = cache.ends[i];
+            if (view.alive[i]) {
+                if constexpr (DUNGEON_STATS) stats.pairsExamined += to - from;
+                for (size_t c = from; c < to; ++c) {
+                    if (cache.d2[c] > range2) continue;
+                    if constexpr (DUNGEON_STATS) ++stats.pairsInRange;
+                    if (view.alive[cache.js[c]]) resolvePair(view, i, cache.js[c], onKill);
+                }
+            }
+            from = to;
+        }
+    }
+
+    // Тот же порядок пар, что и у BattleVisitor: сначала i атакует j, затем j атакует i.
+    // onKill(killer, victim) вызывается после пометки жертвы мёртвой. false - прерван
+    // через progress между блоками атакующих. Бой после restore() к уже сражавшейся
+    // геометрии (undo и повтор, перебор радиусов) запоминает пары в cache, и следующие
+    // бои с тем же или меньшим радиусом по этой геометрии берут их оттуда. Пары для
+    // кэша собираются от всех живых в начале боя (иначе после undo их не хватит), это
+    // дороже обычного боя, поэтому первый бой по геометрии их не копит.
+    template <typename KillFn>
+    bool battleTable(BattleView view, double range, KillFn onKill) {
+        long long range2 = rangeSquared(range);
+        if (range2 < 0) return true;
+        PhaseTimer timer(stats);
+        if (progress) progress->start(view.size);
+        if (cache.covers(geometryEpoch, range2, view)) {
+            resolveCached(view, range2, onKill);
+            if constexpr (DUNGEON_STATS) ++stats.cached;
+            timer.lap(BattleStats::RESOLVE);
+            if (progress) progress->advance(view.size);
+            return true;
+        }
+        const bool simd = engine == BattleEngine::SIMD || engine == BattleEngine::GPU;
+        bool onGpu = engine == BattleEngine::GPU && gpu;
+        if (onGpu && !gpu->upload(view, range2)) onGpu = gpuFailed();
+        auto buildGrid = [&] {
+            grid.build(view, range);
+            if (simd) grid.pack(view);
+        };
+        if (!onGpu) buildGrid();
+        timer.lap(BattleStats::GRID);
+
+        // Атакующие идут блоками, чтобы память под кандидатов не росла с размером мира
+        const bool parallel = threadCount > 1;
+        if (parallel && (!pool || pool->size() != threadCount)) pool = std::make_unique<ThreadPool>(threadCount);
+        candidates.resize(onGpu ? 1 : threadCount);
+        const size_t block = onGpu ? GPU_BLOCK : PARALLEL_BLOCK * threadCount;
+        // пар по прошлому бою этой геометрии - примерно пропорционально площади круга и с
+        // запасом вдвое: атакующих, живых в начале боя, больше, чем доживших до своей строки
+        const double expected = 2.0 * static_cast<double>(battledPairs) * static_cast<double>(range2 + 1) /
+                                static_cast<double>(std::max(battledRange2, 0LL) + 1);
+        bool caching = repeatGeometry && !onGpu && cacheLimit > 0 && view.size <= cacheLimit &&
+                       expected <= static_cast<double>(cacheLimit);
+        if (caching) cache.start(range2, view);
+        battledGeometry = geometryEpoch;
+        battledRange2 = range2;
+        battledPairs = 0;
+        repeatGeometry = false;
+        const std::uint8_t* attackers = caching ? cache.alive.data() : view.alive;
+        for (size_t begin = 0; begin < view.size; begin += block) {
+            if (progress && progress->cancelled()) return false;
+            const size_t end = std::min(view.size, begin + block);
+            if (!onGpu || !gpu->collect(view, begin, end, candidates[0])) {
+                if (onGpu) {
+                    // остаток боя на CPU: кандидаты те же, порядок разбора не меняется
+                    onGpu = gpuFailed();
+                    buildGrid();
+                    candidates.resize(threadCount);
+                }
+                if (parallel) {
+                    pool->parallelFor(end - begin, [&](size_t part, size_t from, size_t to) {
+                        collectCandidates(view, range2, simd, attackers, caching, begin + from, begin + to, candidates[part]);
+                    });
+                } else {
+                    collectCandidates(view, range2, simd, attackers, caching, begin, end, candidates[0]);
+                }
+            }
+            timer.lap(BattleStats::PAIRS);
+            for (const auto& list : candidates) {
+                if constexpr (DUNGEON_STATS) {
+                    stats.pairsExamined += list.examined;
+                    stats.pairsInRange += list.js.size();
+                }
+                battledPairs += list.js.size();
+                resolveCandidates(view, list, onKill);
+                if (caching && !cache.append(list, cacheLimit)) {
+                    caching = false;
+                    attackers = view.alive;
+                }
+            }
+            timer.lap(BattleStats::RESOLVE);
+            if (progress) progress->advance(end - begin);
+        }
+        if (caching) cache.finish(geometryEpoch);
+        return true;
+    }
+
+    // Бой только по парам с грязными NPC. Прошлый бой оставил в радиусе settledRange2
+    // лишь пары, где никто никого не убивает, поэтому при range2 <= settledRange2
+    // пропуск чистых пар ничего не меняет, а остальные идут в том же порядке (i, j).
+    template <typename KillFn>
+    void battleDirty(BattleView view, long long range2, KillFn& onKill) {
+        PhaseTimer timer(stats);
+        const int reach = static_cast<int>(std::min(501.0, std::ceil(std::sqrt(static_cast<double>(range2)))));
+        dirtyPairs.clear();
+        for (size_t d : dirty) {
+            if (!view.alive[d]) continue;
+            const std::uint32_t mask = pairMask(view.type[d]);
+            index.forEachInBox(view.x[d], view.y[d], reach, [&](size_t c) {
+                if (c == d || !view.alive[c] || !(mask & (1u << static_cast<unsigned>(view.type[c])))) return;
+                if constexpr (DUNGEON_STATS) ++stats.pairsExamined;
+                long long dx = view.x[d] - view.x[c], dy = view.y[d] - view.y[c];
+                if (dx * dx + dy * dy > range2) return;
+                dirtyPairs.emplace_back(std::min(c, d), std::max(c, d));
+            });
+        }
+        std::sort(dirtyPairs.begin(), dirtyPairs.end());
+        dirtyPairs.erase(std::unique(dirtyPairs.begin(), dirtyPairs.end()), dirtyPairs.end());
+        if constexpr (DUNGEON_STATS) stats.pairsInRange += dirtyPairs.size();
+        timer.lap(BattleStats::PAIRS);
+
+        for (size_t k = 0; k < dirtyPairs.size();) {
+            const size_t i = dirtyPairs[k].first;
+            const bool attackerAlive = view.alive[i]; // как проверка в начале строки i полного боя
+            for (; k < dirtyPairs.size() && dirtyPairs[k].first == i; ++k) {
+                if (attackerAlive && view.alive[dirtyPairs[k].second]) resolvePair(view, i, dirtyPairs[k].second, onKill);
+            }
+        }
+        timer.lap(BattleStats::RESOLVE);
+    }
+
+    // Ошибка устройства посреди боя: дальше бой идёт на SIMD; всегда false
+    bool gpuFailed() {
+        gpuStatus = gpu->lastError();
+        std::cout << "GPU: " << gpuStatus << "; бой продолжается на simd" << std::endl;
+        gpu.reset();
+        engine = BattleEngine::SIMD;
+        return false;
+    }
+
+    size_t loggedBytes() const { return consoleLog ? consoleLog->bytesWritten() + fileLog->bytesWritten() : 0; }
+
+    BattleView activeView() { return storage == StorageMode::SOA ? store.view() : packed.view(); }
+    const NPCStore& activeStore() const { return storage == StorageMode::SOA ? store : packed; }
+    const NameTable& activeNames() const { return storage == StorageMode::SOA ? store.names : names; }
+    size_t activeSize() const { return storage == StorageMode::SOA ? store.size() : npcs.size(); }
+
+    // Удаляет мёртвых из активного хранилища и заново строит индекс
+    void compactWorld() {
+        settleMoves();
+        PhaseTimer timer(stats);
+        // грязные id (add или такт после боя) переходят в номера среди живых
+        if (!dirty.empty()) {
+            const BattleView view = activeView();
+            std::sort(dirty.begin(), dirty.end());
+            size_t alive = 0, k = 0, out = 0;
+            for (size_t i = 0; i < view.size && k < dirty.size(); ++i) {
+                for (; k < dirty.size() && dirty[k] == i; ++k) {
+                    if (view.alive[i]) dirty[out++] = alive;
+                }
+                alive += view.alive[i];
+            }
+            dirty.resize(out);
+        }
+        if (storage == StorageMode::SOA) {
+            store.compact();
+            if (store.names.size() > NAME_SLACK * store.size()) store.compactNames();
+        } else {
+            removeDeadObjects();
+            packed.compact();
+            if (names.size() > NAME_SLACK * npcs.size()) compactObjectNames();
+        }
+        index.rebuild(activeView());
+        deadCount = 0;
+        relayout();
+        observers.onCompact();
+        timer.lap(BattleStats::COMPACT);
+    }
+
+    // NPCStore::compactNames() для объектов: их имена и зеркало packed - в новой таблице.
+    // Версии держат блоки прежней таблицы сами (NameTable::share).
+    void compactObjectNames() {
+        NameTable kept;
+        for (size_t i = 0; i < npcs.size(); ++i) {
+            const std::uint32_t id = kept.intern(npcs[i]->getName());
+            npcs[i]->rename(kept.handle(id));
+            packed.nameId[i] = id;
+        }
+        names = std::move(kept);
+    }
+
+    // Мёртвые остаются в хранилище (alive = 0), пока их доля не превысит порог:
+    // бой, печать и сохранение их пропускают, а порядок живых от этого не меняется
+    void noteKills(size_t kills) {
+        deadCount += kills;
+        if (deadCount > 0 && static_cast<double>(deadCount) >= compactionThreshold * static_cast<double>(activeSize())) {
+            compactWorld();
+        }
+    }
+
+    bool battleActive(double range) {
+        const long long range2 = rangeSquared(range);
+        const bool incremental = range2 >= 0 && range2 <= settledRange2 && dirty.size() * INCREMENTAL_LIMIT <= activeSize();
+        const BattleView view = activeView();
+        size_t kills = 0;
+        bool finished = true;
+        auto run = [&](auto onKill) {
+            auto counted = [&](size_t killer, size_t victim) {
+                ++kills;
+                --aliveCounts[static_cast<size_t>(view.type[victim])];
+                touch(victim);
+                observers.onKilled(victim);
+                if constexpr (DUNGEON_STATS) {
+                    ++stats.kills[static_cast<size_t>(view.type[killer])][static_cast<size_t>(view.type[victim])];
+                }
+                onKill(killer, victim);
+            };
+            if (incremental) battleDirty(view, range2, counted);
+            else finished = battleTable(view, range, counted);
+        };
+        if (storage == StorageMode::SOA) {
+            run([&](size_t killer, size_t victim) { observers.onKill(store.nameAt(killer), store.nameAt(victim)); });
+        } else {
+            run([&](size_t killer, size_t victim) {
+                npcs[victim]->markDead();
+                observers.onKill(*npcs[killer], *npcs[victim]);
+            });
+        }
+        if constexpr (DUNGEON_STATS) stats.incremental += incremental;
+        settledRange2 = finished ? range2 : -1;
+        dirty.clear();
+        noteKills(kills);
+        return finished;
+    }
+
+    // см. restore()
+    void restoreVersion(const WorldVersion& version) {
+        settleMoves();
+        if (version.layout != layoutEpoch || lastVersion.layout != layoutEpoch || version.count > activeSize()) {
+            clearWorld();
+            reserve(version.aliveCount());
+            version.forEachAlive([&](NPCType type, std::string_view name, int x, int y) { append(type, name, x, y); });
+            ticks = version.ticks;
+            // без мёртвых id те же, что в версии: её пары боя снова годятся
+            if (version.dead == 0) geometryEpoch = version.geometry;
+            repeatGeometry = geometryEpoch == battledGeometry;
+            return;
+        }
+        NPCStore& front = storage == StorageMode::SOA ? store : packed;
+        // отличия от мира: изменения после lastVersion и страницы, где version и lastVersion разные
+        std::vector<size_t> pages = version.changedPages(lastVersion);
+        pages.insert(pages.end(), changedPages.begin(), changedPages.end());
+        for (size_t p = version.pages.size(); p * WorldVersion::PAGE < front.size(); ++p) pages.push_back(p);
+        std::sort(pages.begin(), pages.end());
+        pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+        for (size_t p : pages) {
+            const size_t from = p * WorldVersion::PAGE, to = std::min(front.size(), from + WorldVersion::PAGE);
+            for (size_t i = from; i < to; ++i) {
+                if (i >= version.count) {
+                    index.erase(i, front.x[i], front.y[i]);
+                    continue;
+                }
+                const WorldVersion::Page& page = *version.pages[p];
+                const size_t at = i - from;
+                index.move(i, front.x[i], front.y[i], page.x[at], page.y[at]);
+                front.x[i] = page.x[at];
+                front.y[i] = page.y[at];
+                front.alive[i] = page.alive[at];
+                if (storage == StorageMode::OBJECTS) {
+                    npcs[i]->moveTo(page.x[at], page.y[at]);
+                    if (page.alive[at]) npcs[i]->revive();
+                    else npcs[i]->markDead();
+                }
+            }
+        }
+        const bool truncated = version.count < front.size();
+        if (truncated) {
+            front.x.resize(version.count);
+            front.y.resize(version.count);
+            front.type.resize(version.count);
+            front.alive.resize(version.count);
+            front.nameId.resize(version.count);
+            if (storage == StorageMode::OBJECTS) npcs.resize(version.count);
+        }
+        deadCount = version.dead;
+        std::copy(std::begin(version.aliveCounts), std::end(version.aliveCounts), aliveCounts);
+        ticks = version.ticks;
+        dirty.clear();
+        settledRange2 = -1;
+        if (truncated) {
+            // освободившиеся id займут другие NPC, поэтому версии этой раскладки больше не годятся
+            relayout();
+        } else {
+            for (size_t p : changedPages) pageChanged[p] = 0;
+            changedPages.clear();
+            lastVersion = version;
+        }
+        geometryEpoch = version.geometry; // координаты и id до version.count - как в версии
+        repeatGeometry = geometryEpoch == battledGeometry;
+    }
+
+    // Мир меняется целиком (загрузка, смена хранилища, откат): журнал на это время
+    // отключён, после - новая контрольная точка
+    template <typename F>
+    void withoutJournal(F&& f) {
+        if (!journal) {
+            f();
+            return;
+        }
+        journal->flush();
+        observers.remove(*journal);
+        auto detached = std::move(journal);
+        f();
+        journal = std::move(detached);
+        observers.add(*journal);
+        checkpoint();
+    }
+
+    // Контрольная точка, когда журнал перерос снимок: восстановление читает не больше
+    // двух размеров мира
+    void journalFlush() {
+        if (!journal) return;
+        journal->flush();
+        if (journal->bytes() > std::max<std::uint64_t>(JOURNAL_MIN, checkpointBytes)) checkpoint();
+    }
+
+    // Живой NPC id погиб: без уведомлений и уплотнения
+    void markKilled(size_t id) {
+        BattleView view = activeView();
+        view.alive[id] = 0;
+        if (storage == StorageMode::OBJECTS) npcs[id]->markDead();
+        --aliveCounts[static_cast<size_t>(view.type[id])];
+        touch(id);
+    }
+
+    // Запись журнала к миру; false - она не подходит (id, координаты, тип)
+    bool replay(const JournalRecord& record, std::string_view name) {
+        const bool inWorld = record.x >= 0 && record.x <= 500 && record.y >= 0 && record.y <= 500;
+        const bool known = record.id < activeSize() && activeStore().alive[record.id];
+        switch (record.kind) {
+            case Journal::ADD:
+                if (!inWorld || record.type >= NPC_TYPE_COUNT || record.id != activeSize()) return false;
+                append(static_cast<NPCType>(record.type), name, record.x, record.y);
+                return true;
+            case Journal::KILL:
+                if (!known) return false;
+                markKilled(record.id);
+                ++deadCount;
+                return true;
+            case Journal::MOVE: {
+                if (!known || !inWorld) return false;
+                NPCStore& front = storage == StorageMode::SOA ? store : packed;
+                index.move(record.id, front.x[record.id], front.y[record.id], record.x, record.y);
+                front.x[record.id] = record.x;
+                front.y[record.id] = record.y;
+                if (storage == StorageMode::OBJECTS) npcs[record.id]->moveTo(record.x, record.y);
+                dirty.push_back(record.id);
+                touch(record.id);
+                moved();
+                return true;
+            }
+            case Journal::COMPACT:
+                compact();
+                return true;
+            case Journal::TICK:
+                ++ticks;
+                return true;
+        }
+        return false;
+    }
+
+public:
+    explicit Dungeon(StorageMode mode = StorageMode::OBJECTS, bool logging = true) : storage(mode) {
+        setLogging(logging);
+    }
+
+    // Наблюдатель должен жить дольше подземелья или быть отключён removeObserver
+    void addObserver(Observer& observer) { observers.add(observer); }
+    void removeObserver(Observer& observer) { observers.remove(observer); }
+
+    // Встроенные журналы убийств (консоль и logFile); подключённые наблюдатели не трогает.
+    // Без журналов у подземелья нет фоновых потоков записи. false - logFile не открылся.
+    bool setLogging(bool enabled) {
+        if (enabled == static_cast<bool>(consoleLog)) return isLogFileOpen();
+        if (enabled) {
+            consoleLog = std::make_unique<AsyncObserver>(*console);
+            fileLog = std::make_unique<AsyncObserver>(logFile);
+            observers.add(*consoleLog);
+            observers.add(*fileLog);
+        } else {
+            observers.remove(*consoleLog);
+            observers.remove(*fileLog);
+            consoleLog.reset();
+            fileLog.reset();
+        }
+        return isLogFileOpen();
+    }
+
+    // Куда выводится консольный журнал (по умолчанию std::cout); не во время боя.
+    // Прежний журнал выводит накопленное в свой поток.
+    void setConsole(std::ostream& out) {
+        console = &out;
+        if (!consoleLog) return;
+        observers.remove(*consoleLog);
+        consoleLog = std::make_unique<AsyncObserver>(*console);
+        observers.add(*consoleLog);
+    }
+
+    // Файл журнала убийств (по умолчанию log.txt); *.dz - сжатый, новый кадр на каждое
+    // открытие. false - файл не открылся, журнал остаётся прежним.
+    bool setLogFile(const std::string& filename) {
+        if (!fileLog) {
+            logFile = filename;
+            return true;
+        }
+        auto opened = std::make_unique<AsyncObserver>(filename);
+        if (!opened->isOpen()) return false;
+        logFile = filename;
+        observers.remove(*fileLog);
+        fileLog = std::move(opened);
+        observers.add(*fileLog);
+        return true;
+    }
+
+    const std::string& getLogFile() const { return logFile; }
+    // Журналы выключены - тоже true
+    bool isLogFileOpen() const { return !fileLog || fileLog->isOpen(); }
+
+    StorageMode getStorageMode() const { return storage; }
+
+    // Для StorageMode::SOA вместо VISITOR используется TABLE. Без устройства OpenCL
+    // (или без -DDUNGEON_WITH_OPENCL) GPU не выбирается: false, движок - SIMD,
+    // причина - в getGpuStatus()
+    bool setBattleEngine(BattleEngine battleEngine) {
+        if (battleEngine == BattleEngine::GPU && !gpu) gpu = GpuPairs::create(gpuStatus);
+        if (battleEngine == BattleEngine::GPU && !gpu) {
+            engine = BattleEngine::SIMD;
+            return false;
+        }
+        engine = battleEngine;
+        return true;
+    }
+    const std::string& getGpuStatus() const { return gpuStatus; }
+    BattleEngine getBattleEngine() const { return engine; }
+
+    // 0 - уплотнять после каждого боя с убийствами, 1 - только вызовом compact()
+    void setCompactionThreshold(double fraction) { compactionThreshold = std::clamp(fraction, 0.0, 1.0); }
+    double getCompactionThreshold() const { return compactionThreshold; }
+
+    void compact() {
+        if (deadCount > 0) compactWorld();
+        if (journal) journal->flush();
+    }
+
+    // Дождаться фонового такта tick(); перед работой с подземельем из другого потока
+    void settleTick() { settleMoves(); }
+
+    // Потоки для фазы поиска пар в движках TABLE и SIMD и для загрузки файлов
+    void setThreads(size_t threads) {
+        settleMoves();
+        threadCount = std::max<size_t>(1, threads);
+    }
+    size_t getThreads() const { return threadCount; }
+
+    // Переносит текущих живых NPC в другое хранилище
+    void setStorageMode(StorageMode mode) {
+        if (mode == storage) return;
+        std::vector<NPCRecord> records;
+        forEachAlive([&](NPCType type, std::string_view name, int x, int y) {
+            records.push_back({type, std::string(name), x, y});
+        });
+        withoutJournal([&] {
+            clearWorld();
+            storage = mode;
+            addNPCs(records);
+        });
+    }
+
+    // Память под ещё count NPC разом; рост остаётся геометрическим при частых вызовах
+    void reserve(size_t count) {
+        settleMoves();
+        const size_t needed = activeSize() + count;
+        const size_t capacity = storage == StorageMode::SOA ? store.type.capacity() : npcs.capacity();
+        if (needed <= capacity) return;
+        const size_t target = std::max(needed, capacity * 2);
+        if (storage == StorageMode::SOA) {
+            store.reserve(target);
+        } else {
+            npcs.reserve(target);
+            packed.reserve(target);
+        }
+    }
+
+    // Пачка записей с полями type, name, x, y (NPCRecord, NPCRecordView): проверка
+    // координат одним проходом без ветвлений, одно резервирование и
+    // одна достройка индекса (insertRange), без вывода в cout
+    template <typename Record>
+    AddReport addNPCs(const Record* records, size_t count) {
+        AddReport report;
+        badRecords.resize(count);
+        size_t badCount = 0;
+        for (size_t k = 0; k < count; ++k) {
+            // отрицательные после приведения к unsigned тоже больше 500
+            const bool bad = (static_cast<unsigned>(records[k].x) > 500u) | (static_cast<unsigned>(records[k].y) > 500u);
+            badRecords[k] = bad;
+            badCount += bad;
+        }
+        reserve(count - badCount);
+        report.rejected.reserve(badCount);
+        const size_t first = activeSize();
+        for (size_t k = 0; k < count; ++k) {
+            if (badRecords[k]) {
+                report.rejected.push_back(k);
+                continue;
+            }
+            appendUnindexed(records[k].type, records[k].name, records[k].x, records[k].y);
+        }
+        index.insertRange(activeView(), first);
+        report.added = count - badCount;
+        journalFlush();
+        return report;
+    }
+
+    template <typename Record>
+    AddReport addNPCs(const std::vector<Record>& records) { return addNPCs(records.data(), records.size()); }
+
+    void addNPC(NPCType type, const std::string& name, int x, int y) {
+        if (x < 0 || x > 500 || y < 0 || y > 500) {
+            std::cout << "Неверные координаты!" << std::endl;
+            return;
+        }
+        append(type, name, x, y);
+        journalFlush();
+    }
+
+    // Строка print: "Тип имя at (x, y)"
+    static void printLine(BufferedWriter& out, NPCType type, std::string_view name, int x, int y) {
+        out.write(NPCFactory::typeName(type));
+        out.put(' ');
+        out.write(name);
+        out.write(" at (");
+        out.writeInt(x);
+        out.write(", ");
+        out.writeInt(y);
+        out.write(")\n");
+    }
+
+    void print() const {
+        BufferedWriter out(std::cout, PRINT_BUFFER);
+        forEachAlive([&](NPCType type, std::string_view name, int x, int y) { printLine(out, type, name, x, y); });
+    }
+
+    static void print(const WorldVersion& version) {
+        BufferedWriter out(std::cout, PRINT_BUFFER);
+        version.forEachAlive([&](NPCType type, std::string_view name, int x, int y) { printLine(out, type, name, x, y); });
+    }
+
+    // NPC ids (как из near() и nearest()) в формате print
+    void print(const std::vector<size_t>& ids) const {
+        const NPCStore& source = activeStore();
+        BufferedWriter out(std::cout, PRINT_BUFFER);
+        for (size_t id : ids) printLine(out, source.type[id], nameOf(id), source.x[id], source.y[id]);
+    }
+
+    // Живые NPC в круге радиуса range вокруг (x, y) в [0, 500], по порядку хранения.
+    // Обходятся только ячейки индекса, задевающие круг, а не весь мир.
+    std::vector<size_t> near(int x, int y, double range) const {
+        std::vector<size_t> found;
+        const long long range2 = rangeSquared(range);
+        if (range2 < 0) return found;
+        const NPCStore& source = activeStore();
+        const int reach = static_cast<int>(std::min(501.0, std::ceil(std::sqrt(static_cast<double>(range2)))));
+        index.forEachInBox(x, y, reach, [&](size_t id) {
+            if (!source.alive[id]) return;
+            const long long dx = source.x[id] - x, dy = source.y[id] - y;
+            if (dx * dx + dy * dy <= range2) found.push_back(id);
+        });
+        std::sort(found.begin(), found.end());
+        return found;
+    }
+
+    // k ближайших живых NPC к (x, y) в [0, 500]: по расстоянию, при равенстве - по порядку
+    // хранения. Кольца ячеек вокруг точки обходятся, пока k-й найденный не ближе
+    // всех необойдённых.
+    std::vector<size_t> nearest(int x, int y, size_t k) const {
+        std::vector<std::pair<long long, size_t>> best; // max-куча (d2, id) из не более k
+        if (k == 0) return {};
+        const NPCStore& source = activeStore();
+        for (int ring = 0;; ++ring) {
+            const long long covered = index.forEachInRing(x, y, ring, [&](size_t id) {
+                if (!source.alive[id]) return;
+                const long long dx = source.x[id] - x, dy = source.y[id] - y;
+                const std::pair<long long, size_t> candidate(dx * dx + dy * dy, id);
+                if (best.size() == k) {
+                    if (!(candidate < best.front())) return;
+                    std::pop_heap(best.begin(), best.end());
+                    best.pop_back();
+                }
+                best.push_back(candidate);
+                std::push_heap(best.begin(), best.end());
+            });
+            if (covered < 0 || covered == std::numeric_limits<long long>::max()) break;
+            if (best.size() == k && best.front().first < covered * covered) break;
+        }
+        std::sort_heap(best.begin(), best.end());
+        std::vector<size_t> found;
+        found.reserve(best.size());
+        for (const auto& entry : best) found.push_back(entry.second);
+        return found;
+    }
+
+    // Живых NPC типа; счётчики ведутся при добавлении и убийствах
+    size_t count(NPCType type) const { return aliveCounts[static_cast<size_t>(type)]; }
+
+    bool saveToFile(const std::string& filename) const {
+        return writeText(filename, [&](auto&& write) { forEachAlive(write); });
+    }
+
+    // Сохраняет мир на момент вызова в фоновом потоке; подземелье можно менять
+    // сразу. Предыдущее фоновое сохранение сначала дожидается, его итог - в результате.
+    bool saveToFileAsync(const std::string& filename) {
+        const bool previous = waitBackgroundSave();
+        backgroundSave = std::async(std::launch::async, [filename, version = snapshot()] { return saveVersion(filename, version); });
+        return previous;
+    }
+
+    // Версия не меняется, поэтому сохранять её можно из любого потока. После отмены
+    // через progress (ход - в записях) файл удаляется.
+    static bool saveVersion(const std::string& filename, const WorldVersion& version, Progress* progress = nullptr) {
+        if (progress) progress->start(version.aliveCount());
+        return writeText(filename, [&](auto&& write) { version.forEachAlive(write); }, progress);
+    }
+
+    // true - фоновых сохранений не было или последнее удалось
+    bool waitBackgroundSave() {
+        return !backgroundSave.valid() || backgroundSave.get();
+    }
+
+    // Файл читается целиком, с threads > 1 - по частям параллельно (ChunkedTextLoader);
+    // неверные строки пропускаются и возвращаются списком
+    std::vector<LoadError> loadFromFile(const std::string& filename) {
+        std::vector<LoadError> errors;
+        NPCStore loaded;
+        readTextFile(filename, loaded, errors);
+        installLoaded(std::move(loaded));
+        return errors;
+    }
+
+    // Первая половина loadFromFile(): разбор в loaded, мир не меняется, поэтому её можно
+    // выполнять в другом потоке, пока с подземельем ничего не делают. false - прервано
+    // через progress, loaded не годится.
+    bool readTextFile(const std::string& filename, NPCStore& loaded, std::vector<LoadError>& errors) {
+        auto file = MappedFile::open(filename, loadPool());
+        if (!file) errors.push_back({0, "не удалось открыть файл " + filename});
+        else ChunkedTextLoader::load(file, loaded, errors, loadPool(), progress);
+        return !(progress && progress->cancelled());
+    }
+
+    // Вторая половина: loaded (из readTextFile) становится миром
+    void installLoaded(NPCStore&& loaded) {
+        withoutJournal([&] { install(std::move(loaded)); });
+    }
+
+    // Двоичный снимок (см. Snapshot); текстовый формат остаётся для обмена
+    bool saveSnapshot(const std::string& filename, SnapshotHeader* written = nullptr) const {
+        if (storage == StorageMode::SOA) return Snapshot::save(filename, store, written);
+        NPCStore copy;
+        forEachAlive([&](NPCType type, std::string_view name, int x, int y) { copy.add(type, name, x, y); });
+        return Snapshot::save(filename, copy, written);
+    }
+
+    // При ошибке формата текущий мир не меняется
+    bool loadSnapshot(const std::string& filename, SnapshotHeader* read = nullptr) {
+        NPCStore loaded;
+        if (!Snapshot::load(filename, loaded, read, loadPool())) return false;
+        withoutJournal([&] { install(std::move(loaded)); });
+        return true;
+    }
+
+    // false - бой прерван отменой в Progress (setProgress()): убийства начала боя
+    // остаются, мир можно вернуть restore() к версии до боя
+    bool battle(double range) {
+        settleMoves();
+        const size_t logged = loggedBytes();
+        bool finished;
+        if (storage == StorageMode::OBJECTS && engine == BattleEngine::VISITOR) {
+            finished = battleVisitor(range);
+            settledRange2 = finished ? rangeSquared(range) : -1;
+            dirty.clear();
+        } else {
+            finished = battleActive(range);
+        }
+        PhaseTimer timer(stats);
+        observers.flush();
+        timer.lap(BattleStats::FLUSH);
+        if constexpr (DUNGEON_STATS) {
+            ++stats.battles;
+            stats.bytesLogged += loggedBytes() - logged;
+        }
+        journalFlush();
+        return finished;
+    }
+
+    // Живых NPC
+    size_t size() const { return activeSize() - deadCount; }
+    // Имён в таблице: с именами мёртвых, пока уплотнение их не убрало
+    size_t nameCount() const { return activeNames().size(); }
+
+    // Версия мира на сейчас. Страницы, не изменённые после прошлого snapshot(), общие с
+    // ним: копируются только страницы с добавленными, убитыми и сдвинутыми NPC (после
+    // уплотнения или загрузки - все). Подземелье держит последнюю версию для следующей.
+    WorldVersion snapshot() {
+        const NPCStore& source = activeStore();
+        const bool shared = lastVersion.layout == layoutEpoch;
+        WorldVersion version;
+        version.pages.resize((source.size() + WorldVersion::PAGE - 1) / WorldVersion::PAGE);
+        for (size_t p = 0; p < version.pages.size(); ++p) {
+            const bool changed = !shared || p >= lastVersion.pages.size() || (p < pageChanged.size() && pageChanged[p]);
+            version.pages[p] = changed ? copyPage(p) : lastVersion.pages[p];
+        }
+        version.count = source.size();
+        version.dead = deadCount;
+        std::copy(std::begin(aliveCounts), std::end(aliveCounts), version.aliveCounts);
+        // имена только дописываются, пока раскладка та же
+        const NameTable& table = activeNames();
+        version.names = shared && lastVersion.names->size() == table.size() ? lastVersion.names
+                                                                           : std::make_shared<const NameTable>(table.share());
+        version.layout = layoutEpoch;
+        version.geometry = geometryEpoch;
+        version.ticks = ticks;
+        for (size_t p : changedPages) pageChanged[p] = 0;
+        changedPages.clear();
+        lastVersion = version;
+        return version;
+    }
+
+    // Возвращает мир к версии. Версия с той же раскладкой id восстанавливается на месте:
+    // переписываются только страницы, отличные от текущего мира; иначе мир
+    // собирается заново из живых NPC версии. Следующий бой - полный.
+    void restore(const WorldVersion& version) {
+        withoutJournal([&] { restoreVersion(version); });
+    }
+
+    // Контрольная точка: мир уплотняется и пишется снимком (через временный файл),
+    // журнал начинается заново. false - журнал не открыт или запись не удалась.
+    bool checkpoint() {
+        if (!journal) return false;
+        compact();
+        journal->flush();
+        SnapshotHeader header;
+        const std::string temporary = journalSnapshot + ".tmp";
+        if (!saveSnapshot(temporary, &header) || std::rename(temporary.c_str(), journalSnapshot.c_str()) != 0) return false;
+        checkpointBytes = sizeof(SnapshotHeader) + header.recordCount * sizeof(SnapshotRecord) +
+                          (header.nameCount + 1) * sizeof(std::uint32_t) + header.nameBytes;
+        return journal->reset(header, ticks);
+    }
+
+    // Дальше изменения мира пишутся в journalFile, контрольные точки - в snapshotFile.
+    // Сразу делается первая контрольная точка.
+    bool openJournal(const std::string& snapshotFile, const std::string& journalFile) {
+        closeJournal();
+        journal = std::make_unique<Journal>(journalFile);
+        journalSnapshot = snapshotFile;
+        observers.add(*journal);
+        if (checkpoint()) return true;
+        closeJournal();
+        return false;
+    }
+
+    void closeJournal() {
+        if (!journal) return;
+        journal->flush();
+        observers.remove(*journal);
+        journal.reset();
+    }
+
+    bool isJournaling() const { return static_cast<bool>(journal); }
+
+    // Мир из контрольной точки и журнала после неё. Журнал от другого снимка (сбой между
+    // записью снимка и обнулением журнала) не применяется: снимок уже новее.
+    // false - снимок не загрузился или запись журнала не подходит к миру.
+    bool recover(const std::string& snapshotFile, const std::string& journalFile, RecoveryReport& report) {
+        report = RecoveryReport();
+        bool ok = true;
+        withoutJournal([&] {
+            SnapshotHeader snapshot;
+            if (!loadSnapshot(snapshotFile, &snapshot)) {
+                ok = false;
+                return;
+            }
+            report.journalUsed = Journal::read(
+                journalFile,
+                [&](const JournalHeader& header) {
+                    if (header.snapshotRecords != snapshot.recordCount || header.snapshotNameBytes != snapshot.nameBytes) return false;
+                    ticks = header.ticks;
+                    return true;
+                },
+                [&](const JournalRecord& record, std::string_view name) {
+                    if (!replay(record, name)) {
+                        ok = false;
+                        return false;
+                    }
+                    ++report.replayed;
+                    return true;
+                });
+        });
+        return ok;
+    }
+
+    // f(id, type, x, y) для живых NPC по порядку; id верны до следующего боя, загрузки
+    // или уплотнения (для World: обмен NPC у края шарда)
+    template <typename F>
+    void forEachAliveIndexed(F&& f) const {
+        const NPCStore& source = storage == StorageMode::SOA ? store : packed;
+        for (size_t i = 0; i < source.size(); ++i) {
+            if (source.alive[i]) f(i, source.type[i], source.x[i], source.y[i]);
+        }
+    }
+
+    std::string_view nameOf(size_t id) const {
+        return storage == StorageMode::SOA ? store.nameAt(id) : npcs[id]->getName();
+    }
+
+    // Убивает живых NPC ids, погибших в бою снаружи подземелья (World); наблюдатели
+    // не уведомляются - убийство уже выдал тот, кто вёл бой
+    void killNPCs(const std::vector<size_t>& ids) {
+        settleMoves();
+        for (size_t id : ids) {
+            markKilled(id);
+            observers.onKilled(id);
+        }
+        noteKills(ids.size());
+        journalFlush();
+    }
+
+    // Скорость типа в клетках за такт по каждой оси, [0, 500]
+    void setSpeed(NPCType type, int speed) {
+        settleMoves();
+        speeds[static_cast<size_t>(type)] = std::clamp(speed, 0, 500);
+    }
+    int getSpeed(NPCType type) const { return speeds[static_cast<size_t>(type)]; }
+
+    // Такт симуляции: NPC двигаются, затем бой в радиусе range. Следующий такт
+    // сразу начинает считаться в фоне (задний буфер), пока мир читают print и save;
+    // любое изменение мира дожидается его и отбрасывает.
+    void tick(double range) {
+        if (movesReady) {
+            pendingMoves.get();
+            movesReady = false;
+        } else {
+            settleMoves();
+            computeMoves(activeView(), ticks);
+        }
+        applyMoves();
+        ++ticks;
+        observers.onTick();
+        battle(range);
+        pendingMoves = std::async(std::launch::async, [this, view = activeView(), tick = ticks] { computeMoves(view, tick); });
+        movesReady = true;
+    }
+
+    std::uint64_t getTicks() const { return ticks; }
+
+    const BattleStats& getStats() const { return stats; }
+    void resetStats() { stats = BattleStats(); }
+
+    // Предел пар в кэше боя (BattleCache); 0 - не запоминать пары
+    void setBattleCacheLimit(size_t pairs) {
+        cacheLimit = std::min<size_t>(pairs, UINT32_MAX);
+        cache.clear();
+    }
+
+    // Ход и отмена battle() и readTextFile() (nullptr - без них); объект живёт, пока они идут
+    void setProgress(Progress* target) { progress = target; }
+
+    void printStats() const { printStats(stats); }
+
+    static void printStats(const BattleStats& stats) {
+        if (!DUNGEON_STATS) {
+            std::cout << "Статистика отключена при сборке (DUNGEON_NO_STATS)" << std::endl;
+            return;
+        }
+        std::cout << "Боёв: " << stats.battles << " (по новым NPC: " << stats.incremental << ", по кэшу пар: " << stats.cached << ")"
+                  << std::endl;
+        std::cout << "Пар проверено: " << stats.pairsExamined << ", в радиусе: " << stats.pairsInRange << std::endl;
+        for (size_t killer = 0; killer < NPC_TYPE_COUNT; ++killer) {
+            for (size_t victim = 0; victim < NPC_TYPE_COUNT; ++victim) {
+                if (!canKill(static_cast<NPCType>(killer), static_cast<NPCType>(victim))) continue;
+                std::cout << NPCFactory::typeName(static_cast<NPCType>(killer)) << " -> "
+                          << NPCFactory::typeName(static_cast<NPCType>(victim)) << ": " << stats.kills[killer][victim] << std::endl;
+            }
+        }
+        std::cout << "Время, мкс:";
+        for (int phase = 0; phase < BattleStats::PHASE_COUNT; ++phase) {
+            std::cout << " " << BattleStats::phaseKey(static_cast<BattleStats::Phase>(phase)) << " "
+                      << stats.nanos[phase] / 1000;
+        }
+        std::cout << std::endl;
+        std::cout << "Записано в журнал, байт: " << stats.bytesLogged << std::endl;
+    }
 
-    double distanceTo(const NPC& other) const {
-        return std::sqrt(std::pow(x - other.x, 2) + std::pow(y - other.y, 2));
+    // Та же статистика в JSON, время в наносекундах
+    bool saveStats(const std::string& filename) const {
+        std::ofstream file(filename);
+        if (!file) return false;
+        file << "{\n  \"enabled\": " << (DUNGEON_STATS ? "true" : "false") << ",\n"
+             << "  \"battles\": " << stats.battles << ",\n"
+             << "  \"incremental\": " << stats.incremental << ",\n"
+             << "  \"cached\": " << stats.cached << ",\n"
+             << "  \"pairs_examined\": " << stats.pairsExamined << ",\n"
+             << "  \"pairs_in_range\": " << stats.pairsInRange << ",\n"
+             << "  \"bytes_logged\": " << stats.bytesLogged << ",\n"
+             << "  \"kills\": {";
+        const char* separator = "";
+        for (size_t killer = 0; killer < NPC_TYPE_COUNT; ++killer) {
+            for (size_t victim = 0; victim < NPC_TYPE_COUNT; ++victim) {
+                if (!canKill(static_cast<NPCType>(killer), static_cast<NPCType>(victim))) continue;
+                file << separator << "\"" << NPCFactory::typeKeyword(static_cast<NPCType>(killer)) << ">"
+                     << NPCFactory::typeKeyword(static_cast<NPCType>(victim)) << "\": " << stats.kills[killer][victim];
+                separator = ", ";
+            }
+        }
+        file << "},\n  \"phase_ns\": {";
+        for (int phase = 0; phase < BattleStats::PHASE_COUNT; ++phase) {
+            file << (phase ? ", " : "") << "\"" << BattleStats::phaseKey(static_cast<BattleStats::Phase>(phase))
+                 << "\": " << stats.nanos[phase];
+        }
+        file << "}\n}\n";
+        return static_cast<bool>(file);
     }
+};
 
-private:
-    std::string name;
-    int x, y;
-    bool alive;
+// Сообщение узла World за один раунд боя. Гало - записи снимка (SnapshotRecord)
+// в глобальных координатах, reserved хранит номер шарда (24 бита, little-endian);
+// убийства - пары номеров имён. Имена - смещения и символы, как в снимке.
+struct NodeMessageHeader {
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t recordSize;
+    std::uint32_t round;
+    std::uint32_t haloCount;
+    std::uint32_t killCount;
+    std::uint32_t nameCount;
+    std::uint32_t nameBytes;
+    std::uint32_t reserved;
 };
 
-class Princess : public NPC {
-public:
-    Princess(const std::string& name, int x, int y) : NPC(name, x, y) {}
-    NPCType getType() const override { return NPCType::PRINCESS; }
-    void accept(Visitor& visitor) override;
+struct KillRecord {
+    std::uint32_t killer, victim;
 };
 
-class Dragon : public NPC {
+static_assert(sizeof(NodeMessageHeader) == 40 && sizeof(KillRecord) == 8, "формат сообщения не должен зависеть от платформы");
+
+class NodeMessage {
 public:
-    Dragon(const std::string& name, int x, int y) : NPC(name, x, y) {}
-    NPCType getType() const override { return NPCType::DRAGON; }
-    void accept(Visitor& visitor) override;
+    static constexpr char MAGIC[8] = {'D', 'U', 'N', 'G', 'N', 'O', 'D', 'E'};
+    static constexpr std::uint32_t VERSION = 1;
+
+    // Разобранное сообщение; names указывают в байты сообщения
+    std::vector<SnapshotRecord> halo;
+    std::vector<KillRecord> kills;
+    std::vector<std::string_view> names;
+
+    static std::uint32_t shardOf(const SnapshotRecord& record) {
+        return record.reserved[0] | (record.reserved[1] << 8) | (static_cast<std::uint32_t>(record.reserved[2]) << 16);
+    }
+
+    // Собирает сообщение; убийства приходят как от любого наблюдателя
+    class Writer : public Observer {
+        std::vector<SnapshotRecord> halo;
+        std::vector<KillRecord> kills;
+        std::vector<std::uint32_t> offsets{0};
+        std::string chars;
+
+        std::uint32_t addName(std::string_view name) {
+            chars += name;
+            offsets.push_back(static_cast<std::uint32_t>(chars.size()));
+            return static_cast<std::uint32_t>(offsets.size() - 2);
+        }
+
+    public:
+        using Observer::onKill;
+        void onKill(std::string_view killerName, std::string_view victimName) override {
+            kills.push_back({addName(killerName), addName(victimName)});
+        }
+
+        void addHalo(int x, int y, NPCType type, std::uint32_t shard, std::string_view name) {
+            halo.push_back({static_cast<std::int16_t>(x), static_cast<std::int16_t>(y), static_cast<std::uint8_t>(type),
+                            {static_cast<std::uint8_t>(shard), static_cast<std::uint8_t>(shard >> 8),
+                             static_cast<std::uint8_t>(shard >> 16)},
+                            addName(name)});
+        }
+
+        // Байты сообщения; писатель очищается для следующего раунда
+        std::vector<char> finish(std::uint32_t round) {
+            NodeMessageHeader header{};
+            std::copy_n(MAGIC, sizeof(MAGIC), header.magic);
+            header.version = VERSION;
+            header.recordSize = sizeof(SnapshotRecord);
+            header.round = round;
+            header.haloCount = static_cast<std::uint32_t>(halo.size());
+            header.killCount = static_cast<std::uint32_t>(kills.size());
+            header.nameCount = static_cast<std::uint32_t>(offsets.size() - 1);
+            header.nameBytes = static_cast<std::uint32_t>(chars.size());
+
+            std::vector<char> bytes;
+            auto put = [&](const void* data, size_t size) {
+                const char* from = static_cast<const char*>(data);
+                bytes.insert(bytes.end(), from, from + size);
+            };
+            bytes.reserve(sizeof(header) + halo.size() * sizeof(SnapshotRecord) + kills.size() * sizeof(KillRecord) +
+                          offsets.size() * sizeof(std::uint32_t) + chars.size());
+            put(&header, sizeof(header));
+            put(halo.data(), halo.size() * sizeof(SnapshotRecord));
+            put(kills.data(), kills.size() * sizeof(KillRecord));
+            put(offsets.data(), offsets.size() * sizeof(std::uint32_t));
+            put(chars.data(), chars.size());
+
+            halo.clear();
+            kills.clear();
+            offsets.assign(1, 0);
+            chars.clear();
+            return bytes;
+        }
+    };
+
+    // false - не тот раунд или повреждённое сообщение; bytes должны жить, пока нужны names
+    static bool decode(const std::vector<char>& bytes, std::uint32_t round, NodeMessage& out) {
+        if (bytes.size() < sizeof(NodeMessageHeader)) return false;
+        NodeMessageHeader header;
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        if (!std::equal(MAGIC, MAGIC + sizeof(MAGIC), header.magic) || header.version != VERSION ||
+            header.recordSize != sizeof(SnapshotRecord) || header.round != round) {
+            return false;
+        }
+        const std::uint64_t haloAt = sizeof(NodeMessageHeader);
+        const std::uint64_t killsAt = haloAt + std::uint64_t(header.haloCount) * sizeof(SnapshotRecord);
+        const std::uint64_t offsetsAt = killsAt + std::uint64_t(header.killCount) * sizeof(KillRecord);
+        const std::uint64_t charsAt = offsetsAt + (std::uint64_t(header.nameCount) + 1) * sizeof(std::uint32_t);
+        if (charsAt + header.nameBytes != bytes.size()) return false;
+
+        out.names.resize(header.nameCount);
+        std::uint32_t previous = 0;
+        for (std::uint64_t n = 0; n <= header.nameCount; ++n) {
+            std::uint32_t offset;
+            std::memcpy(&offset, bytes.data() + offsetsAt + n * sizeof(offset), sizeof(offset));
+            if (offset < previous || offset > header.nameBytes || (n == 0 && offset != 0)) return false;
+            if (n > 0) out.names[n - 1] = std::string_view(bytes.data() + charsAt + previous, offset - previous);
+            previous = offset;
+        }
+        out.halo.resize(header.haloCount);
+        std::memcpy(out.halo.data(), bytes.data() + haloAt, out.halo.size() * sizeof(SnapshotRecord));
+        for (const auto& record : out.halo) {
+            if (record.x < 0 || record.y < 0 || record.type >= NPC_TYPE_COUNT || record.nameId >= header.nameCount) return false;
+        }
+        out.kills.resize(header.killCount);
+        std::memcpy(out.kills.data(), bytes.data() + killsAt, out.kills.size() * sizeof(KillRecord));
+        for (const auto& kill : out.kills) {
+            if (kill.killer >= header.nameCount || kill.victim >= header.nameCount) return false;
+        }
+        return true;
+    }
 };
 
-class Knight : public NPC {
+// Связь узлов World: allGather - барьер раунда, каждый узел получает сообщения всех
+class Transport {
 public:
-    Knight(const std::string& name, int x, int y) : NPC(name, x, y) {}
-    NPCType getType() const override { return NPCType::KNIGHT; }
-    void accept(Visitor& visitor) override;
+    virtual ~Transport() = default;
+    virtual size_t rank() const = 0;
+    virtual size_t nodes() const = 0;
+    // messages[k] - сообщение узла k (своё - тоже); false - связь потеряна
+    virtual bool allGather(const std::vector<char>& message, std::vector<std::vector<char>>& messages) = 0;
 };
 
-// для логирования
-class Observer {
+// Узлы в одном процессе (потоки): общий LocalHub, по LocalTransport на узел
+class LocalHub {
+    std::mutex mutex;
+    std::condition_variable roundDone;
+    std::vector<std::vector<char>> pending;
+    std::shared_ptr<const std::vector<std::vector<char>>> published;
+    size_t arrived = 0;
+    size_t generation = 0;
+
 public:
-    virtual ~Observer() = default;
-    virtual void onKill(const NPC& killer, const NPC& victim) = 0;
+    explicit LocalHub(size_t nodes) : pending(nodes) {}
+
+    size_t nodes() const { return pending.size(); }
+
+    bool allGather(size_t rank, const std::vector<char>& message, std::vector<std::vector<char>>& messages) {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending[rank] = message;
+        const size_t round = generation;
+        if (++arrived == pending.size()) {
+            published = std::make_shared<const std::vector<std::vector<char>>>(std::move(pending));
+            pending.assign(published->size(), {});
+            arrived = 0;
+            ++generation;
+            roundDone.notify_all();
+        } else {
+            roundDone.wait(lock, [&] { return generation != round; });
+        }
+        auto result = published; // следующий раунд не опубликуется, пока этот узел не придёт снова
+        lock.unlock();
+        messages = *result;
+        return true;
+    }
 };
 
-class ConsoleObserver : public Observer {
+class LocalTransport : public Transport {
+    LocalHub& hub;
+    size_t self;
 public:
-    void onKill(const NPC& killer, const NPC& victim) override {
-        std::cout << killer.getName() << " убил(а) " << victim.getName() << std::endl;
+    LocalTransport(LocalHub& hub, size_t rank) : hub(hub), self(rank) {}
+    size_t rank() const override { return self; }
+    size_t nodes() const override { return hub.nodes(); }
+    bool allGather(const std::vector<char>& message, std::vector<std::vector<char>>& messages) override {
+        return hub.allGather(self, message, messages);
     }
 };
 
-class FileObserver : public Observer {
-    std::ofstream logFile;
+#if defined(__unix__) || defined(__APPLE__)
+// Узлы в разных процессах или машинах: peers[k] - двунаправленный сокет к узлу k
+// (TCP или socketpair, соединяет вызывающий), peers[rank] не используется.
+// Кадр - длина uint64 и байты; отправка и приём идут одновременно через poll().
+class SocketTransport : public Transport {
+    size_t self;
+    std::vector<int> peers;
+
 public:
-    FileObserver() : logFile("log.txt", std::ios::app) {}
-    void onKill(const NPC& killer, const NPC& victim) override {
-        if (logFile.is_open()) {
-            logFile << killer.getName() << " убил(а) " << victim.getName() << std::endl;
+    SocketTransport(size_t rank, std::vector<int> peerSockets) : self(rank), peers(std::move(peerSockets)) {
+        for (size_t k = 0; k < peers.size(); ++k) {
+            if (k != self) fcntl(peers[k], F_SETFL, fcntl(peers[k], F_GETFL) | O_NONBLOCK);
         }
     }
-};
 
-//обработка сражений
-class Visitor {
-public:
-    virtual ~Visitor() = default;
-    virtual void visit(Princess& princess) = 0;
-    virtual void visit(Dragon& dragon) = 0;
-    virtual void visit(Knight& knight) = 0;
+    size_t rank() const override { return self; }
+    size_t nodes() const override { return peers.size(); }
+
+    bool allGather(const std::vector<char>& message, std::vector<std::vector<char>>& messages) override {
+#ifdef MSG_NOSIGNAL
+        constexpr int SEND_FLAGS = MSG_NOSIGNAL; // закрытый узел - ошибка, а не SIGPIPE
+#else
+        constexpr int SEND_FLAGS = 0;
+#endif
+        std::vector<char> frame(sizeof(std::uint64_t));
+        const std::uint64_t length = message.size();
+        std::memcpy(frame.data(), &length, sizeof(length));
+        frame.insert(frame.end(), message.begin(), message.end());
+
+        struct Peer {
+            size_t sent = 0;
+            char lengthBytes[sizeof(std::uint64_t)];
+            size_t received = 0; // сначала байты длины, затем тела
+            bool done = false;
+        };
+        std::vector<Peer> state(peers.size());
+        messages.assign(peers.size(), {});
+        messages[self] = message;
+
+        std::vector<pollfd> fds;
+        for (;;) {
+            fds.clear();
+            for (size_t k = 0; k < peers.size(); ++k) {
+                if (k == self) continue;
+                short events = 0;
+                if (state[k].sent < frame.size()) events |= POLLOUT;
+                if (!state[k].done) events |= POLLIN;
+                if (events) fds.push_back({peers[k], events, 0});
+            }
+            if (fds.empty()) return true;
+            if (poll(fds.data(), static_cast<nfds_t>(fds.size()), -1) < 0) {
+                if (errno == EINTR) continue;
+                return false;
+            }
+            for (const pollfd& polled : fds) {
+                const size_t k = static_cast<size_t>(std::find(peers.begin(), peers.end(), polled.fd) - peers.begin());
+                Peer& peer = state[k];
+                if (polled.revents & POLLOUT) {
+                    ssize_t n = send(polled.fd, frame.data() + peer.sent, frame.size() - peer.sent, SEND_FLAGS);
+                    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+                    if (n > 0) peer.sent += static_cast<size_t>(n);
+                }
+                if (polled.revents & (POLLIN | POLLHUP | POLLERR)) {
+                    char* into;
+                    size_t want;
+                    if (peer.received < sizeof(peer.lengthBytes)) {
+                        into = peer.lengthBytes + peer.received;
+                        want = sizeof(peer.lengthBytes) - peer.received;
+                    } else {
+                        const size_t bodyAt = peer.received - sizeof(peer.lengthBytes);
+                        into = messages[k].data() + bodyAt;
+                        want = messages[k].size() - bodyAt;
+                    }
+                    ssize_t n = want ? recv(polled.fd, into, want, 0) : 0;
+                    if (want && n == 0) return false; // узел закрыл соединение
+                    if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+                    if (n > 0) peer.received += static_cast<size_t>(n);
+                    if (peer.received == sizeof(peer.lengthBytes) && messages[k].empty()) {
+                        std::uint64_t bodyLength;
+                        std::memcpy(&bodyLength, peer.lengthBytes, sizeof(bodyLength));
+                        messages[k].resize(static_cast<size_t>(bodyLength));
+                    }
+                    peer.done = peer.received >= sizeof(peer.lengthBytes) &&
+                                peer.received - sizeof(peer.lengthBytes) == messages[k].size();
+                }
+            }
+        }
+    }
 };
+#endif
 
-class BattleVisitor : public Visitor {
-    NPC* other;
-    double range;
-    Observer& observer;
+// Мир из cols x rows подземелий-шардов. У каждого шарда свои координаты 0..500,
+// глобальные: x = столбец * 501 + локальный x (так же по y). Бой идёт в две фазы:
+// сначала каждый шард сражается у себя (шарды - параллельно, по одному на поток),
+// затем NPC не дальше range от края шарда (гало) сражаются с гало соседей. Вторая
+// фаза видит только пары из разных шардов, порядок пар - по шардам и номерам в них,
+// поэтому итог не зависит от числа потоков.
+//
+// С Transport мир распределён: узел rank владеет полосой строк шардов, после
+// фазы 1 узлы обмениваются гало и убийствами (NodeMessage), и каждый узел
+// одинаково проводит фазу 2 по общему гало. Наблюдатели каждого узла получают
+// убийства всего мира в том же порядке, что и у нераспределённого World.
+class World {
 public:
-    BattleVisitor(double range, Observer& observer) : other(nullptr), range(range), observer(observer) {}
+    static constexpr int SHARD_SPAN = 501;
+    static constexpr int MAX_SHARDS = 32767 / SHARD_SPAN; // глобальные координаты гало - int16
 
-    void setOther(NPC* npc) { other = npc; }
+private:
+    int cols, rows;
+    int firstRow, lastRow; // строки шардов этого узла: [firstRow, lastRow)
+    Transport* transport = nullptr;
+    std::uint32_t round = 0;
+    std::vector<std::unique_ptr<Dungeon>> shards; // по строкам: shards[row * cols + col]; чужие - nullptr
+    std::vector<KillBuffer> shardKills;           // убийства фазы 1 каждого шарда
+    std::unique_ptr<AsyncObserver> consoleLog;
+    std::unique_ptr<AsyncObserver> fileLog;
+    std::string logFile = "log.txt";
+    ObserverList observers;
+    size_t threadCount = 1;
+    std::unique_ptr<ThreadPool> pool;
+
+    // Гало текущего боя: живые NPC у краёв шардов в глобальных координатах
+    struct Halo {
+        std::vector<std::int16_t> x, y;
+        std::vector<NPCType> type;
+        std::vector<std::uint8_t> alive;
+        std::vector<std::uint32_t> shard;
+        std::vector<size_t> id; // номер в шарде (Dungeon::forEachAliveIndexed); у чужих не нужен
+        std::vector<std::string_view> name;
+
+        void add(int npcX, int npcY, NPCType npcType, std::uint32_t npcShard, size_t npcId, std::string_view npcName) {
+            x.push_back(static_cast<std::int16_t>(npcX));
+            y.push_back(static_cast<std::int16_t>(npcY));
+            type.push_back(npcType);
+            alive.push_back(1);
+            shard.push_back(npcShard);
+            id.push_back(npcId);
+            name.push_back(npcName);
+        }
 
-    void visit(Princess& princess) override {
+        void append(const Halo& other) {
+            x.insert(x.end(), other.x.begin(), other.x.end());
+            y.insert(y.end(), other.y.begin(), other.y.end());
+            type.insert(type.end(), other.type.begin(), other.type.end());
+            alive.insert(alive.end(), other.alive.begin(), other.alive.end());
+            shard.insert(shard.end(), other.shard.begin(), other.shard.end());
+            id.insert(id.end(), other.id.begin(), other.id.end());
+            name.insert(name.end(), other.name.begin(), other.name.end());
+        }
+
+        void clear() {
+            x.clear();
+            y.clear();
+            type.clear();
+            alive.clear();
+            shard.clear();
+            id.clear();
+            name.clear();
+        }
+    };
+    std::vector<Halo> shardHalos; // собираются параллельно, затем сливаются в halo
+    Halo halo;
+    SpatialGrid haloGrid;
+    std::vector<size_t> nearby;
+    std::vector<std::vector<size_t>> victims; // погибшие в фазе 2, по шардам
+    NodeMessage::Writer writer;
+    std::vector<std::vector<char>> received; // сообщения раунда; на них указывают имена гало
+    NodeMessage decoded;
+
+    size_t firstShard() const { return static_cast<size_t>(firstRow) * cols; }
+    size_t endShard() const { return static_cast<size_t>(lastRow) * cols; }
+    int maxCoord() const { return std::max(cols, rows) * SHARD_SPAN - 1; }
+    int baseX(size_t s) const { return static_cast<int>(s % static_cast<size_t>(cols)) * SHARD_SPAN; }
+    int baseY(size_t s) const { return static_cast<int>(s / static_cast<size_t>(cols)) * SHARD_SPAN; }
+
+    // f(s) для шардов этого узла
+    template <typename F>
+    void forEachShard(F&& f) {
+        const size_t count = endShard() - firstShard();
+        if (threadCount <= 1 || count <= 1) {
+            for (size_t s = firstShard(); s < endShard(); ++s) f(s);
+            return;
+        }
+        if (!pool || pool->size() != threadCount) pool = std::make_unique<ThreadPool>(threadCount);
+        pool->parallelFor(count, [&](size_t, size_t from, size_t to) {
+            for (size_t s = firstShard() + from; s < firstShard() + to; ++s) f(s);
+        });
+    }
+
+    void collectHalo(size_t s, int margin) {
+        Halo& out = shardHalos[s];
+        out.clear();
+        const Dungeon& dungeon = *shards[s];
+        dungeon.forEachAliveIndexed([&](size_t id, NPCType type, int x, int y) {
+            if (x >= margin && x <= 500 - margin && y >= margin && y <= 500 - margin) return;
+            out.add(baseX(s) + x, baseY(s) + y, type, static_cast<std::uint32_t>(s), id, dungeon.nameOf(id));
+        });
+    }
+
+    void mergeLocalHalos() {
+        for (size_t s = firstShard(); s < endShard(); ++s) halo.append(shardHalos[s]);
     }
 
-    void visit(Dragon& dragon) override {
-        if (other && other->isAlive() && dragon.distanceTo(*other) <= range) {
-            if (other->getType() == NPCType::PRINCESS) {
-                other->markDead();
-                observer.onKill(dragon, *other);
+    // Фаза 1 всех узлов: убийства - наблюдателям по порядку узлов, гало - в halo.
+    // Шарды узлов идут по возрастанию, поэтому порядок тот же, что у одного World.
+    bool exchange() {
+        for (size_t s = firstShard(); s < endShard(); ++s) {
+            shardKills[s].replay(writer);
+            const Halo& part = shardHalos[s];
+            for (size_t k = 0; k < part.x.size(); ++k) writer.addHalo(part.x[k], part.y[k], part.type[k], part.shard[k], part.name[k]);
+        }
+        if (!transport->allGather(writer.finish(round), received)) return false;
+
+        for (size_t node = 0; node < received.size(); ++node) {
+            if (!NodeMessage::decode(received[node], round, decoded)) return false;
+            for (const auto& kill : decoded.kills) observers.onKill(decoded.names[kill.killer], decoded.names[kill.victim]);
+            if (node == transport->rank()) {
+                mergeLocalHalos(); // свои - с номерами NPC в шардах
+                continue;
+            }
+            for (const auto& record : decoded.halo) {
+                const std::uint32_t s = NodeMessage::shardOf(record);
+                if (s >= shards.size() || shards[s]) return false; // чужое гало не может быть из наших шардов
+                halo.add(record.x, record.y, static_cast<NPCType>(record.type), s, SIZE_MAX, decoded.names[record.nameId]);
             }
         }
+        return true;
+    }
+
+    void killInHalo(size_t killer, size_t victim) {
+        halo.alive[victim] = 0;
+        if (shards[halo.shard[victim]]) victims[halo.shard[victim]].push_back(halo.id[victim]);
+        observers.onKill(halo.name[killer], halo.name[victim]);
     }
 
-    void visit(Knight& knight) override {
-        if (other && other->isAlive() && knight.distanceTo(*other) <= range) {
-            if (other->getType() == NPCType::DRAGON) {
-                other->markDead();
-                observer.onKill(knight, *other);
+    // Фаза 2: пары гало из разных шардов, в порядке (i, j), как resolveCandidates подземелья
+    void battleHalo(double range, long long range2) {
+        const BattleView view{halo.x.data(), halo.y.data(), halo.type.data(), halo.alive.data(), halo.x.size()};
+        haloGrid.build(view, range, maxCoord());
+        haloGrid.pack(view);
+        for (size_t i = 0; i < view.size; ++i) {
+            if (!view.alive[i]) continue;
+            nearby.clear();
+            haloGrid.collectNear(i, view.x[i], view.y[i], range2, pairMask(view.type[i]), nearby);
+            std::sort(nearby.begin(), nearby.end());
+            for (size_t j : nearby) {
+                if (halo.shard[i] == halo.shard[j] || !view.alive[j]) continue;
+                if (canKill(view.type[i], view.type[j])) killInHalo(i, j);
+                if (view.alive[i] && canKill(view.type[j], view.type[i])) killInHalo(j, i);
             }
         }
     }
-};
 
-void Princess::accept(Visitor& visitor) { visitor.visit(*this); }
-void Dragon::accept(Visitor& visitor) { visitor.visit(*this); }
-void Knight::accept(Visitor& visitor) { visitor.visit(*this); }
+    void init(StorageMode mode, bool logging) {
+        shards.resize(shardKills.size());
+        for (size_t s = firstShard(); s < endShard(); ++s) {
+            shards[s] = std::make_unique<Dungeon>(mode, false);
+            shards[s]->addObserver(shardKills[s]);
+        }
+        setLogging(logging);
+    }
 
-class NPCFactory {
 public:
-    static std::unique_ptr<NPC> createNPC(NPCType type, const std::string& name, int x, int y) {
-        switch (type) {
-            case NPCType::PRINCESS: return std::unique_ptr<NPC>(new Princess(name, x, y));
-            case NPCType::DRAGON: return std::unique_ptr<NPC>(new Dragon(name, x, y));
-            case NPCType::KNIGHT: return std::unique_ptr<NPC>(new Knight(name, x, y));
+    // Размер сетки шардов ограничен [1, MAX_SHARDS] по каждой оси
+    World(int shardCols, int shardRows, StorageMode mode = StorageMode::SOA, bool logging = true)
+        : cols(std::clamp(shardCols, 1, MAX_SHARDS)), rows(std::clamp(shardRows, 1, MAX_SHARDS)), firstRow(0), lastRow(rows),
+          shardKills(static_cast<size_t>(cols) * rows), shardHalos(shardKills.size()), victims(shardKills.size()) {
+        init(mode, logging);
+    }
+
+    // Узел распределённого мира: строки шардов делятся между узлами поровну по порядку.
+    // Все узлы должны вызывать battle() одинаковое число раз с одинаковым range.
+    World(int shardCols, int shardRows, StorageMode mode, Transport& nodeTransport, bool logging = true)
+        : cols(std::clamp(shardCols, 1, MAX_SHARDS)), rows(std::clamp(shardRows, 1, MAX_SHARDS)),
+          firstRow(static_cast<int>(nodeTransport.rank() * rows / nodeTransport.nodes())),
+          lastRow(static_cast<int>((nodeTransport.rank() + 1) * rows / nodeTransport.nodes())), transport(&nodeTransport),
+          shardKills(static_cast<size_t>(cols) * rows), shardHalos(shardKills.size()), victims(shardKills.size()) {
+        init(mode, logging);
+    }
+
+    World(const World&) = delete;
+    World& operator=(const World&) = delete;
+
+    int width() const { return cols * SHARD_SPAN; }
+    int height() const { return rows * SHARD_SPAN; }
+
+    // Шард принадлежит этому узлу (без Transport - все шарды)
+    bool owns(int col, int row) const { return col >= 0 && col < cols && row >= firstRow && row < lastRow; }
+    Dungeon& shard(int col, int row) { return *shards[static_cast<size_t>(row) * cols + col]; }
+
+    void addObserver(Observer& observer) { observers.add(observer); }
+    void removeObserver(Observer& observer) { observers.remove(observer); }
+
+    // Встроенные журналы мира (консоль и logFile), как у Dungeon; у шардов своих журналов
+    // нет. false - logFile не открылся.
+    bool setLogging(bool enabled) {
+        if (enabled == static_cast<bool>(consoleLog)) return isLogFileOpen();
+        if (enabled) {
+            consoleLog = std::make_unique<AsyncObserver>(std::cout);
+            fileLog = std::make_unique<AsyncObserver>(logFile);
+            observers.add(*consoleLog);
+            observers.add(*fileLog);
+        } else {
+            observers.remove(*consoleLog);
+            observers.remove(*fileLog);
+            consoleLog.reset();
+            fileLog.reset();
         }
-        return nullptr;
+        return isLogFileOpen();
     }
 
-    static std::unique_ptr<NPC> loadFromStream(std::istream& in) {
-        std::string typeStr, name;
-        int x, y;
-        if (in >> typeStr >> name >> x >> y) {
-            NPCType type;
-            if (typeStr == "PRINCESS") type = NPCType::PRINCESS;
-            else if (typeStr == "DRAGON") type = NPCType::DRAGON;
-            else if (typeStr == "KNIGHT") type = NPCType::KNIGHT;
-            else return nullptr;
+    // См. Dungeon::setLogFile
+    bool setLogFile(const std::string& filename) {
+        if (!fileLog) {
+            logFile = filename;
+            return true;
+        }
+        auto opened = std::make_unique<AsyncObserver>(filename);
+        if (!opened->isOpen()) return false;
+        logFile = filename;
+        observers.remove(*fileLog);
+        fileLog = std::move(opened);
+        observers.add(*fileLog);
+        return true;
+    }
+
+    const std::string& getLogFile() const { return logFile; }
+    bool isLogFileOpen() const { return !fileLog || fileLog->isOpen(); }
+
+    // Потоки фазы 1: шарды распределяются между ними целиком
+    void setThreads(size_t threads) { threadCount = std::max<size_t>(1, threads); }
+    size_t getThreads() const { return threadCount; }
 
-            if (x < 0 || x > 500 || y < 0 || y > 500) return nullptr;
-            return createNPC(type, name, x, y);
+    // false - хотя бы один шард остался на SIMD (см. Dungeon::setBattleEngine)
+    bool setBattleEngine(BattleEngine engine) {
+        bool ok = true;
+        for (auto& dungeon : shards) {
+            if (dungeon) ok = dungeon->setBattleEngine(engine) && ok;
         }
-        return nullptr;
+        return ok;
     }
-};
 
-// Класс подземелья
-class Dungeon {
-    std::vector<std::unique_ptr<NPC>> npcs;
-    ConsoleObserver consoleObserver;
-    FileObserver fileObserver;
+    // Живых NPC в шардах этого узла
+    size_t size() const {
+        size_t total = 0;
+        for (const auto& dungeon : shards) {
+            if (dungeon) total += dungeon->size();
+        }
+        return total;
+    }
 
-public:
+    // Глобальные координаты: [0, width()) x [0, height())
     void addNPC(NPCType type, const std::string& name, int x, int y) {
-        if (x < 0 || x > 500 || y < 0 || y > 500) {
+        if (x < 0 || x >= width() || y < 0 || y >= height()) {
             std::cout << "Неверные координаты!" << std::endl;
             return;
         }
-        npcs.push_back(NPCFactory::createNPC(type, name, x, y));
+        if (!owns(x / SHARD_SPAN, y / SHARD_SPAN)) {
+            std::cout << "Координаты вне области узла" << std::endl;
+            return;
+        }
+        shard(x / SHARD_SPAN, y / SHARD_SPAN).addNPC(type, name, x % SHARD_SPAN, y % SHARD_SPAN);
     }
 
+    // По шардам, внутри шарда - в порядке хранения; координаты глобальные
     void print() const {
-        for (const auto& npc : npcs) {
-            if (!npc->isAlive()) continue;
-            std::string typeStr;
-            switch (npc->getType()) {
-                case NPCType::PRINCESS: typeStr = "Принцесса"; break;
-                case NPCType::DRAGON: typeStr = "Дракон"; break;
-                case NPCType::KNIGHT: typeStr = "Рыцарь"; break;
+        BufferedWriter out(std::cout, 64 << 10);
+        for (size_t s = firstShard(); s < endShard(); ++s) {
+            shards[s]->forEachAliveIndexed([&](size_t id, NPCType type, int x, int y) {
+                Dungeon::printLine(out, type, shards[s]->nameOf(id), baseX(s) + x, baseY(s) + y);
+            });
+        }
+    }
+
+    // false - обмен с другими узлами не удался (фаза 1 этого узла уже прошла)
+    bool battle(double range) {
+        const long long range2 = rangeSquared(range);
+        // гало: всё, что ближе margin к краю шарда, может дотянуться до соседа
+        const int margin = range2 < 0 ? 0 : static_cast<int>(std::min(251.0, std::ceil(range)));
+        forEachShard([&](size_t s) {
+            shards[s]->battle(range);
+            shardHalos[s].clear();
+            if (range2 >= 0 && shards.size() > 1) collectHalo(s, margin);
+        });
+
+        bool ok = true;
+        halo.clear();
+        if (transport) {
+            ok = exchange();
+            ++round;
+        } else {
+            for (size_t s = firstShard(); s < endShard(); ++s) shardKills[s].replay(observers);
+            mergeLocalHalos();
+        }
+
+        if (ok && range2 >= 0 && shards.size() > 1) {
+            battleHalo(range, range2);
+            for (size_t s = firstShard(); s < endShard(); ++s) {
+                if (victims[s].empty()) continue;
+                shards[s]->killNPCs(victims[s]);
+                victims[s].clear();
             }
-            std::cout << typeStr << " " << npc->getName() << " at (" << npc->getX() << ", " << npc->getY() << ")" << std::endl;
         }
+        observers.flush();
+        return ok;
     }
+};
 
-    void saveToFile(const std::string& filename) const {
-        std::ofstream file(filename);
-        for (const auto& npc : npcs) {
-            if (!npc->isAlive()) continue;
-            switch (npc->getType()) {
-                case NPCType::PRINCESS: file << "PRINCESS "; break;
-                case NPCType::DRAGON: file << "DRAGON "; break;
-                case NPCType::KNIGHT: file << "KNIGHT "; break;
+// Аргументы команды из потока (интерактивный режим)
+class StreamArgs {
+    std::istream& in;
+public:
+    explicit StreamArgs(std::istream& in) : in(in) {}
+    bool word(std::string& out) { return static_cast<bool>(in >> out); }
+    template <typename T>
+    bool number(T& out) { return static_cast<bool>(in >> out); }
+};
+
+// Аргументы команды из строки сценария
+class LineArgs {
+    LineTokens tokens;
+public:
+    explicit LineArgs(std::string_view line) : tokens(line) {}
+    bool word(std::string& out) {
+        std::string_view token;
+        if (!tokens.next(token)) return false;
+        out.assign(token);
+        return true;
+    }
+    template <typename T>
+    bool number(T& out) {
+        std::string_view token;
+        return tokens.next(token) && parseNumber(token, out);
+    }
+    bool end() {
+        std::string_view token;
+        return !tokens.next(token);
+    }
+};
+
+#if DUNGEON_ASYNC
+// Фоновая команда REPL - сопрограмма на BackgroundJobs. Кадр создаётся остановленным,
+// принадлежит BackgroundJobs и должен завершаться в потоке REPL (после co_await repl()).
+struct Job {
+    struct promise_type {
+        Job get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Вывод, который копится в одном потоке и выводится другим целыми строками
+// (консольный журнал фонового боя: выводится в потоке REPL между ответами)
+class DeferredOutput : private std::streambuf, public std::ostream {
+    std::mutex mutex;
+    std::string text;
+
+    int overflow(int c) override {
+        if (c == std::char_traits<char>::eof()) return std::char_traits<char>::not_eof(c);
+        std::lock_guard<std::mutex> lock(mutex);
+        text += std::char_traits<char>::to_char_type(c);
+        return c;
+    }
+
+    std::streamsize xsputn(const char* bytes, std::streamsize count) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        text.append(bytes, static_cast<size_t>(count));
+        return count;
+    }
+
+public:
+    DeferredOutput() : std::ostream(static_cast<std::streambuf*>(this)) {}
+
+    // Целые строки - в out; недописанная остаётся до следующего раза
+    void drainTo(std::ostream& out) {
+        std::string lines;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            const size_t end = text.rfind('\n');
+            if (end == std::string::npos) return;
+            lines = text.substr(0, end + 1);
+            text.erase(0, end + 1);
+        }
+        out << lines << std::flush;
+    }
+};
+
+// Исполнитель фоновых команд: одна задача за раз. co_await worker() продолжает её в
+// фоновом потоке, co_await repl() - в потоке REPL, когда тот вызовет poll() или wait().
+// Так тяжёлая часть не держит ввод команд, а итог применяется к миру между командами.
+class BackgroundJobs {
+    std::mutex mutex;
+    std::condition_variable wake, ready;
+    std::deque<std::coroutine_handle<>> forWorker, forRepl;
+    bool stopping = false;
+    std::coroutine_handle<> current; // кадр текущей задачи
+    std::string title;
+    Progress progress;
+    DeferredOutput output;
+    std::thread worker; // запускается первой задачей
+
+    void workerLoop() {
+        for (;;) {
+            std::coroutine_handle<> next;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                wake.wait(lock, [&] { return stopping || !forWorker.empty(); });
+                if (forWorker.empty()) return;
+                next = forWorker.front();
+                forWorker.pop_front();
             }
-            file << npc->getName() << " " << npc->getX() << " " << npc->getY() << std::endl;
+            next.resume();
         }
     }
 
-    void loadFromFile(const std::string& filename) {
-        std::ifstream file(filename);
-        npcs.clear();
-        std::unique_ptr<NPC> npc;
-        while ((npc = NPCFactory::loadFromStream(file))) {
-            npcs.push_back(std::move(npc));
+    void post(std::coroutine_handle<> handle, bool onWorker) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (onWorker) {
+            forWorker.push_back(handle);
+            wake.notify_one();
+        } else {
+            forRepl.push_back(handle);
+            ready.notify_one();
         }
     }
 
-    void battle(double range) {
-        BattleVisitor visitor(range, consoleObserver);
-        for (size_t i = 0; i < npcs.size(); ++i) {
-            if (!npcs[i]->isAlive()) continue;
-            for (size_t j = i + 1; j < npcs.size(); ++j) {
-                if (!npcs[j]->isAlive()) continue;
-                visitor.setOther(npcs[j].get());
-                npcs[i]->accept(visitor);
-                visitor.setOther(npcs[i].get());
-                npcs[j]->accept(visitor);
+    struct Switch {
+        BackgroundJobs& jobs;
+        bool onWorker;
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> handle) { jobs.post(handle, onWorker); }
+        void await_resume() const noexcept {}
+    };
+
+    // Продолжения в потоке REPL; block - ждать, пока задача не завершится
+    void drain(bool block) {
+        while (current) {
+            std::deque<std::coroutine_handle<>> due;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                if (block) ready.wait(lock, [&] { return !forRepl.empty(); });
+                due.swap(forRepl);
+            }
+            if (due.empty()) return;
+            for (auto handle : due) handle.resume();
+            if (current.done()) {
+                current.destroy();
+                current = nullptr;
             }
         }
-        // Удаляем мёртвых NPC
-        npcs.erase(
-            std::remove_if(npcs.begin(), npcs.end(), [](const std::unique_ptr<NPC>& npc) { return !npc->isAlive(); }),
-            npcs.end()
-        );
+    }
+
+public:
+    BackgroundJobs() = default;
+    BackgroundJobs(const BackgroundJobs&) = delete;
+    BackgroundJobs& operator=(const BackgroundJobs&) = delete;
+
+    ~BackgroundJobs() {
+        wait();
+        if (!worker.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        worker.join();
+    }
+
+    Switch toWorker() { return {*this, true}; }
+    Switch toRepl() { return {*this, false}; }
+
+    bool busy() const { return static_cast<bool>(current); }
+    const std::string& name() const { return title; }
+    Progress& getProgress() { return progress; }
+
+    // Поток для вывода задачи из фонового потока; в std::cout попадает в poll(),
+    // wait() и flushOutput() - в потоке REPL, между ответами на команды
+    std::ostream& console() { return output; }
+    void flushOutput() { output.drainTo(std::cout); }
+
+    // Предыдущая задача сначала дожидается; job выполняется до первого co_await
+    void start(std::string what, Job job) {
+        wait();
+        if (!worker.joinable()) worker = std::thread([this] { workerLoop(); });
+        title = std::move(what);
+        progress.cancel.store(false);
+        progress.start(0);
+        current = job.handle;
+        current.resume();
+        if (current.done()) {
+            current.destroy();
+            current = nullptr;
+        }
+    }
+
+    void poll() {
+        flushOutput();
+        drain(false);
+    }
+
+    void wait() {
+        flushOutput();
+        drain(true);
     }
 };
+#endif
 
-int main() {
-    Dungeon dungeon;
-    std::string command;
+// Команды REPL. Разбор общий для std::cin и сценариев (run <файл>, ./lab6 <файл>):
+// сценарий идёт без приглашений, ошибки выводятся с номером строки,
+// а подряд идущие add вставляются одной пачкой.
+class CommandRunner {
+    static constexpr size_t MAX_DEPTH = 16; // вложенные run
+    static constexpr size_t UNDO_DEPTH = 16; // версий для undo
+
+    Dungeon& dungeon;
+    size_t depth = 0;
+    std::vector<WorldVersion> history; // до battle, tick, load и loadbin; страницы общие
+    std::vector<NPCRecord> pendingAdds;
+    std::vector<size_t> pendingLines; // строки сценария для pendingAdds
+    WorldVersion jobVersion; // мир на начало фоновой задачи (bg): по нему отвечают print и count
+    BattleStats jobStats;
+#if DUNGEON_ASYNC
+    BackgroundJobs jobs; // последним: разрушается первым и дожидается задачи
+#endif
+
+    static bool parseType(const std::string& name, NPCType& type) { return Species::find(Species::commands, name, type); }
+
+    void remember() {
+        if (history.size() == UNDO_DEPTH) history.erase(history.begin());
+        history.push_back(dungeon.snapshot());
+    }
+
+    void flushAdds() {
+        if (pendingAdds.empty()) return;
+        for (size_t k : dungeon.addNPCs(pendingAdds).rejected) {
+            std::cout << "Строка " << pendingLines[k] << ": Неверные координаты!" << std::endl;
+        }
+        pendingAdds.clear();
+        pendingLines.clear();
+    }
+
+#if DUNGEON_ASYNC
+    // Фоновые battle, save и load (команда bg). Бой меняет мир в фоновом потоке, поэтому
+    // до его конца команды, кроме print, count, stats, jobs и cancel, ждут; save пишет
+    // версию, load разбирает файл отдельно от мира и ставит его уже в потоке REPL.
+    void startJob(std::string title, Job job) {
+        // фоновый такт делит с задачей пул потоков подземелья
+        dungeon.settleTick();
+        jobVersion = dungeon.snapshot();
+        jobStats = dungeon.getStats();
+        jobs.start(std::move(title), job);
+    }
 
-    while (std::cout << "Выберите команду: " && std::cin >> command) {
+    // Журнал убийств боя копится в jobs.console(), чтобы не разрывать ответы REPL
+    Job battleJob(double range) {
+        dungeon.setConsole(jobs.console());
+        co_await jobs.toWorker();
+        dungeon.setProgress(&jobs.getProgress());
+        const bool finished = dungeon.battle(range);
+        dungeon.setProgress(nullptr);
+        co_await jobs.toRepl();
+        dungeon.setConsole(std::cout);
+        jobs.flushOutput();
+        if (finished) {
+            std::cout << "bg: battle завершён" << std::endl;
+        } else {
+            dungeon.restore(history.back());
+            history.pop_back();
+            std::cout << "bg: battle отменён, мир возвращён" << std::endl;
+        }
+    }
+
+    Job saveJob(std::string filename) {
+        const WorldVersion version = jobVersion;
+        co_await jobs.toWorker();
+        const bool saved = Dungeon::saveVersion(filename, version, &jobs.getProgress());
+        co_await jobs.toRepl();
+        if (saved) std::cout << "bg: save завершён" << std::endl;
+        else if (jobs.getProgress().cancelled()) std::cout << "bg: save отменён" << std::endl;
+        else std::cout << "bg: Не удалось сохранить файл" << std::endl;
+    }
+
+    Job loadJob(std::string filename) {
+        co_await jobs.toWorker();
+        NPCStore loaded;
+        std::vector<LoadError> errors;
+        dungeon.setProgress(&jobs.getProgress());
+        const bool finished = dungeon.readTextFile(filename, loaded, errors);
+        dungeon.setProgress(nullptr);
+        co_await jobs.toRepl();
+        if (!finished) {
+            std::cout << "bg: load отменён" << std::endl;
+            co_return;
+        }
+        remember();
+        dungeon.installLoaded(std::move(loaded));
+        for (const auto& loadError : errors) {
+            std::cout << "bg: ";
+            if (loadError.line > 0) std::cout << "Строка " << loadError.line << ": ";
+            std::cout << loadError.message << std::endl;
+        }
+        std::cout << "bg: load завершён" << std::endl;
+    }
+
+    // Команда, которую можно выполнить, не дожидаясь фоновой задачи
+    static bool runsAlongsideJob(const std::string& command) {
+        return command == "print" || command == "count" || command == "stats" || command == "jobs" || command == "cancel";
+    }
+#endif
+
+    // Команда с аргументами из args; error(сообщение) - неверный ввод. false - exit.
+    template <typename Args, typename Error>
+    bool execute(const std::string& command, Args& args, Error&& error) {
+#if DUNGEON_ASYNC
+        jobs.poll();
+        const bool alongside = jobs.busy() && runsAlongsideJob(command);
+        if (jobs.busy() && !alongside) jobs.wait();
+#else
+        const bool alongside = false;
+#endif
         if (command == "add") {
             std::string type, name;
             int x, y;
-            std::cin >> type >> name >> x >> y;
+            if (!args.word(type) || !args.word(name) || !args.number(x) || !args.number(y)) {
+                error("ожидалось: add тип имя x y");
+                return true;
+            }
             NPCType npcType;
-            if (type == "princess") npcType = NPCType::PRINCESS;
-            else if (type == "dragon") npcType = NPCType::DRAGON;
-            else if (type == "knight") npcType = NPCType::KNIGHT;
-            else {
-                std::cout << "Неизвестный NPC" << std::endl;
-                continue;
+            if (!parseType(type, npcType)) {
+                error("Неизвестный NPC");
+                return true;
             }
             dungeon.addNPC(npcType, name, x, y);
         } else if (command == "print") {
-            dungeon.print();
+            if (alongside) Dungeon::print(jobVersion);
+            else dungeon.print();
         } else if (command == "save") {
             std::string filename;
-            std::cin >> filename;
-            dungeon.saveToFile(filename);
+            if (!args.word(filename)) error("ожидалось: save файл");
+            else if (!dungeon.saveToFile(filename)) error("Не удалось сохранить файл");
+        } else if (command == "savebg") {
+            std::string filename;
+            if (!args.word(filename)) error("ожидалось: savebg файл");
+            else if (!dungeon.saveToFileAsync(filename)) error("Не удалось сохранить файл (прошлое фоновое сохранение)");
         } else if (command == "load") {
             std::string filename;
-            std::cin >> filename;
-            dungeon.loadFromFile(filename);
+            if (!args.word(filename)) {
+                error("ожидалось: load файл");
+                return true;
+            }
+            remember();
+            for (const auto& loadError : dungeon.loadFromFile(filename)) {
+                if (loadError.line > 0) error("Строка " + std::to_string(loadError.line) + ": " + loadError.message);
+                else error(loadError.message);
+            }
+        } else if (command == "savebin") {
+            std::string filename;
+            if (!args.word(filename)) error("ожидалось: savebin файл");
+            else if (!dungeon.saveSnapshot(filename)) error("Не удалось сохранить снимок");
+        } else if (command == "loadbin") {
+            std::string filename;
+            if (!args.word(filename)) {
+                error("ожидалось: loadbin файл");
+                return true;
+            }
+            remember();
+            if (!dungeon.loadSnapshot(filename)) {
+                history.pop_back();
+                error("Не удалось загрузить снимок");
+            }
         } else if (command == "battle") {
             double range;
-            std::cin >> range;
+            if (!args.number(range)) {
+                error("ожидалось: battle радиус");
+                return true;
+            }
+            remember();
             dungeon.battle(range);
+        } else if (command == "storage") {
+            std::string mode;
+            args.word(mode);
+            if (mode == "objects") dungeon.setStorageMode(StorageMode::OBJECTS);
+            else if (mode == "soa") dungeon.setStorageMode(StorageMode::SOA);
+            else error("Неизвестный режим хранения");
+        } else if (command == "engine") {
+            std::string name;
+            args.word(name);
+            if (name == "visitor") dungeon.setBattleEngine(BattleEngine::VISITOR);
+            else if (name == "table") dungeon.setBattleEngine(BattleEngine::TABLE);
+            else if (name == "simd") dungeon.setBattleEngine(BattleEngine::SIMD);
+            else if (name == "gpu") {
+                if (!dungeon.setBattleEngine(BattleEngine::GPU)) error("GPU недоступен (" + dungeon.getGpuStatus() + "), используется simd");
+            }
+            else error("Неизвестный движок боя");
+        } else if (command == "threads") {
+            size_t threads;
+            if (!args.number(threads)) error("ожидалось: threads число");
+            else dungeon.setThreads(threads);
+        } else if (command == "compaction") {
+            double fraction;
+            if (!args.number(fraction)) error("ожидалось: compaction доля");
+            else dungeon.setCompactionThreshold(fraction);
+        } else if (command == "compact") {
+            dungeon.compact();
+        } else if (command == "tick") {
+            size_t count;
+            double range;
+            if (!args.number(count) || !args.number(range)) {
+                error("ожидалось: tick число радиус");
+                return true;
+            }
+            remember();
+            for (size_t t = 0; t < count; ++t) dungeon.tick(range);
+        } else if (command == "speed") {
+            std::string type;
+            int speed;
+            NPCType npcType;
+            if (!args.word(type) || !args.number(speed)) error("ожидалось: speed тип клеток");
+            else if (!parseType(type, npcType)) error("Неизвестный NPC");
+            else dungeon.setSpeed(npcType, speed);
+        } else if (command == "near") {
+            int x, y;
+            double range;
+            if (!args.number(x) || !args.number(y) || !args.number(range)) error("ожидалось: near x y радиус");
+            else if (x < 0 || x > 500 || y < 0 || y > 500) error("Неверные координаты!");
+            else dungeon.print(dungeon.near(x, y, range));
+        } else if (command == "knn") {
+            int x, y;
+            size_t k;
+            if (!args.number(x) || !args.number(y) || !args.number(k)) error("ожидалось: knn x y число");
+            else if (x < 0 || x > 500 || y < 0 || y > 500) error("Неверные координаты!");
+            else dungeon.print(dungeon.nearest(x, y, k));
+        } else if (command == "count") {
+            std::string type;
+            NPCType npcType;
+            if (!args.word(type)) error("ожидалось: count тип");
+            else if (!parseType(type, npcType)) error("Неизвестный NPC");
+            else std::cout << NPCFactory::typeName(npcType) << ": " << (alongside ? jobVersion.countOf(npcType) : dungeon.count(npcType)) << std::endl;
+        } else if (command == "journal") {
+            std::string snapshotFile, journalFile;
+            if (!args.word(snapshotFile)) error("ожидалось: journal снимок журнал | journal off");
+            else if (snapshotFile == "off") dungeon.closeJournal();
+            else if (!args.word(journalFile)) error("ожидалось: journal снимок журнал | journal off");
+            else if (!dungeon.openJournal(snapshotFile, journalFile)) error("Не удалось начать журнал");
+        } else if (command == "checkpoint") {
+            if (!dungeon.isJournaling()) error("Журнал не открыт");
+            else if (!dungeon.checkpoint()) error("Не удалось записать контрольную точку");
+        } else if (command == "recover") {
+            std::string snapshotFile, journalFile;
+            if (!args.word(snapshotFile) || !args.word(journalFile)) {
+                error("ожидалось: recover снимок журнал");
+                return true;
+            }
+            remember();
+            RecoveryReport report;
+            const bool ok = dungeon.recover(snapshotFile, journalFile, report);
+            if (!ok && !report.journalUsed) error("Не удалось загрузить снимок");
+            else if (!ok) error("Журнал повреждён после записи " + std::to_string(report.replayed));
+            else if (!report.journalUsed) error("Журнал не найден или не от этого снимка: загружен только снимок");
+            else std::cout << "Записей журнала: " << report.replayed << std::endl;
+        } else if (command == "undo") {
+            if (history.empty()) {
+                error("Нечего отменять");
+                return true;
+            }
+            dungeon.restore(history.back());
+            history.pop_back();
+        } else if (command == "stats") {
+            if (alongside) Dungeon::printStats(jobStats);
+            else dungeon.printStats();
+        } else if (command == "statsdump") {
+            std::string filename;
+            if (!args.word(filename)) error("ожидалось: statsdump файл");
+            else if (!dungeon.saveStats(filename)) error("Не удалось записать статистику");
+        } else if (command == "logfile") {
+            std::string filename;
+            if (!args.word(filename)) error("ожидалось: logfile файл");
+            else if (!dungeon.setLogFile(filename)) error("Не удалось открыть журнал " + filename);
+        } else if (command == "convert") {
+            std::string from, to;
+            if (!args.word(from) || !args.word(to)) error("ожидалось: convert из в");
+            else if (!convertFile(from, to)) error("Не удалось преобразовать файл");
+        } else if (command == "run") {
+            std::string filename;
+            if (!args.word(filename)) error("ожидалось: run файл");
+            else if (depth >= MAX_DEPTH) error("слишком глубокая вложенность run");
+            else return runFile(filename, error);
+        } else if (command == "bg") {
+            std::string what;
+            if (!args.word(what)) {
+                error("ожидалось: bg battle|save|load ...");
+#if DUNGEON_ASYNC
+            } else if (what == "battle") {
+                double range;
+                if (!args.number(range)) {
+                    error("ожидалось: bg battle радиус");
+                    return true;
+                }
+                remember();
+                startJob("battle", battleJob(range));
+            } else if (what == "save" || what == "load") {
+                std::string filename;
+                if (!args.word(filename)) error("ожидалось: bg " + what + " файл");
+                else if (what == "save") startJob("save " + filename, saveJob(filename));
+                else startJob("load " + filename, loadJob(filename));
+            } else {
+                error("в фоне выполняются только battle, save и load");
+            }
+#else
+            } else if (what != "battle" && what != "save" && what != "load") {
+                error("в фоне выполняются только battle, save и load");
+            } else {
+                std::cout << "bg: сборка без C++20, команда выполняется сразу" << std::endl;
+                return execute(what, args, error);
+            }
+#endif
+        } else if (command == "jobs") {
+#if DUNGEON_ASYNC
+            if (jobs.busy()) {
+                const Progress& progress = jobs.getProgress();
+                std::cout << jobs.name() << ": " << progress.done.load() << " из " << progress.total.load() << std::endl;
+                return true;
+            }
+#endif
+            std::cout << "Фоновых задач нет" << std::endl;
+        } else if (command == "cancel") {
+#if DUNGEON_ASYNC
+            if (jobs.busy()) {
+                jobs.getProgress().cancel.store(true);
+                return true;
+            }
+#endif
+            error("Нет фоновой задачи");
+        } else if (command == "wait") {
+            // фоновая задача уже дождалась в начале execute()
         } else if (command == "exit") {
-            break;
+            return false;
+        } else {
+            error("Неизвестная команда!");
+        }
+        return true;
+    }
+
+    // add из сценария: синтаксис проверяется сразу, координаты и вставка - в flushAdds()
+    template <typename Error>
+    void queueAdd(LineArgs& args, size_t lineNumber, Error&& error) {
+        std::string type;
+        NPCRecord record;
+        if (!args.word(type) || !args.word(record.name) || !args.number(record.x) || !args.number(record.y) || !args.end()) {
+            error("ожидалось: add тип имя x y");
+        } else if (!parseType(type, record.type)) {
+            error("Неизвестный NPC");
         } else {
-            std::cout << "Неизвестная команда!" << std::endl;
+            pendingAdds.push_back(std::move(record));
+            pendingLines.push_back(lineNumber);
+        }
+    }
+
+    template <typename Error>
+    bool runFile(const std::string& filename, Error&& error) {
+        auto file = MappedFile::open(filename);
+        if (!file) {
+            error("не удалось открыть файл " + filename);
+            return true;
+        }
+        return runScript(std::string_view(file->data(), file->size()));
+    }
+
+public:
+    explicit CommandRunner(Dungeon& dungeon) : dungeon(dungeon) {}
+
+    // Интерактивный цикл с приглашением
+    void interactive(std::istream& in) {
+        StreamArgs args(in);
+        std::string command;
+        auto error = [](const std::string& message) { std::cout << message << std::endl; };
+        while (std::cout << "Выберите команду: " && in >> command) {
+            if (!execute(command, args, error)) break;
+        }
+    }
+
+    // Сценарий: команда на строку, пустые строки и строки с # пропускаются. false - был exit.
+    bool runScript(std::string_view text) {
+        ++depth;
+        bool running = true;
+        size_t lineNumber = 0;
+        while (running && !text.empty()) {
+            ++lineNumber;
+            size_t end = text.find('\n');
+            std::string_view line = text.substr(0, end);
+            text.remove_prefix(end == std::string_view::npos ? text.size() : end + 1);
+
+            LineArgs args(line);
+            std::string command;
+            if (!args.word(command) || command[0] == '#') continue;
+            auto error = [&](const std::string& message) {
+                std::cout << "Строка " << lineNumber << ": " << message << std::endl;
+            };
+            if (command == "add") {
+                queueAdd(args, lineNumber, error);
+                continue;
+            }
+            flushAdds();
+            running = execute(command, args, error);
+        }
+        flushAdds();
+        --depth;
+        return running;
+    }
+
+    // Файл сценария; "-" - весь std::cin. false - был exit.
+    bool runScriptFile(const std::string& filename) {
+        if (filename == "-") {
+            std::string text(std::istreambuf_iterator<char>(std::cin), std::istreambuf_iterator<char>());
+            return runScript(text);
         }
+        return runFile(filename, [](const std::string& message) { std::cout << message << std::endl; });
     }
+};
 
+#ifndef DUNGEON_NO_MAIN
+// ./lab6 - интерактивный режим; ./lab6 файл... (или - для std::cin) - сценарии без приглашений
+int main(int argc, char** argv) {
+    Dungeon dungeon;
+    if (!dungeon.isLogFileOpen()) std::cout << "Не удалось открыть журнал " << dungeon.getLogFile() << std::endl;
+    CommandRunner runner(dungeon);
+    if (argc > 1) {
+        for (int i = 1; i < argc && runner.runScriptFile(argv[i]); ++i) {
+        }
+        return 0;
+    }
+    runner.interactive(std::cin);
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -0,0 +1,96 @@
+// Фоновые команды (bg, сборка C++20): bg battle, save и load с wait дают тот же мир
+// и файлы, что и обычные команды, а журнал убийств фонового боя не разрывает ответы.
+#include "check.h"
+
+#include <sstream>
+
+static_assert(DUNGEON_ASYNC, "background_test собирается по C++20");
+
+// Вывод сценария целиком; std::cout на время подменяется
+static std::string runCaptured(CommandRunner& runner, const std::string& script) {
+    std::ostringstream captured;
+    std::streambuf* previous = std::cout.rdbuf(captured.rdbuf());
+    runner.runScript(script);
+    std::cout.rdbuf(previous);
+    return captured.str();
+}
+
+static std::vector<std::string> splitLines(const std::string& text) {
+    std::vector<std::string> lines;
+    std::istringstream in(text);
+    for (std::string line; std::getline(in, line);) lines.push_back(line);
+    return lines;
+}
+
+static bool isKill(const std::string& line) {
+    const size_t at = line.find(" убил(а) ");
+    return at != std::string::npos && at > 0 && line.find(' ') == at && line.rfind(' ') == at + std::strlen(" убил(а)");
+}
+
+static void testBattle(std::mt19937& rng) {
+    const std::vector<NPCRecord> records = randomRecords(3000, rng);
+    Dungeon reference(StorageMode::OBJECTS, false);
+    reference.addNPCs(records);
+    reference.battle(30);
+
+    Dungeon dungeon(StorageMode::OBJECTS, false);
+    dungeon.setLogFile("background_test_kills.txt");
+    std::filesystem::remove("background_test_kills.txt");
+    dungeon.setLogging(true);
+    dungeon.addNPCs(records);
+    CommandRunner runner(dungeon);
+    const std::vector<std::string> lines = splitLines(runCaptured(runner, "bg battle 30\ncount\nprint\njobs\ncount\nwait\ncount\n"));
+    dungeon.setLogging(false);
+    check(linesOf(dungeon.snapshot()) == linesOf(reference.snapshot()), "bg battle: мир не тот же, что после battle");
+
+    // строки журнала целые и все до сообщения о конце боя; ответы не задеты журналом
+    size_t kills = 0, finished = lines.size();
+    bool whole = true;
+    for (size_t i = 0; i < lines.size(); ++i) {
+        if (isKill(lines[i])) {
+            ++kills;
+            whole = i < finished && whole;
+        } else {
+            whole = lines[i].find("убил") == std::string::npos && whole;
+            if (lines[i] == "bg: battle завершён") finished = i;
+        }
+    }
+    const size_t died = records.size() - linesOf(reference.snapshot()).size();
+    check(finished < lines.size(), "bg battle: нет сообщения о конце боя");
+    check(whole, "bg battle: журнал убийств вперемешку с ответами");
+    check(kills == died, "bg battle: в выводе не все убийства");
+    const std::vector<char> logged = readBytes("background_test_kills.txt");
+    check(splitLines(std::string(logged.begin(), logged.end())).size() == died, "bg battle: в файле журнала не все убийства");
+
+    // отменённый бой возвращает мир; успевший закончиться - как обычный
+    Dungeon cancelled(StorageMode::OBJECTS, false);
+    cancelled.addNPCs(records);
+    const std::vector<std::string> before = linesOf(cancelled.snapshot());
+    CommandRunner cancelRunner(cancelled);
+    runCaptured(cancelRunner, "bg battle 30\ncancel\nwait\n");
+    const std::vector<std::string> after = linesOf(cancelled.snapshot());
+    check(after == before || after == linesOf(reference.snapshot()), "bg battle: после cancel мир ни прежний, ни после боя");
+}
+
+static void testSaveLoad(std::mt19937& rng, StorageMode mode) {
+    Dungeon dungeon(mode, false);
+    dungeon.addNPCs(randomRecords(2000, rng));
+    const std::vector<std::string> expected = linesOf(dungeon.snapshot());
+    CommandRunner runner(dungeon);
+    runCaptured(runner, "save background_test_plain.txt\nbg save background_test_bg.txt\nadd dragon late 1 1\nwait\n");
+    check(readBytes("background_test_bg.txt") == readBytes("background_test_plain.txt"), "bg save: файл не тот же, что у save");
+
+    Dungeon loaded(mode, false);
+    CommandRunner loadRunner(loaded);
+    const std::string output = runCaptured(loadRunner, "bg load background_test_bg.txt\nwait\n");
+    check(linesOf(loaded.snapshot()) == expected, "bg load: мир не тот же, что в файле");
+    check(output.find("bg: load завершён") != std::string::npos, "bg load: нет сообщения о конце загрузки");
+}
+
+int main() {
+    std::mt19937 rng(2024);
+    testBattle(rng);
+    testSaveLoad(rng, StorageMode::OBJECTS);
+    testSaveLoad(rng, StorageMode::SOA);
+    return finish("background_test");
+}
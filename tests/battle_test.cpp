@@ -0,0 +1,201 @@
+// Бой всеми движками (VISITOR, TABLE, SIMD) в обоих хранилищах, на 1 и 4 потоках, с
+// кэшем пар, боем по новым NPC и уплотнением - против исходного перебора всех пар:
+// те же выжившие в том же порядке и те же убийства в том же порядке. Фильтр кандидатов
+// SIMD - каждым набором инструкций, который есть у сборки и процессора; таблица имён
+// при уплотнениях не копит имена мёртвых.
+#include "check.h"
+
+// Пачка NPC с разными именами; часть - в тесных кучах, чтобы в клетках сетки было тесно
+static std::vector<NPCRecord> fighters(size_t count, size_t& serial, std::mt19937& rng) {
+    std::vector<NPCRecord> records;
+    for (size_t i = 0; i < count; ++i) {
+        int x = static_cast<int>(rng() % 501), y = static_cast<int>(rng() % 501);
+        if (i % 4 == 0) {
+            x = 250 + static_cast<int>(rng() % 9) - 4;
+            y = 100 + static_cast<int>(rng() % 9) - 4;
+        }
+        records.push_back({static_cast<NPCType>(rng() % NPC_TYPE_COUNT), "n" + std::to_string(serial++), x, y});
+    }
+    return records;
+}
+
+struct Setup {
+    StorageMode mode;
+    BattleEngine engine;
+    size_t threads;
+    size_t cachePairs;
+    double compaction;
+};
+
+static std::string describe(const Setup& setup) {
+    static const char* engines[] = {"visitor", "table", "simd", "gpu"};
+    return std::string(setup.mode == StorageMode::SOA ? "soa" : "objects") + "/" + engines[static_cast<int>(setup.engine)] +
+           "/потоков " + std::to_string(setup.threads) + "/кэш " + std::to_string(setup.cachePairs) + "/уплотнение " +
+           std::to_string(setup.compaction);
+}
+
+// Бои подряд: полный, по новым NPC (радиус не больше), снова полный (больший радиус),
+// затем по кэшу после undo; границы sqrt - целые и иррациональные радиусы
+// Такты (движение и бой по сдвинутым NPC) сверяются с первой настройкой - objects/visitor
+// на одном потоке, бой которой только что сошёлся с перебором
+// (движение - общее для всех настроек, и без tick() его не повторить)
+static std::vector<std::string> ticked;
+
+static void testSetup(const Setup& setup) {
+    std::mt19937 rng(7);
+    size_t serial = 0;
+    Dungeon dungeon(setup.mode, false);
+    dungeon.setBattleEngine(setup.engine);
+    dungeon.setThreads(setup.threads);
+    dungeon.setBattleCacheLimit(setup.cachePairs);
+    dungeon.setCompactionThreshold(setup.compaction);
+    KillRecorder recorder;
+    dungeon.addObserver(recorder);
+    std::vector<Fighter> reference;
+    std::vector<std::string> expectedKills;
+
+    auto add = [&](size_t count) {
+        const std::vector<NPCRecord> records = fighters(count, serial, rng);
+        dungeon.addNPCs(records);
+        for (const NPCRecord& record : records) reference.push_back({record.type, record.name, record.x, record.y, true, 0});
+    };
+    bool same = true;
+    auto battle = [&](double range) {
+        dungeon.battle(range);
+        referenceBattle(reference, range, expectedKills);
+        same = linesOf(dungeon.snapshot()) == linesOf(reference) && recorder.kills == expectedKills && same;
+    };
+
+    add(1500);
+    battle(7.0710678118654755); // sqrt(50): пары на расстоянии 5,5 и 1,7 на границе
+    add(200);
+    battle(7.0710678118654755);
+    add(30);
+    battle(5);
+    battle(3.5);
+    dungeon.compact();
+    add(100);
+    battle(12);
+    battle(0);
+    add(300);
+    battle(20.5);
+    // undo и повтор по той же геометрии: второй бой копит пары, следующие берут их из кэша
+    add(400);
+    const WorldVersion before = dungeon.snapshot();
+    const std::vector<Fighter> saved = reference;
+    for (double range : {9.0, 9.0, 6.5, 9.0}) {
+        dungeon.restore(before);
+        reference = saved;
+        battle(range);
+    }
+    check(same, "бой " + describe(setup) + ": не как в переборе всех пар");
+
+    for (size_t type = 0; type < NPC_TYPE_COUNT; ++type) dungeon.setSpeed(static_cast<NPCType>(type), 2 + static_cast<int>(type));
+    const size_t killsBefore = recorder.kills.size();
+    for (int tick = 0; tick < 4; ++tick) dungeon.tick(6);
+    std::vector<std::string> after = linesOf(dungeon.snapshot());
+    after.insert(after.end(), recorder.kills.begin() + static_cast<std::ptrdiff_t>(killsBefore), recorder.kills.end());
+    if (ticked.empty()) ticked = after;
+    check(after == ticked, "такты " + describe(setup) + ": не как в objects/visitor");
+    if (DUNGEON_STATS && !(setup.mode == StorageMode::OBJECTS && setup.engine == BattleEngine::VISITOR)) {
+        check(dungeon.getStats().incremental > 0, "бой " + describe(setup) + ": не было боя по новым NPC");
+        check(setup.cachePairs == 0 || setup.compaction < 1 || dungeon.getStats().cached > 0, "бой " + describe(setup) + ": не было боя по кэшу");
+    }
+    dungeon.removeObserver(recorder);
+}
+
+// Долгая игра с уплотнением: таблица имён не копит имена убранных мёртвых, а имена
+// живых после её пересборки те же; версия до пересборки остаётся верной
+static void testNames(StorageMode mode) {
+    const std::string name = mode == StorageMode::SOA ? "soa" : "objects";
+    std::mt19937 rng(3);
+    size_t serial = 0;
+    Dungeon dungeon(mode, false);
+    dungeon.setCompactionThreshold(0.2);
+    std::vector<Fighter> reference;
+    std::vector<std::string> kills;
+    // драконы (без рыцарей их никто не убивает) съедают всех принцесс: живых прибавляется мало
+    auto add = [&](size_t count) {
+        std::vector<NPCRecord> records = fighters(count, serial, rng);
+        for (size_t k = 0; k < records.size(); ++k) records[k].type = k % 10 == 0 ? NPCType::DRAGON : NPCType::PRINCESS;
+        dungeon.addNPCs(records);
+        for (const NPCRecord& record : records) reference.push_back({record.type, record.name, record.x, record.y, true, 0});
+    };
+    add(1000);
+    const WorldVersion early = dungeon.snapshot();
+    const std::vector<std::string> earlyLines = linesOf(early);
+    bool same = true, bounded = true;
+    for (int round = 0; round < 30; ++round) {
+        add(300);
+        dungeon.battle(800);
+        referenceBattle(reference, 800, kills);
+        same = linesOf(dungeon) == linesOf(reference) && same;
+        bounded = dungeon.nameCount() <= 2 * dungeon.size() + 300 && bounded;
+    }
+    check(same, "имена " + name + ": после уплотнений не те NPC");
+    check(bounded && serial > 4 * dungeon.nameCount(), "имена " + name + ": имена мёртвых не убираются");
+    check(linesOf(early) == earlyLines, "имена " + name + ": версия до пересборки имён изменилась");
+    dungeon.restore(early);
+    check(linesOf(dungeon) == earlyLines, "имена " + name + ": restore к версии до пересборки имён");
+}
+
+static const char* simdName(SimdLevel level) {
+    static const char* names[] = {"scalar", "simd128", "avx2"};
+    return names[static_cast<int>(level)];
+}
+
+// filterCandidates набором level против скалярного: любые длины (хвосты) и расстояния
+// ровно на границе range2
+static void testFilter(SimdLevel level, std::mt19937& rng) {
+    bool same = true;
+    for (int round = 0; round < 400; ++round) {
+        const size_t count = rng() % 70;
+        const int ox = static_cast<int>(rng() % 501), oy = static_cast<int>(rng() % 501);
+        const std::int32_t range2 = static_cast<std::int32_t>(rng() % 1200);
+        std::vector<std::int32_t> xy(count);
+        std::vector<std::uint32_t> typeBits(count);
+        std::vector<size_t> ids(count);
+        for (size_t k = 0; k < count; ++k) {
+            int dx = static_cast<int>(rng() % 81) - 40, dy = static_cast<int>(rng() % 81) - 40;
+            if (k % 3 == 0) dy = static_cast<int>(std::sqrt(std::max(0, range2 - dx * dx))) * (k % 2 ? 1 : -1);
+            xy[k] = packXY(std::clamp(ox + dx, 0, 500), std::clamp(oy + dy, 0, 500));
+            typeBits[k] = 1u << (rng() % NPC_TYPE_COUNT);
+            ids[k] = rng();
+        }
+        const std::uint32_t typeMask = static_cast<std::uint32_t>(rng() % (1u << NPC_TYPE_COUNT));
+        std::vector<size_t> expected, got;
+        setSimdLevel(SimdLevel::SCALAR);
+        filterCandidates(xy.data(), typeBits.data(), ids.data(), count, packXY(ox, oy), range2, typeMask, expected);
+        setSimdLevel(level);
+        filterCandidates(xy.data(), typeBits.data(), ids.data(), count, packXY(ox, oy), range2, typeMask, got);
+        same = got == expected && same;
+    }
+    check(same, std::string("фильтр ") + simdName(level) + ": не как скалярный");
+}
+
+int main() {
+    std::mt19937 rng(2024);
+#if DUNGEON_AVX2
+    check(!__builtin_cpu_supports("avx2") || bestSimdLevel() == SimdLevel::AVX2, "avx2 есть у процессора, но не выбран");
+#endif
+    const SimdLevel best = bestSimdLevel();
+    for (SimdLevel level : {SimdLevel::SCALAR, SimdLevel::SIMD128, SimdLevel::AVX2}) {
+        if (!setSimdLevel(level)) continue;
+        testFilter(level, rng);
+        testSetup({StorageMode::SOA, BattleEngine::SIMD, 1, 0, 0.3});
+        testSetup({StorageMode::OBJECTS, BattleEngine::SIMD, 4, size_t(1) << 20, 0.0});
+    }
+    setSimdLevel(best);
+    testNames(StorageMode::OBJECTS);
+    testNames(StorageMode::SOA);
+    for (StorageMode mode : {StorageMode::OBJECTS, StorageMode::SOA}) {
+        for (BattleEngine engine : {BattleEngine::VISITOR, BattleEngine::TABLE, BattleEngine::SIMD}) {
+            for (size_t threads : {1, 4}) {
+                for (size_t cachePairs : {size_t(0), size_t(1) << 20}) {
+                    for (double compaction : {0.0, 0.3, 1.0}) testSetup({mode, engine, threads, cachePairs, compaction});
+                }
+            }
+        }
+    }
+    return finish("battle_test");
+}
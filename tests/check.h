@@ -0,0 +1,133 @@
+// Общее для проверок tests/*_test.cpp: подземелье без main() и простые утверждения.
+// Каждая проверка - отдельная программа, код возврата 0 - всё верно (ctest).
+#pragma once
+#define DUNGEON_NO_MAIN
+#include "../main.cpp"
+
+#include <filesystem>
+#include <random>
+
+inline int failures = 0;
+
+inline void check(bool ok, const std::string& what) {
+    if (ok) return;
+    ++failures;
+    std::cout << "ОШИБКА: " << what << std::endl;
+}
+
+inline std::vector<char> readBytes(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    return std::vector<char>(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+}
+
+inline void writeBytes(const std::string& filename, const char* data, size_t size) {
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    out.write(data, static_cast<std::streamsize>(size));
+}
+
+inline void writeBytes(const std::string& filename, const std::vector<char>& bytes) { writeBytes(filename, bytes.data(), bytes.size()); }
+
+template <typename T>
+inline void patch(std::vector<char>& bytes, size_t at, T value) {
+    std::memcpy(bytes.data() + at, &value, sizeof(value));
+}
+
+// Живые NPC строками "ТИП имя x y" в порядке хранения
+template <typename Source>
+inline std::vector<std::string> linesOf(const Source& source) {
+    std::vector<std::string> lines;
+    source.forEachAlive([&](NPCType type, std::string_view name, int x, int y) {
+        lines.push_back(std::string(NPCFactory::typeKeyword(type)) + " " + std::string(name) + " " + std::to_string(x) + " " +
+                        std::to_string(y));
+    });
+    return lines;
+}
+
+// Без snapshot(): сама проверка не меняет учёт страниц версий
+inline std::vector<std::string> linesOf(const Dungeon& dungeon) {
+    std::vector<std::string> lines;
+    dungeon.forEachAliveIndexed([&](size_t id, NPCType type, int x, int y) {
+        lines.push_back(std::string(NPCFactory::typeKeyword(type)) + " " + std::string(dungeon.nameOf(id)) + " " + std::to_string(x) +
+                        " " + std::to_string(y));
+    });
+    return lines;
+}
+
+inline std::vector<std::string> linesOf(const NPCStore& store) {
+    std::vector<std::string> lines;
+    for (size_t i = 0; i < store.size(); ++i) {
+        if (!store.alive[i]) continue;
+        lines.push_back(std::string(NPCFactory::typeKeyword(store.type[i])) + " " + std::string(store.nameAt(i)) + " " +
+                        std::to_string(store.x[i]) + " " + std::to_string(store.y[i]));
+    }
+    return lines;
+}
+
+// Убийства строками "убийца жертва" в порядке наблюдателя
+class KillRecorder : public Observer {
+public:
+    std::vector<std::string> kills;
+    using Observer::onKill;
+    void onKill(std::string_view killerName, std::string_view victimName) override {
+        kills.push_back(std::string(killerName) + " " + std::string(victimName));
+    }
+};
+
+inline std::vector<NPCRecord> randomRecords(size_t count, std::mt19937& rng) {
+    std::vector<NPCRecord> records;
+    for (size_t i = 0; i < count; ++i) {
+        // имена повторяются, как в мире, собранном из нескольких файлов
+        records.push_back({static_cast<NPCType>(rng() % NPC_TYPE_COUNT), "npc" + std::to_string(rng() % (count / 2 + 1)),
+                           static_cast<int>(rng() % 501), static_cast<int>(rng() % 501)});
+    }
+    return records;
+}
+
+// Исходный бой (первая версия Dungeon::battle) - образец для движков: каждая пара
+// i < j живых, сначала i атакует j, затем j атакует i; расстояние через sqrt.
+// crossShard - только пары из разных шардов (фаза 2 World)
+struct Fighter {
+    NPCType type;
+    std::string name;
+    int x, y;
+    bool alive;
+    size_t shard = 0;
+};
+
+inline bool referenceKills(NPCType killer, NPCType victim) {
+    return (killer == NPCType::DRAGON && victim == NPCType::PRINCESS) || (killer == NPCType::KNIGHT && victim == NPCType::DRAGON);
+}
+
+inline void referenceBattle(std::vector<Fighter>& world, double range, std::vector<std::string>& kills, bool crossShard = false) {
+    for (size_t i = 0; i < world.size(); ++i) {
+        if (!world[i].alive) continue;
+        for (size_t j = i + 1; j < world.size(); ++j) {
+            if (!world[j].alive || (crossShard && world[i].shard == world[j].shard)) continue;
+            if (std::sqrt(std::pow(world[i].x - world[j].x, 2) + std::pow(world[i].y - world[j].y, 2)) > range) continue;
+            if (referenceKills(world[i].type, world[j].type)) {
+                world[j].alive = false;
+                kills.push_back(world[i].name + " " + world[j].name);
+            }
+            if (world[i].alive && referenceKills(world[j].type, world[i].type)) {
+                world[i].alive = false;
+                kills.push_back(world[j].name + " " + world[i].name);
+            }
+        }
+    }
+    world.erase(std::remove_if(world.begin(), world.end(), [](const Fighter& fighter) { return !fighter.alive; }), world.end());
+}
+
+inline std::vector<std::string> linesOf(const std::vector<Fighter>& world) {
+    std::vector<std::string> lines;
+    for (const Fighter& fighter : world) {
+        lines.push_back(std::string(NPCFactory::typeKeyword(fighter.type)) + " " + fighter.name + " " + std::to_string(fighter.x) +
+                        " " + std::to_string(fighter.y));
+    }
+    return lines;
+}
+
+// Итог проверки для main(): код возврата и строка в вывод ctest
+inline int finish(const char* name) {
+    std::cout << name << (failures ? ": ошибок " + std::to_string(failures) : std::string(": всё верно")) << std::endl;
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,186 @@
+// Блок LZ4 и сжатые файлы *.dz: круг на случайных и повторяющихся данных, затем
+// обрезанные и испорченные блоки и кадры.
+#include "check.h"
+
+// Распаковка пишет в буфер ровно нужного размера, так что выход за границу под
+// -fsanitize=address сразу виден.
+static void testCompression(std::mt19937& rng) {
+    std::vector<std::string> inputs{"", "a", "abcd", std::string(13, 'z'), std::string(100000, '\0')};
+    for (size_t size = 1; size < 48; ++size) {
+        std::string random(size, ' ');
+        for (char& c : random) c = static_cast<char>(rng());
+        inputs.push_back(random);
+    }
+    std::string random(CompressedFormat::BLOCK_SIZE, ' '), text, periodic;
+    for (char& c : random) c = static_cast<char>(rng());
+    while (text.size() < CompressedFormat::BLOCK_SIZE) {
+        text += "DRAGON npc" + std::to_string(rng() % 300) + " " + std::to_string(rng() % 501) + " " + std::to_string(rng() % 501) + "\n";
+    }
+    for (size_t k = 0; k < 70000; ++k) periodic += static_cast<char>("ab"[k % 2] + k / 9000); // ссылки с перекрытием
+    inputs.push_back(random);
+    inputs.push_back(text);
+    inputs.push_back(periodic);
+
+    bool roundTrip = true, tooSmall = true, truncated = true;
+    for (const std::string& input : inputs) {
+        std::vector<char> packed(Lz4Block::bound(input.size()));
+        packed.resize(Lz4Block::compress(input.data(), input.size(), packed.data()));
+        std::vector<char> raw(input.size());
+        roundTrip = Lz4Block::decompress(packed.data(), packed.size(), raw.data(), raw.size()) == input.size() &&
+                    std::equal(raw.begin(), raw.end(), input.begin()) && roundTrip;
+        if (input.empty()) continue;
+        std::vector<char> shorter(input.size() - 1);
+        tooSmall = Lz4Block::decompress(packed.data(), packed.size(), shorter.data(), shorter.size()) == Lz4Block::FAILED && tooSmall;
+        for (size_t cut = 0; cut < packed.size(); cut += 1 + cut / 64) {
+            std::vector<char> part(packed.begin(), packed.begin() + static_cast<std::ptrdiff_t>(cut));
+            truncated = Lz4Block::decompress(part.data(), part.size(), raw.data(), raw.size()) != input.size() && truncated;
+        }
+    }
+    check(roundTrip, "LZ4: круг сжатие-распаковка");
+    check(tooSmall, "LZ4: распаковка не заметила малый буфер");
+    check(truncated, "LZ4: обрезанный блок распакован целиком");
+
+    // испорченный блок: ошибка или сколько-то байт, но не больше буфера
+    std::vector<char> packed(Lz4Block::bound(text.size()));
+    packed.resize(Lz4Block::compress(text.data(), text.size(), packed.data()));
+    check(packed.size() < text.size() / 2, "LZ4: текст не сжимается");
+    bool bounded = true;
+    for (int round = 0; round < 2000; ++round) {
+        std::vector<char> broken = packed;
+        for (int k = 0; k < 1 + round % 4; ++k) broken[rng() % broken.size()] = static_cast<char>(rng());
+        if (round % 3 == 0) {
+            for (char& c : broken) c = static_cast<char>(rng()); // мусор вместо блока
+        }
+        std::vector<char> raw(text.size());
+        const size_t size = Lz4Block::decompress(broken.data(), broken.size(), raw.data(), raw.size());
+        bounded = (size == Lz4Block::FAILED || size <= raw.size()) && bounded;
+    }
+    check(bounded, "LZ4: испорченный блок вышел за буфер");
+
+    // кадр из нескольких блоков, затем дописанный второй кадр
+    const std::string file = "compression_test_stream.txt.dz", copy = "compression_test_cut.txt.dz";
+    std::string expected;
+    size_t firstFrame = 0;
+    for (int frame = 0; frame < 2; ++frame) {
+        auto out = openOutput(file, frame > 0);
+        const std::string part = frame == 0 ? text + random + text + periodic : text;
+        out->write(part.data(), static_cast<std::streamsize>(part.size()));
+        out.reset();
+        expected += part;
+        if (frame == 0) firstFrame = readBytes(file).size();
+    }
+    auto whole = MappedFile::open(file);
+    check(whole && std::string(whole->data(), whole->size()) == expected, "DZ: круг через два кадра");
+
+    // обрезанный файл - ошибка, кроме ровной границы кадров; журнал (tornTail)
+    // отбрасывает оборванный хвост целыми блоками. Меньше сигнатуры - уже не *.dz
+    const std::vector<char> bytes = readBytes(file);
+    bool strict = true, prefix = true;
+    for (size_t cut = sizeof(CompressedFormat::MAGIC); cut < bytes.size(); cut += 1 + rng() % 997) {
+        writeBytes(copy, bytes.data(), cut);
+        strict = !MappedFile::open(copy) && strict;
+        auto torn = MappedFile::open(copy, nullptr, true);
+        prefix = torn && torn->size() <= expected.size() && expected.compare(0, torn->size(), torn->data(), torn->size()) == 0 && prefix;
+    }
+    check(strict, "DZ: принят обрезанный файл");
+    check(prefix, "DZ: обрезанный журнал прочитан не префиксом");
+    writeBytes(copy, bytes.data(), firstFrame);
+    whole = MappedFile::open(copy);
+    check(whole && whole->size() == expected.size() - text.size(), "DZ: не прочитан первый из двух кадров");
+
+    auto rejected = [&](const std::vector<char>& broken, const std::string& what) {
+        writeBytes(copy, broken);
+        check(!MappedFile::open(copy) && !MappedFile::open(copy, nullptr, true), "DZ: принят " + what);
+    };
+    const size_t firstBlock = CompressedFormat::HEADER_SIZE;
+    std::vector<char> broken = bytes;
+    patch(broken, firstBlock, CompressedFormat::BLOCK_SIZE + 1);
+    rejected(broken, "блок больше размера блока кадра");
+    broken = bytes;
+    patch(broken, firstBlock, CompressedFormat::UNCOMPRESSED | 0x7FFFFFFFu);
+    rejected(broken, "несжатый блок в 2 ГиБ");
+    broken = bytes;
+    broken[6] ^= 1;
+    rejected(broken, "с неверной суммой заголовка");
+    broken = bytes;
+    broken.push_back('x');
+    writeBytes(copy, broken);
+    check(!MappedFile::open(copy), "DZ: принят мусор после кадра");
+    broken = bytes;
+    broken[0] ^= 1;
+    writeBytes(copy, broken);
+    whole = MappedFile::open(copy);
+    check(whole && std::string(whole->data(), whole->size()) == std::string(broken.begin(), broken.end()),
+          "DZ: файл с чужой сигнатурой не прочитан как есть");
+
+    // кадры, собранные вручную: флаги FLG/BD, блоки и суммы как у утилиты lz4
+    auto frame = [](std::uint8_t flags, std::uint8_t descriptor, const std::vector<std::string>& blocks, bool compressed) {
+        std::vector<char> out(4);
+        std::memcpy(out.data(), &CompressedFormat::MAGIC, 4);
+        out.push_back(static_cast<char>(flags));
+        out.push_back(static_cast<char>(descriptor));
+        out.push_back(static_cast<char>(xxHash32(out.data() + 4, 2) >> 8));
+        auto put32 = [&](std::uint32_t value) { out.insert(out.end(), reinterpret_cast<char*>(&value), reinterpret_cast<char*>(&value) + 4); };
+        for (const std::string& block : blocks) {
+            put32(static_cast<std::uint32_t>(block.size()) | (compressed ? 0 : CompressedFormat::UNCOMPRESSED));
+            out.insert(out.end(), block.begin(), block.end());
+            if (flags & 0x10) put32(xxHash32(block.data(), block.size()));
+        }
+        put32(0);
+        return out;
+    };
+    auto reads = [&](const std::vector<char>& bytes, const std::string& content) {
+        writeBytes(copy, bytes);
+        auto file = MappedFile::open(copy);
+        return file && std::string(file->data(), file->size()) == content;
+    };
+    check(xxHash32("", 0) == 0x02CC5D05u && xxHash32("abc", 3) == 0x32D153FFu &&
+              xxHash32("Nobody inspects the spammish repetition", 39) == 0xE2293B2Fu,
+          "xxHash32: эталонные значения");
+    const std::string literals(64, 'q');
+    // 60 байт ссылкой на 64 назад (в предыдущий блок), затем 5 литералов
+    const std::string linkedBlock = std::string("\x0F\x40\x00\x29\x50", 5) + "tail!";
+    check(reads(frame(0x40, 0x40, {literals, "0123456789"}, false), literals + "0123456789"), "DZ: связанные несжатые блоки");
+    const std::string firstPacked = std::string(1, static_cast<char>(0xF0)) + std::string(1, 49) + literals;
+    check(reads(frame(0x40, 0x70, {firstPacked, linkedBlock}, true), literals + std::string(60, 'q') + "tail!"),
+          "DZ: связанный блок со ссылкой в предыдущий");
+    check(!reads(frame(0x60, 0x70, {firstPacked, linkedBlock}, true), literals + std::string(60, 'q') + "tail!"),
+          "DZ: независимый блок сослался в предыдущий");
+    check(reads(frame(0x70, 0x40, {literals}, false), literals), "DZ: блок с суммой");
+    std::vector<char> withChecksum = frame(0x70, 0x40, {literals}, false);
+    withChecksum[withChecksum.size() - 5] ^= 1;
+    check(!reads(withChecksum, literals), "DZ: принят блок с неверной суммой");
+    std::vector<char> content = frame(0x64, 0x40, {literals}, false);
+    const std::uint32_t sum = xxHash32(literals.data(), literals.size());
+    content.insert(content.end(), reinterpret_cast<const char*>(&sum), reinterpret_cast<const char*>(&sum) + 4);
+    check(reads(content, literals), "DZ: кадр с суммой содержимого");
+    content.back() ^= 1;
+    check(!reads(content, literals), "DZ: принят кадр с неверной суммой содержимого");
+    check(!reads(frame(0x61, 0x40, {literals}, false), literals), "DZ: принят кадр со словарём");
+    check(!reads(frame(0x62, 0x40, {literals}, false), literals), "DZ: принят кадр с зарезервированным битом");
+    check(!reads(frame(0xA0, 0x40, {literals}, false), literals), "DZ: принят кадр другой версии");
+    check(!reads(frame(0x60, 0x30, {literals}, false), literals), "DZ: принят кадр с блоками меньше 64 КиБ");
+    // пара байт не должна распаковываться в гигабайты: длина ссылки 5 МиБ больше блока 4 МиБ
+    std::string bomb = std::string("\x1F", 1) + "a" + std::string("\x01\x00", 2) + std::string(5 << 12, static_cast<char>(255)) + "\x00";
+    check(!reads(frame(0x60, 0x70, {bomb}, true), ""), "DZ: принят блок длиннее размера блока кадра");
+    std::vector<char> skippable(8, 0);
+    const std::uint32_t skip = CompressedFormat::SKIPPABLE | 3;
+    std::memcpy(skippable.data(), &skip, 4);
+    std::vector<char> withSkip = frame(0x60, 0x40, {literals}, false);
+    withSkip.insert(withSkip.begin(), skippable.begin(), skippable.end());
+    check(reads(withSkip, literals), "DZ: не пропущен пустой кадр");
+
+    // снимок тоже пишется и читается сжатым
+    NPCStore store, loaded;
+    for (const auto& record : randomRecords(500, rng)) store.add(record.type, record.name, record.x, record.y);
+    check(Snapshot::save("compression_test_snapshot.bin.dz", store) && Snapshot::load("compression_test_snapshot.bin.dz", loaded) &&
+              linesOf(loaded) == linesOf(store),
+          "DZ: круг снимка");
+    for (const auto& name : {file, copy, std::string("compression_test_snapshot.bin.dz")}) std::filesystem::remove(name);
+}
+
+int main() {
+    std::mt19937 rng(2024);
+    testCompression(rng);
+    return finish("compression_test");
+}
@@ -0,0 +1,60 @@
+// Движок gpu (сборка с DUNGEON_WITH_OPENCL) против SIMD и исходного перебора: те же
+// убийства в том же порядке и те же выжившие в обоих хранилищах, в том числе в бою по
+// новым NPC и после тактов. Без устройства OpenCL проверка пропускается (код 77).
+#include "check.h"
+
+#ifndef DUNGEON_WITH_OPENCL
+#error "gpu_test собирается с DUNGEON_WITH_OPENCL"
+#endif
+
+static void testEngines(StorageMode mode, size_t threads) {
+    const std::string name = std::string(mode == StorageMode::SOA ? "soa" : "objects") + "/потоков " + std::to_string(threads);
+    std::mt19937 rng(5);
+    Dungeon gpu(mode, false), simd(mode, false);
+    gpu.setBattleEngine(BattleEngine::GPU);
+    simd.setBattleEngine(BattleEngine::SIMD);
+    gpu.setThreads(threads);
+    KillRecorder gpuKills, simdKills;
+    gpu.addObserver(gpuKills);
+    simd.addObserver(simdKills);
+    std::vector<Fighter> reference;
+    std::vector<std::string> expectedKills;
+
+    bool same = true;
+    for (double range : {7.0710678118654755, 7.0710678118654755, 0.0, 15.0, 40.0}) {
+        const std::vector<NPCRecord> records = randomRecords(2000, rng);
+        gpu.addNPCs(records);
+        simd.addNPCs(records);
+        for (const NPCRecord& record : records) reference.push_back({record.type, record.name, record.x, record.y, true, 0});
+        gpu.battle(range);
+        simd.battle(range);
+        referenceBattle(reference, range, expectedKills);
+        same = gpuKills.kills == expectedKills && simdKills.kills == expectedKills && linesOf(gpu) == linesOf(reference) && same;
+    }
+    check(same, "gpu " + name + ": бой не как в переборе");
+    check(gpu.getBattleEngine() == BattleEngine::GPU, "gpu " + name + ": движок сменился на " + gpu.getGpuStatus());
+
+    for (size_t type = 0; type < NPC_TYPE_COUNT; ++type) {
+        gpu.setSpeed(static_cast<NPCType>(type), 5);
+        simd.setSpeed(static_cast<NPCType>(type), 5);
+    }
+    for (int tick = 0; tick < 3; ++tick) {
+        gpu.tick(9);
+        simd.tick(9);
+    }
+    check(gpuKills.kills == simdKills.kills && linesOf(gpu) == linesOf(simd), "gpu " + name + ": такты не как у simd");
+    gpu.removeObserver(gpuKills);
+    simd.removeObserver(simdKills);
+}
+
+int main() {
+    Dungeon probe(StorageMode::SOA, false);
+    if (!probe.setBattleEngine(BattleEngine::GPU)) {
+        std::cout << "gpu_test: пропущено, " << probe.getGpuStatus() << std::endl;
+        return 77;
+    }
+    for (StorageMode mode : {StorageMode::OBJECTS, StorageMode::SOA}) {
+        for (size_t threads : {1, 4}) testEngines(mode, threads);
+    }
+    return finish("gpu_test");
+}
@@ -0,0 +1,88 @@
+// Журнал DJNL (Journal, Dungeon::recover): круг запись-восстановление в обоих
+// хранилищах, обрезанный хвост, чужой заголовок и записи, не подходящие к миру.
+#include "check.h"
+
+static void testJournal(std::mt19937& rng, StorageMode mode) {
+    const std::string snapshot = "journal_test.bin", log = "journal_test.log", copy = "journal_test_cut.log";
+    std::vector<std::string> expected;
+    std::uint64_t ticks;
+    {
+        Dungeon dungeon(mode, false);
+        dungeon.addNPCs(randomRecords(300, rng));
+        check(dungeon.openJournal(snapshot, log), "журнал: открытие");
+        for (size_t type = 0; type < NPC_TYPE_COUNT; ++type) dungeon.setSpeed(static_cast<NPCType>(type), 3);
+        dungeon.addNPCs(randomRecords(100, rng));
+        dungeon.tick(4);
+        dungeon.tick(4);
+        dungeon.battle(6);
+        dungeon.addNPC(NPCType::KNIGHT, "last", 250, 250);
+        dungeon.compact();
+        expected = linesOf(dungeon.snapshot());
+        ticks = dungeon.getTicks();
+        dungeon.closeJournal();
+    }
+    RecoveryReport report;
+    {
+        Dungeon recovered(mode, false);
+        check(recovered.recover(snapshot, log, report) && report.journalUsed, "журнал: восстановление");
+        check(linesOf(recovered.snapshot()) == expected && recovered.getTicks() == ticks, "журнал: мир после восстановления");
+    }
+    const size_t total = report.replayed;
+    const std::vector<char> bytes = readBytes(log);
+
+    // оборванный хвост отбрасывается: применяется только целая часть журнала
+    size_t previous = 0;
+    bool monotonic = true, recovered = true;
+    for (size_t cut = sizeof(JournalHeader); cut < bytes.size(); cut += 1 + cut % 7) {
+        writeBytes(copy, bytes.data(), cut);
+        Dungeon dungeon(mode, false);
+        recovered = dungeon.recover(snapshot, copy, report) && report.journalUsed && recovered;
+        monotonic = report.replayed >= previous && report.replayed < total && monotonic;
+        previous = report.replayed;
+    }
+    check(recovered, "журнал: обрезанный не восстановился");
+    check(monotonic, "журнал: обрезанный применён не префиксом");
+
+    auto unused = [&](const std::vector<char>& broken, const std::string& what) {
+        writeBytes(copy, broken);
+        Dungeon dungeon(mode, false);
+        check(dungeon.recover(snapshot, copy, report) && !report.journalUsed && dungeon.getTicks() == 0,
+              "журнал: применён " + what);
+    };
+    unused(std::vector<char>(bytes.begin(), bytes.begin() + sizeof(JournalHeader) - 1), "обрезанный заголовок");
+    std::vector<char> broken = bytes;
+    broken[0] = 'X';
+    unused(broken, "с чужой сигнатурой");
+    broken = bytes;
+    patch(broken, offsetof(JournalHeader, version), Journal::VERSION + 1);
+    unused(broken, "другой версии");
+    broken = bytes;
+    patch(broken, offsetof(JournalHeader, snapshotRecords), std::uint64_t(1));
+    unused(broken, "от другого снимка");
+
+    // запись, не подходящая к миру, останавливает восстановление ошибкой
+    broken = bytes;
+    broken.resize(sizeof(JournalHeader));
+    JournalRecord kill{Journal::KILL, 0, 0, 0, 0, 1000000};
+    broken.insert(broken.end(), reinterpret_cast<const char*>(&kill), reinterpret_cast<const char*>(&kill) + sizeof(kill));
+    writeBytes(copy, broken);
+    {
+        Dungeon dungeon(mode, false);
+        check(!dungeon.recover(snapshot, copy, report), "журнал: принято убийство несуществующего NPC");
+    }
+    JournalRecord move{Journal::MOVE, 0, 0, 600, 0, 0};
+    std::memcpy(broken.data() + sizeof(JournalHeader), &move, sizeof(move));
+    writeBytes(copy, broken);
+    {
+        Dungeon dungeon(mode, false);
+        check(!dungeon.recover(snapshot, copy, report), "журнал: принят сдвиг за карту");
+    }
+    for (const auto& name : {snapshot, log, copy}) std::filesystem::remove(name);
+}
+
+int main() {
+    std::mt19937 rng(2024);
+    testJournal(rng, StorageMode::SOA);
+    testJournal(rng, StorageMode::OBJECTS);
+    return finish("journal_test");
+}
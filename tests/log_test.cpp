@@ -0,0 +1,92 @@
+// Журналы убийств подземелья и мира (AsyncObserver): файл получает те же убийства в
+// том же порядке, что и наблюдатель; файл, который не открылся, - ошибка, прежний
+// журнал продолжает писать; без журналов log.txt не создаётся.
+#include "check.h"
+
+#include <filesystem>
+#include <sstream>
+
+static std::vector<std::string> fileKills(const std::string& filename) {
+    std::vector<std::string> kills;
+    std::ifstream in(filename);
+    for (std::string line; std::getline(in, line);) {
+        const size_t at = line.find(" убил(а) ");
+        if (at != std::string::npos) kills.push_back(line.substr(0, at) + " " + line.substr(at + std::strlen(" убил(а) ")));
+    }
+    return kills;
+}
+
+static void testDungeon(std::mt19937& rng) {
+    std::filesystem::remove("log_test_first.txt");
+    std::filesystem::remove("log_test_second.txt");
+    std::ostringstream console;
+    Dungeon dungeon(StorageMode::SOA, false);
+    dungeon.setConsole(console);
+    check(dungeon.setLogFile("log_test_first.txt") && dungeon.setLogging(true), "журнал: log_test_first.txt не открылся");
+    KillRecorder recorder;
+    dungeon.addObserver(recorder);
+    dungeon.addNPCs(randomRecords(1500, rng));
+    dungeon.battle(10);
+    const size_t first = recorder.kills.size();
+
+    check(!dungeon.setLogFile("log_test_missing/kills.txt"), "журнал: файл в несуществующем каталоге открылся");
+    check(dungeon.getLogFile() == "log_test_first.txt" && dungeon.isLogFileOpen(), "журнал: после ошибки журнал сменился");
+    dungeon.addNPCs(randomRecords(800, rng));
+    dungeon.battle(10);
+    const size_t second = recorder.kills.size();
+
+    check(dungeon.setLogFile("log_test_second.txt"), "журнал: log_test_second.txt не открылся");
+    dungeon.addNPCs(randomRecords(800, rng));
+    dungeon.battle(10);
+    dungeon.setLogging(false);
+    dungeon.removeObserver(recorder);
+
+    const std::vector<std::string> kills = recorder.kills;
+    check(first > 0 && second > first && kills.size() > second, "журнал: в боях никто не погиб");
+    check(fileKills("log_test_first.txt") == std::vector<std::string>(kills.begin(), kills.begin() + second),
+          "журнал: в log_test_first.txt не те убийства");
+    check(fileKills("log_test_second.txt") == std::vector<std::string>(kills.begin() + second, kills.end()),
+          "журнал: в log_test_second.txt не те убийства");
+    check(!std::filesystem::exists("log_test_missing"), "журнал: каталог создан");
+
+    // REPL сообщает об ошибке, как о других ошибках ввода-вывода
+    dungeon.setLogging(true);
+    CommandRunner runner(dungeon);
+    std::ostringstream output;
+    std::streambuf* previous = std::cout.rdbuf(output.rdbuf());
+    runner.runScript("logfile log_test_missing/kills.txt\n");
+    std::cout.rdbuf(previous);
+    dungeon.setLogging(false);
+    check(output.str() == "Строка 1: Не удалось открыть журнал log_test_missing/kills.txt\n", "журнал: REPL не сообщил об ошибке");
+}
+
+static void testWorld(std::mt19937& rng) {
+    std::filesystem::remove("log_test_world.txt");
+    World world(2, 2, StorageMode::SOA, false);
+    check(world.setLogFile("log_test_world.txt"), "журнал мира: log_test_world.txt не открылся");
+    KillRecorder recorder;
+    world.addObserver(recorder);
+    // консольный журнал мира пишет в std::cout: на время боёв он подменён
+    std::ostringstream console;
+    std::streambuf* previous = std::cout.rdbuf(console.rdbuf());
+    const bool opened = world.setLogging(true);
+    for (const NPCRecord& record : randomRecords(1500, rng)) world.addNPC(record.type, record.name, 2 * record.x, 2 * record.y);
+    world.battle(20);
+    const bool rejected = !world.setLogFile("log_test_missing/world.txt") && world.getLogFile() == "log_test_world.txt";
+    world.battle(40);
+    world.setLogging(false);
+    std::cout.rdbuf(previous);
+    world.removeObserver(recorder);
+    check(opened, "журнал мира: log_test_world.txt не открылся");
+    check(rejected, "журнал мира: файл в несуществующем каталоге открылся");
+    check(!recorder.kills.empty() && fileKills("log_test_world.txt") == recorder.kills, "журнал мира: в файле не те убийства");
+}
+
+int main() {
+    std::mt19937 rng(2024);
+    std::filesystem::remove("log.txt");
+    testDungeon(rng);
+    testWorld(rng);
+    check(!std::filesystem::exists("log.txt"), "журнал: log.txt создан без журналов");
+    return finish("log_test");
+}
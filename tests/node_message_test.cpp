@@ -0,0 +1,166 @@
+// Сообщение узла World (NodeMessage): круг Writer-decode, чужой раунд, каждое
+// обрезанное сообщение и номера имён, смещения и типы вне пределов. Узлы распределённого
+// мира (LocalTransport, SocketTransport) видят те же убийства и те же шарды, что и World
+// без узлов.
+#include "check.h"
+
+static void testNodeMessage(std::mt19937& rng) {
+    NodeMessage::Writer writer;
+    std::vector<NPCRecord> halo = randomRecords(30, rng);
+    for (size_t k = 0; k < halo.size(); ++k) writer.addHalo(halo[k].x + 1000, halo[k].y, halo[k].type, static_cast<std::uint32_t>(k * 70001), halo[k].name);
+    writer.onKill("killer", "victim");
+    writer.onKill(halo[0].name, halo[1].name);
+    const std::vector<char> bytes = writer.finish(7);
+
+    NodeMessage message;
+    check(NodeMessage::decode(bytes, 7, message), "сообщение: разбор");
+    bool same = message.halo.size() == halo.size() && message.kills.size() == 2;
+    for (size_t k = 0; same && k < halo.size(); ++k) {
+        const SnapshotRecord& record = message.halo[k];
+        same = record.x == halo[k].x + 1000 && record.y == halo[k].y && record.type == static_cast<std::uint8_t>(halo[k].type) &&
+               NodeMessage::shardOf(record) == (k * 70001 & 0xFFFFFF) && message.names[record.nameId] == halo[k].name;
+    }
+    same = same && message.names[message.kills[0].killer] == "killer" && message.names[message.kills[1].victim] == halo[1].name;
+    check(same, "сообщение: содержимое после круга");
+    check(!NodeMessage::decode(bytes, 8, message), "сообщение: принят чужой раунд");
+    check(NodeMessage::decode(writer.finish(8), 8, message) && message.halo.empty() && message.kills.empty(),
+          "сообщение: писатель не очищен после finish");
+
+    auto rejected = [&](const std::vector<char>& broken, const std::string& what) {
+        check(!NodeMessage::decode(broken, 7, message), "сообщение: принято " + what);
+    };
+    for (size_t cut = 0; cut < bytes.size(); ++cut) {
+        rejected(std::vector<char>(bytes.begin(), bytes.begin() + static_cast<std::ptrdiff_t>(cut)), "обрезанное до " + std::to_string(cut));
+    }
+    NodeMessageHeader header;
+    std::memcpy(&header, bytes.data(), sizeof(header));
+    const size_t killsAt = sizeof(NodeMessageHeader) + header.haloCount * sizeof(SnapshotRecord);
+    const size_t offsetsAt = killsAt + header.killCount * sizeof(KillRecord);
+    std::vector<char> broken = bytes;
+    broken[0] = 'X';
+    rejected(broken, "с чужой сигнатурой");
+    broken = bytes;
+    patch(broken, offsetof(NodeMessageHeader, version), NodeMessage::VERSION + 1);
+    rejected(broken, "другой версии");
+    broken = bytes;
+    patch(broken, offsetof(NodeMessageHeader, haloCount), UINT32_MAX);
+    rejected(broken, "с огромным гало");
+    broken = bytes;
+    patch(broken, offsetsAt + sizeof(std::uint32_t), header.nameBytes + 1);
+    rejected(broken, "со смещением имени за блоком");
+    broken = bytes;
+    patch(broken, sizeof(NodeMessageHeader) + offsetof(SnapshotRecord, nameId), header.nameCount);
+    rejected(broken, "с номером имени гало вне таблицы");
+    broken = bytes;
+    patch(broken, sizeof(NodeMessageHeader) + offsetof(SnapshotRecord, type), static_cast<std::uint8_t>(NPC_TYPE_COUNT));
+    rejected(broken, "с неизвестным типом");
+    broken = bytes;
+    patch(broken, killsAt + offsetof(KillRecord, victim), header.nameCount);
+    rejected(broken, "с номером имени убийства вне таблицы");
+}
+
+// Что видит узел: убийства всего мира по порядку и NPC своих шардов
+struct NodeView {
+    std::vector<std::string> kills;
+    std::vector<std::vector<std::string>> shards; // по шардам; чужие - пустые
+};
+
+constexpr int NODE_COLS = 2, NODE_ROWS = 5;
+constexpr double NODE_RANGES[] = {8, 20, 0, 14.5};
+
+// Бои мира (transport == nullptr - без узлов) по одним и тем же NPC
+static NodeView runNode(const std::vector<std::vector<NPCRecord>>& waves, Transport* transport) {
+    std::unique_ptr<World> world = transport ? std::make_unique<World>(NODE_COLS, NODE_ROWS, StorageMode::SOA, *transport, false)
+                                             : std::make_unique<World>(NODE_COLS, NODE_ROWS, StorageMode::SOA, false);
+    KillRecorder recorder;
+    world->addObserver(recorder);
+    size_t wave = 0;
+    bool connected = true;
+    for (double range : NODE_RANGES) {
+        for (const NPCRecord& record : waves[wave++]) {
+            if (world->owns(record.x / World::SHARD_SPAN, record.y / World::SHARD_SPAN)) world->addNPC(record.type, record.name, record.x, record.y);
+        }
+        connected = world->battle(range) && connected;
+    }
+    world->removeObserver(recorder);
+    NodeView view;
+    view.kills = connected ? recorder.kills : std::vector<std::string>{"связь потеряна"};
+    for (int row = 0; row < NODE_ROWS; ++row) {
+        for (int col = 0; col < NODE_COLS; ++col) {
+            view.shards.push_back(world->owns(col, row) ? linesOf(world->shard(col, row).snapshot()) : std::vector<std::string>());
+        }
+    }
+    return view;
+}
+
+// Узлы - потоки одного процесса; каждый должен совпасть с World без узлов по своим шардам
+static void testNodes(std::mt19937& rng) {
+    std::vector<std::vector<NPCRecord>> waves;
+    for (size_t wave = 0; wave < std::size(NODE_RANGES); ++wave) {
+        std::vector<NPCRecord> records = randomRecords(1500, rng);
+        for (NPCRecord& record : records) {
+            record.x = static_cast<int>(rng() % (NODE_COLS * World::SHARD_SPAN));
+            record.y = static_cast<int>(rng() % (NODE_ROWS * World::SHARD_SPAN));
+        }
+        waves.push_back(records);
+    }
+    const NodeView whole = runNode(waves, nullptr);
+
+    auto compare = [&](const std::vector<NodeView>& views, const std::string& what) {
+        bool same = true;
+        for (const NodeView& view : views) same = view.kills == whole.kills && same;
+        for (size_t s = 0; s < whole.shards.size(); ++s) {
+            size_t owners = 0;
+            for (const NodeView& view : views) {
+                if (view.shards[s].empty()) continue;
+                ++owners;
+                same = view.shards[s] == whole.shards[s] && same;
+            }
+            same = owners == (whole.shards[s].empty() ? 0 : 1) && same;
+        }
+        check(same, what + ": узлы видят не тот мир, что World без узлов");
+    };
+    auto runAll = [&](std::vector<std::unique_ptr<Transport>>& transports) {
+        std::vector<NodeView> views(transports.size());
+        std::vector<std::thread> threads;
+        for (size_t k = 0; k < transports.size(); ++k) {
+            threads.emplace_back([&, k] { views[k] = runNode(waves, transports[k].get()); });
+        }
+        for (auto& thread : threads) thread.join();
+        return views;
+    };
+
+    for (size_t nodes : {1, 2, 3}) {
+        LocalHub hub(nodes);
+        std::vector<std::unique_ptr<Transport>> transports;
+        for (size_t k = 0; k < nodes; ++k) transports.push_back(std::make_unique<LocalTransport>(hub, k));
+        compare(runAll(transports), "LocalTransport, узлов " + std::to_string(nodes));
+    }
+
+    // socketpair на каждую пару узлов
+    const size_t nodes = 3;
+    std::vector<std::vector<int>> peers(nodes, std::vector<int>(nodes, -1));
+    for (size_t a = 0; a < nodes; ++a) {
+        for (size_t b = a + 1; b < nodes; ++b) {
+            int pair[2];
+            check(socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0, "socketpair");
+            peers[a][b] = pair[0];
+            peers[b][a] = pair[1];
+        }
+    }
+    std::vector<std::unique_ptr<Transport>> transports;
+    for (size_t k = 0; k < nodes; ++k) transports.push_back(std::make_unique<SocketTransport>(k, peers[k]));
+    compare(runAll(transports), "SocketTransport, узлов 3");
+    for (const auto& row : peers) {
+        for (int fd : row) {
+            if (fd >= 0) close(fd);
+        }
+    }
+}
+
+int main() {
+    std::mt19937 rng(2024);
+    testNodeMessage(rng);
+    testNodes(rng);
+    return finish("node_message_test");
+}
@@ -0,0 +1,84 @@
+// Запросы по индексу (near, nearest, count) в обоих хранилищах против перебора всех
+// живых NPC - после добавлений, боя с неубранными мёртвыми, тактов, уплотнения,
+// загрузки и смены хранилища.
+#include "check.h"
+
+struct Alive {
+    size_t id;
+    NPCType type;
+    int x, y;
+};
+
+static std::vector<Alive> aliveOf(const Dungeon& dungeon) {
+    std::vector<Alive> alive;
+    dungeon.forEachAliveIndexed([&](size_t id, NPCType type, int x, int y) { alive.push_back({id, type, x, y}); });
+    return alive;
+}
+
+static bool queriesMatch(const Dungeon& dungeon, std::mt19937& rng) {
+    const std::vector<Alive> alive = aliveOf(dungeon);
+    bool same = true;
+    for (int query = 0; query < 60; ++query) {
+        const int x = static_cast<int>(rng() % 501), y = static_cast<int>(rng() % 501);
+        const double ranges[] = {0, 1, 7.5, 7.0710678118654755, 40, static_cast<double>(rng() % 120), 800};
+        for (double range : ranges) {
+            std::vector<size_t> expected;
+            for (const Alive& npc : alive) {
+                if (std::sqrt(std::pow(npc.x - x, 2) + std::pow(npc.y - y, 2)) <= range) expected.push_back(npc.id);
+            }
+            std::sort(expected.begin(), expected.end());
+            same = dungeon.near(x, y, range) == expected && same;
+        }
+
+        std::vector<std::pair<long long, size_t>> byDistance;
+        for (const Alive& npc : alive) {
+            const long long dx = npc.x - x, dy = npc.y - y;
+            byDistance.push_back({dx * dx + dy * dy, npc.id});
+        }
+        std::sort(byDistance.begin(), byDistance.end());
+        for (size_t k : {size_t(0), size_t(1), size_t(5), size_t(rng() % 200), alive.size(), alive.size() + 3}) {
+            std::vector<size_t> expected;
+            for (size_t i = 0; i < std::min(k, byDistance.size()); ++i) expected.push_back(byDistance[i].second);
+            same = dungeon.nearest(x, y, k) == expected && same;
+        }
+    }
+    for (size_t type = 0; type < NPC_TYPE_COUNT; ++type) {
+        const auto counted = static_cast<size_t>(
+            std::count_if(alive.begin(), alive.end(), [&](const Alive& npc) { return npc.type == static_cast<NPCType>(type); }));
+        same = dungeon.count(static_cast<NPCType>(type)) == counted && same;
+    }
+    return same;
+}
+
+static void testQueries(std::mt19937& rng, StorageMode mode) {
+    const std::string name = mode == StorageMode::SOA ? "soa" : "objects";
+    Dungeon dungeon(mode, false);
+    dungeon.setCompactionThreshold(1);
+    check(queriesMatch(dungeon, rng), "запросы " + name + ": пустой мир");
+    dungeon.addNPCs(randomRecords(3000, rng));
+    check(queriesMatch(dungeon, rng), "запросы " + name + ": после добавления");
+    dungeon.battle(9);
+    check(queriesMatch(dungeon, rng), "запросы " + name + ": с мёртвыми после боя");
+    for (size_t type = 0; type < NPC_TYPE_COUNT; ++type) dungeon.setSpeed(static_cast<NPCType>(type), 4);
+    dungeon.tick(5);
+    dungeon.tick(5);
+    check(queriesMatch(dungeon, rng), "запросы " + name + ": после тактов");
+    dungeon.addNPC(NPCType::KNIGHT, "corner", 500, 500);
+    dungeon.addNPC(NPCType::PRINCESS, "origin", 0, 0);
+    dungeon.compact();
+    check(queriesMatch(dungeon, rng), "запросы " + name + ": после уплотнения");
+    const std::string file = "query_test_" + name + ".txt";
+    dungeon.saveToFile(file);
+    dungeon.addNPCs(randomRecords(500, rng));
+    check(dungeon.loadFromFile(file).empty() && queriesMatch(dungeon, rng), "запросы " + name + ": после загрузки");
+    dungeon.addNPCs(randomRecords(700, rng));
+    dungeon.setStorageMode(mode == StorageMode::SOA ? StorageMode::OBJECTS : StorageMode::SOA);
+    check(queriesMatch(dungeon, rng), "запросы " + name + ": после смены хранилища");
+}
+
+int main() {
+    std::mt19937 rng(2024);
+    testQueries(rng, StorageMode::OBJECTS);
+    testQueries(rng, StorageMode::SOA);
+    return finish("query_test");
+}
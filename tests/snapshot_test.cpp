@@ -0,0 +1,83 @@
+// Двоичный снимок (Snapshot): круг запись-чтение, каждое обрезанное чтение и
+// испорченные сигнатура, версия, счётчики, смещения имён, номера имён, координаты и типы.
+#include "check.h"
+
+static void testSnapshot(std::mt19937& rng) {
+    const std::string file = "snapshot_test.bin";
+    NPCStore original;
+    for (const auto& record : randomRecords(40, rng)) original.add(record.type, record.name, record.x, record.y);
+    for (size_t i = 0; i < original.size(); i += 3) original.alive[i] = 0; // мёртвые в файл не попадают
+
+    SnapshotHeader written;
+    check(Snapshot::save(file, original, &written), "снимок: запись");
+    NPCStore loaded;
+    SnapshotHeader read;
+    check(Snapshot::load(file, loaded, &read), "снимок: чтение");
+    check(linesOf(loaded) == linesOf(original), "снимок: NPC после круга");
+    check(read.recordCount == written.recordCount && read.nameBytes == written.nameBytes, "снимок: заголовок после круга");
+
+    const std::vector<char> bytes = readBytes(file);
+    const size_t kept = loaded.size();
+    // при любой ошибке store остаётся прежним
+    auto rejected = [&](const std::vector<char>& broken, const std::string& what) {
+        writeBytes(file, broken);
+        check(!Snapshot::load(file, loaded) && loaded.size() == kept, "снимок: принят " + what);
+    };
+    for (size_t cut = 0; cut < bytes.size(); ++cut) {
+        rejected(std::vector<char>(bytes.begin(), bytes.begin() + static_cast<std::ptrdiff_t>(cut)), "обрезанный до " + std::to_string(cut));
+    }
+    std::vector<char> longer = bytes;
+    longer.push_back('x');
+    rejected(longer, "с лишним байтом");
+
+    const size_t offsetsAt = sizeof(SnapshotHeader) + read.recordCount * sizeof(SnapshotRecord);
+    const size_t charsAt = offsetsAt + (read.nameCount + 1) * sizeof(std::uint32_t);
+    std::vector<char> broken = bytes;
+    broken[0] = 'X';
+    rejected(broken, "с чужой сигнатурой");
+    broken = bytes;
+    patch(broken, offsetof(SnapshotHeader, version), Snapshot::VERSION + 1);
+    rejected(broken, "другой версии");
+    broken = bytes;
+    patch(broken, offsetof(SnapshotHeader, recordCount), std::uint64_t(1) << 62);
+    rejected(broken, "с огромным числом записей");
+    broken = bytes;
+    patch(broken, offsetsAt + sizeof(std::uint32_t), static_cast<std::uint32_t>(read.nameBytes + 1));
+    rejected(broken, "со смещением имени за блоком");
+    broken = bytes;
+    patch(broken, charsAt - sizeof(std::uint32_t), std::uint32_t(0));
+    rejected(broken, "с убывающими смещениями");
+    broken = bytes;
+    patch(broken, offsetsAt, std::uint32_t(1));
+    rejected(broken, "с ненулевым первым смещением");
+    broken = bytes;
+    patch(broken, sizeof(SnapshotHeader) + offsetof(SnapshotRecord, nameId), static_cast<std::uint32_t>(read.nameCount));
+    rejected(broken, "с номером имени вне таблицы");
+    broken = bytes;
+    patch(broken, sizeof(SnapshotHeader) + offsetof(SnapshotRecord, x), std::int16_t(501));
+    rejected(broken, "с координатой вне карты");
+    broken = bytes;
+    patch(broken, sizeof(SnapshotHeader) + offsetof(SnapshotRecord, type), static_cast<std::uint8_t>(NPC_TYPE_COUNT));
+    rejected(broken, "с неизвестным типом");
+
+    // огромные счётчики не должны ни переполнить проверку размеров, ни дойти до выделения
+    std::vector<char> header(bytes.begin(), bytes.begin() + sizeof(SnapshotHeader));
+    header.resize(104, 0);
+    const std::uint64_t huge[][3] = {{0, 26, ~std::uint64_t(0) - 43}, {0, ~std::uint64_t(0) / 4, 8},
+                                     {0, ~std::uint64_t(0), 0}, {~std::uint64_t(0) / 12, 0, 64}, {0, 0, ~std::uint64_t(0)}};
+    for (const auto& counts : huge) {
+        broken = header;
+        patch(broken, offsetof(SnapshotHeader, recordCount), counts[0]);
+        patch(broken, offsetof(SnapshotHeader, nameCount), counts[1]);
+        patch(broken, offsetof(SnapshotHeader, nameBytes), counts[2]);
+        rejected(broken, "с огромными счётчиками " + std::to_string(counts[0]) + " " + std::to_string(counts[1]) + " " +
+                             std::to_string(counts[2]));
+    }
+    std::filesystem::remove(file);
+}
+
+int main() {
+    std::mt19937 rng(2024);
+    testSnapshot(rng);
+    return finish("snapshot_test");
+}
@@ -0,0 +1,150 @@
+// Версии мира (WorldVersion, snapshot/restore, undo): версия не меняется вместе с миром,
+// а restore к любой из них - в любом порядке, через уплотнение и загрузку - возвращает
+// те же NPC, счётчики и такты; следующие бои после restore - как у мира без отмен.
+#include "check.h"
+
+#include <sstream>
+
+static void writeLines(const std::string& filename, const std::vector<NPCRecord>& records) {
+    std::ofstream out(filename, std::ios::trunc);
+    for (const NPCRecord& record : records) {
+        out << NPCFactory::typeKeyword(record.type) << ' ' << record.name << ' ' << record.x << ' ' << record.y << '\n';
+    }
+}
+
+struct Saved {
+    WorldVersion version;
+    std::vector<std::string> lines;
+    size_t counts[NPC_TYPE_COUNT];
+    std::uint64_t ticks;
+};
+
+static Saved remember(Dungeon& dungeon) {
+    Saved saved{dungeon.snapshot(), linesOf(dungeon), {}, dungeon.getTicks()};
+    for (size_t type = 0; type < NPC_TYPE_COUNT; ++type) saved.counts[type] = dungeon.count(static_cast<NPCType>(type));
+    return saved;
+}
+
+static bool matches(const Dungeon& dungeon, const Saved& saved) {
+    bool same = linesOf(dungeon) == saved.lines && dungeon.getTicks() == saved.ticks;
+    for (size_t type = 0; type < NPC_TYPE_COUNT; ++type) same = dungeon.count(static_cast<NPCType>(type)) == saved.counts[type] && same;
+    return same;
+}
+
+static void testVersions(std::mt19937& rng, StorageMode mode) {
+    const std::string name = mode == StorageMode::SOA ? "soa" : "objects";
+    const std::string file = "version_test_" + name + ".txt";
+    Dungeon dungeon(mode, false);
+    dungeon.setCompactionThreshold(0.5);
+    for (size_t type = 0; type < NPC_TYPE_COUNT; ++type) dungeon.setSpeed(static_cast<NPCType>(type), 3);
+    std::vector<Saved> history;
+    history.push_back(remember(dungeon));
+    dungeon.addNPCs(randomRecords(2500, rng));
+    history.push_back(remember(dungeon));
+    dungeon.battle(6);
+    history.push_back(remember(dungeon));
+    dungeon.tick(5);
+    dungeon.tick(5);
+    history.push_back(remember(dungeon));
+    dungeon.addNPC(NPCType::DRAGON, "late", 10, 10);
+    dungeon.battle(12);
+    history.push_back(remember(dungeon));
+    dungeon.compact();
+    dungeon.addNPCs(randomRecords(400, rng));
+    history.push_back(remember(dungeon));
+    writeLines(file, randomRecords(700, rng));
+    dungeon.loadFromFile(file);
+    history.push_back(remember(dungeon));
+
+    // версии не задеты последующими изменениями мира
+    bool unchanged = true;
+    for (const Saved& saved : history) unchanged = linesOf(saved.version) == saved.lines && saved.version.getTicks() == saved.ticks && unchanged;
+    check(unchanged, "версии " + name + ": версия изменилась вместе с миром");
+
+    // restore в случайном порядке, в том числе к той же версии подряд и с изменениями между
+    bool restored = true;
+    for (int step = 0; step < 40; ++step) {
+        const Saved& saved = history[rng() % history.size()];
+        dungeon.restore(saved.version);
+        restored = matches(dungeon, saved) && restored;
+        if (step % 3 == 0) dungeon.battle(static_cast<double>(rng() % 15));
+        if (step % 5 == 0) dungeon.tick(4);
+        if (step % 7 == 0) dungeon.compact();
+    }
+    check(restored, "версии " + name + ": restore вернул не тот мир");
+    for (const Saved& saved : history) unchanged = linesOf(saved.version) == saved.lines && unchanged;
+    check(unchanged, "версии " + name + ": restore изменил версию");
+
+    // restore на месте: версии одной раскладки (без уплотнения и добавлений - restore к
+    // версии с меньшим числом записей меняет раскладку), между ними бои и такты;
+    // к той же версии подряд - переписать надо только изменённое после неё
+    dungeon.setCompactionThreshold(1);
+    dungeon.addNPCs(randomRecords(1500, rng));
+    std::vector<Saved> layout{remember(dungeon)};
+    dungeon.battle(3);
+    layout.push_back(remember(dungeon));
+    dungeon.tick(6);
+    layout.push_back(remember(dungeon));
+    dungeon.battle(10);
+    layout.push_back(remember(dungeon));
+    bool inPlace = true;
+    for (int step = 0; step < 40; ++step) {
+        const Saved& saved = layout[rng() % layout.size()];
+        for (int again = 0; again < 2; ++again) {
+            dungeon.restore(saved.version);
+            inPlace = matches(dungeon, saved) && inPlace;
+            if (step % 2 == 0) dungeon.battle(static_cast<double>(rng() % 15));
+            else dungeon.tick(4);
+        }
+    }
+    check(inPlace, "версии " + name + ": restore на месте вернул не тот мир");
+    dungeon.setCompactionThreshold(0.5);
+
+    // бой после restore - как бой подземелья, собранного из тех же NPC
+    const Saved& start = history[3];
+    dungeon.restore(start.version);
+    dungeon.battle(20);
+    Dungeon fresh(mode, false);
+    std::vector<NPCRecord> records;
+    start.version.forEachAlive([&](NPCType type, std::string_view npcName, int x, int y) { records.push_back({type, std::string(npcName), x, y}); });
+    fresh.addNPCs(records);
+    fresh.battle(20);
+    check(linesOf(dungeon) == linesOf(fresh), "версии " + name + ": бой после restore не как у нового мира");
+
+    // сохранение старой версии - как сохранение мира, возвращённого к ней
+    Dungeon::saveVersion(file + ".old", history[2].version);
+    dungeon.restore(history[2].version);
+    dungeon.saveToFile(file);
+    check(readBytes(file) == readBytes(file + ".old"), "версии " + name + ": saveVersion не как save после restore");
+}
+
+// undo в REPL отменяет battle, tick, load и loadbin по одному, до UNDO_DEPTH шагов
+static void testUndo(std::mt19937& rng) {
+    Dungeon dungeon(StorageMode::SOA, false);
+    dungeon.addNPCs(randomRecords(1500, rng));
+    writeLines("version_test_load.txt", randomRecords(300, rng));
+    std::vector<std::vector<std::string>> states{linesOf(dungeon)};
+    CommandRunner runner(dungeon);
+    std::ostringstream ignored;
+    std::streambuf* previous = std::cout.rdbuf(ignored.rdbuf());
+    for (const char* command : {"battle 7", "speed dragon 4", "tick 2 5", "battle 15", "load version_test_load.txt", "battle 30"}) {
+        runner.runScript(command);
+        if (std::string(command).rfind("speed", 0) != 0) states.push_back(linesOf(dungeon));
+    }
+    bool same = true;
+    for (size_t k = states.size() - 1; k > 0; --k) {
+        runner.runScript("undo");
+        same = linesOf(dungeon) == states[k - 1] && same;
+    }
+    runner.runScript("undo");
+    std::cout.rdbuf(previous);
+    check(same && ignored.str().find("Нечего отменять") != std::string::npos, "undo: шаги отменены не по порядку");
+}
+
+int main() {
+    std::mt19937 rng(2024);
+    testVersions(rng, StorageMode::OBJECTS);
+    testVersions(rng, StorageMode::SOA);
+    testUndo(rng);
+    return finish("version_test");
+}
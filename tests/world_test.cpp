@@ -0,0 +1,161 @@
+// Мир из шардов (World) против перебора: фаза 1 - исходный бой в каждом шарде, фаза 2 -
+// пары из разных шардов по всему миру в порядке шардов. Гало не должно терять ни одной
+// пары у краёв; итог не зависит от числа потоков, хранилища и движка шардов.
+#include "check.h"
+
+struct Setup {
+    int cols, rows;
+    StorageMode mode;
+    BattleEngine engine;
+    size_t threads;
+};
+
+static std::string describe(const Setup& setup) {
+    static const char* engines[] = {"visitor", "table", "simd", "gpu"};
+    return std::to_string(setup.cols) + "x" + std::to_string(setup.rows) + "/" +
+           (setup.mode == StorageMode::SOA ? "soa" : "objects") + "/" + engines[static_cast<int>(setup.engine)] + "/потоков " +
+           std::to_string(setup.threads);
+}
+
+// Образец World: шарды - списки Fighter в локальных координатах
+class ReferenceWorld {
+    int cols;
+    std::vector<std::vector<Fighter>> shards;
+
+public:
+    ReferenceWorld(int cols, int rows) : cols(cols), shards(static_cast<size_t>(cols) * rows) {}
+
+    void add(const NPCRecord& record) {
+        const size_t s = static_cast<size_t>(record.y / World::SHARD_SPAN) * cols + record.x / World::SHARD_SPAN;
+        shards[s].push_back({record.type, record.name, record.x % World::SHARD_SPAN, record.y % World::SHARD_SPAN, true, s});
+    }
+
+    void battle(double range, std::vector<std::string>& kills) {
+        for (auto& shard : shards) referenceBattle(shard, range, kills);
+        if (range < 0 || shards.size() < 2) return;
+        std::vector<Fighter> all;
+        for (size_t s = 0; s < shards.size(); ++s) {
+            for (Fighter fighter : shards[s]) {
+                fighter.x += static_cast<int>(s % cols) * World::SHARD_SPAN;
+                fighter.y += static_cast<int>(s / cols) * World::SHARD_SPAN;
+                all.push_back(fighter);
+            }
+            shards[s].clear();
+        }
+        referenceBattle(all, range, kills, true);
+        for (Fighter fighter : all) {
+            fighter.x %= World::SHARD_SPAN;
+            fighter.y %= World::SHARD_SPAN;
+            shards[fighter.shard].push_back(fighter);
+        }
+    }
+
+    const std::vector<Fighter>& shard(int col, int row) const { return shards[static_cast<size_t>(row) * cols + col]; }
+};
+
+// NPC по всему миру, половина - у краёв шардов (в том числе у углов)
+static std::vector<NPCRecord> scattered(const Setup& setup, size_t count, size_t& serial, std::mt19937& rng) {
+    std::vector<NPCRecord> records;
+    const int width = setup.cols * World::SHARD_SPAN, height = setup.rows * World::SHARD_SPAN;
+    auto nearEdge = [&](int size) {
+        const int edge = static_cast<int>(rng() % (size / World::SHARD_SPAN + 1)) * World::SHARD_SPAN;
+        return std::clamp(edge + static_cast<int>(rng() % 41) - 20, 0, size - 1);
+    };
+    for (size_t i = 0; i < count; ++i) {
+        int x = static_cast<int>(rng() % width), y = static_cast<int>(rng() % height);
+        if (i % 2 == 0) x = nearEdge(width);
+        if (i % 3 == 0) y = nearEdge(height);
+        records.push_back({static_cast<NPCType>(rng() % NPC_TYPE_COUNT), "w" + std::to_string(serial++), x, y});
+    }
+    return records;
+}
+
+// Пары через каждый внутренний край на расстоянии ровно floor(range): слева от края
+// от 1 до floor(range) клеток - гало уже нужного сразу теряет крайние из них
+static std::vector<NPCRecord> acrossEdges(const Setup& setup, double range, size_t& serial) {
+    std::vector<NPCRecord> records;
+    const int reach = static_cast<int>(range), step = 2 * reach + 5;
+    if (reach < 1 || reach > 40) return records;
+    auto pair = [&](int x1, int y1, int x2, int y2, int k) {
+        const NPCType killer = k % 2 ? NPCType::KNIGHT : NPCType::DRAGON, victim = k % 2 ? NPCType::DRAGON : NPCType::PRINCESS;
+        records.push_back({killer, "e" + std::to_string(serial++), x1, y1});
+        records.push_back({victim, "e" + std::to_string(serial++), x2, y2});
+    };
+    for (int k = 0; k < reach; ++k) {
+        const int along = 10 + k * step;
+        for (int col = 1; col < setup.cols && along < setup.rows * World::SHARD_SPAN; ++col) {
+            const int edge = col * World::SHARD_SPAN;
+            pair(edge - 1 - k, along, edge - 1 - k + reach, along, k);
+        }
+        for (int row = 1; row < setup.rows && along < setup.cols * World::SHARD_SPAN; ++row) {
+            const int edge = row * World::SHARD_SPAN;
+            pair(along, edge - 1 - k + reach, along, edge - 1 - k, k + 1);
+        }
+    }
+    return records;
+}
+
+static void testSetup(const Setup& setup) {
+    std::mt19937 rng(11);
+    size_t serial = 0;
+    World world(setup.cols, setup.rows, setup.mode, false);
+    world.setBattleEngine(setup.engine);
+    world.setThreads(setup.threads);
+    KillRecorder recorder;
+    world.addObserver(recorder);
+    ReferenceWorld reference(setup.cols, setup.rows);
+    std::vector<std::string> expectedKills;
+
+    bool same = true;
+    for (double range : {6.0, 12.5, 0.0, 30.0, 260.0}) {
+        std::vector<NPCRecord> records = scattered(setup, 600, serial, rng);
+        const std::vector<NPCRecord> edges = acrossEdges(setup, range, serial);
+        records.insert(records.end(), edges.begin(), edges.end());
+        for (const NPCRecord& record : records) {
+            world.addNPC(record.type, record.name, record.x, record.y);
+            reference.add(record);
+        }
+        world.battle(range);
+        reference.battle(range, expectedKills);
+        same = recorder.kills == expectedKills && same;
+        for (int row = 0; row < setup.rows; ++row) {
+            for (int col = 0; col < setup.cols; ++col) {
+                same = linesOf(world.shard(col, row).snapshot()) == linesOf(reference.shard(col, row)) && same;
+            }
+        }
+    }
+    check(same, "мир " + describe(setup) + ": не как в переборе");
+    world.removeObserver(recorder);
+}
+
+// Мир из одного шарда - то же подземелье
+static void testSingleShard(std::mt19937& rng) {
+    const std::vector<NPCRecord> records = randomRecords(1500, rng);
+    World world(1, 1, StorageMode::SOA, false);
+    Dungeon dungeon(StorageMode::SOA, false);
+    KillRecorder worldKills, dungeonKills;
+    world.addObserver(worldKills);
+    dungeon.addObserver(dungeonKills);
+    for (const NPCRecord& record : records) world.addNPC(record.type, record.name, record.x, record.y);
+    dungeon.addNPCs(records);
+    world.battle(15);
+    dungeon.battle(15);
+    check(worldKills.kills == dungeonKills.kills && linesOf(world.shard(0, 0).snapshot()) == linesOf(dungeon.snapshot()),
+          "мир 1x1: не как подземелье");
+    world.removeObserver(worldKills);
+    dungeon.removeObserver(dungeonKills);
+}
+
+int main() {
+    std::mt19937 rng(2024);
+    testSingleShard(rng);
+    for (auto [cols, rows] : {std::pair<int, int>{1, 1}, {3, 2}, {1, 4}}) {
+        for (StorageMode mode : {StorageMode::OBJECTS, StorageMode::SOA}) {
+            for (BattleEngine engine : {BattleEngine::TABLE, BattleEngine::SIMD}) {
+                for (size_t threads : {1, 3}) testSetup({cols, rows, mode, engine, threads});
+            }
+        }
+    }
+    testSetup({2, 2, StorageMode::OBJECTS, BattleEngine::VISITOR, 2});
+    return finish("world_test");
+}